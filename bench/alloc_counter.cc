@@ -0,0 +1,29 @@
+#include <cstdlib>
+#include <new>
+#include "../include/profiling.h"
+
+// Counting replacements of the global allocation functions, for the allocs
+// columns of bench and --profile. Link this file into a program to turn the
+// counting on; it is opt-in because every allocation then pays an atomic
+// increment. They are kept out of line so GCC doesn't pair an inlined
+// free() with the builtin operator new.
+namespace {
+  const bool g_registered = (common::profile::g_counting_allocations = true);
+}
+
+__attribute__((noinline)) void *operator new(std::size_t size) {
+  common::profile::g_allocations.fetch_add(1, std::memory_order_relaxed);
+  ++common::profile::t_allocations;
+  if (void *p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+__attribute__((noinline)) void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  common::profile::g_allocations.fetch_add(1, std::memory_order_relaxed);
+  ++common::profile::t_allocations;
+  return std::malloc(size ? size : 1);
+}
+__attribute__((noinline)) void operator delete(void *p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, const std::nothrow_t &) noexcept {
+  std::free(p);
+}
@@ -0,0 +1,556 @@
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <nlohmann/json.hpp>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../include/common.h"
+#include "../include/csv_decoder.h"
+#include "../include/data_structures.h"
+#include "../include/json_decoder.h"
+#include "../include/lod.h"
+#include "../include/mcap.h"
+#include "../include/parallel_query.h"
+#include "../include/pipeline.h"
+#include "../include/pointcloud.h"
+#include "../include/predicate.h"
+#include "../include/profiling.h"
+#include "../include/replay.h"
+#include "../include/schema.h"
+#include "../include/stats.h"
+#include "../include/streaming.h"
+#include "../include/utilities.h"
+#include "../include/voxel_grid.h"
+
+namespace {
+  struct BenchResult {
+    std::string name;
+    size_t bytes;
+    size_t records;
+    double seconds;
+    size_t allocations;
+
+    double mb_per_s() const { return bytes / seconds / 1e6; }
+    double records_per_s() const { return records / seconds; }
+    double allocs_per_record() const {
+      return records ? double(allocations) / double(records) : 0.0;
+    }
+  };
+
+  struct BenchOptions {
+    bool json = false;
+    size_t iterations = 5;
+    size_t scale = 1;
+    std::string filter;
+  };
+
+  // Best-of-N wall time after one warm-up run; allocations are taken from the
+  // last run, as counted by the operator new in bench/alloc_counter.cc.
+  BenchResult run_case(const BenchOptions &opts, const std::string &name,
+                       size_t bytes, size_t records,
+                       const std::function<void()> &fn) {
+    fn();
+    double best = 1e300;
+    size_t allocs = 0;
+    for (size_t i = 0; i < opts.iterations; ++i) {
+      size_t a0 = common::profile::allocations();
+      auto t0 = std::chrono::steady_clock::now();
+      fn();
+      auto t1 = std::chrono::steady_clock::now();
+      allocs = common::profile::allocations() - a0;
+      best = std::min(best, std::chrono::duration<double>(t1 - t0).count());
+    }
+    return {name, bytes, records, std::max(best, 1e-9), allocs};
+  }
+
+  // --- synthetic payloads ---------------------------------------------------
+
+  struct ImuSample {
+    int64_t ts_ns;
+    double x, y, z;
+  };
+
+  std::vector<ImuSample> make_imu(size_t n) {
+    std::mt19937_64 rng(42);
+    std::normal_distribution<double> acc(0.0, 6.0);
+    std::vector<ImuSample> out(n);
+    int64_t ts = 1'709'997'000'000'000'000LL;
+    for (auto &s : out) {
+      ts += 2'500'000;  // 400 Hz
+      s = {ts, acc(rng), acc(rng), acc(rng) - 9.81};
+    }
+    return out;
+  }
+
+  std::string make_csv(const std::vector<ImuSample> &rows) {
+    std::string out = "ts_ns,linear_acceleration_x,linear_acceleration_y,"
+                      "linear_acceleration_z\n";
+    char buf[128];
+    for (const auto &r : rows) {
+      int n = std::snprintf(buf, sizeof(buf), "%lld,%.9f,%.9f,%.9f\n",
+                            static_cast<long long>(r.ts_ns), r.x, r.y, r.z);
+      out.append(buf, size_t(n));
+    }
+    return out;
+  }
+
+  std::string make_json_rows(const std::vector<ImuSample> &rows) {
+    std::string out = "[";
+    char buf[256];
+    for (size_t i = 0; i < rows.size(); ++i) {
+      const auto &r = rows[i];
+      int n = std::snprintf(
+          buf, sizeof(buf),
+          "%s{\"ts_ns\":%lld,\"linear_acceleration_x\":%.9f,"
+          "\"linear_acceleration_y\":%.9f,\"linear_acceleration_z\":%.9f}",
+          i ? "," : "", static_cast<long long>(r.ts_ns), r.x, r.y, r.z);
+      out.append(buf, size_t(n));
+    }
+    out += "]";
+    return out;
+  }
+
+  // One sensor_msgs/Imu message per record, as the ros.extract extension
+  // returns it.
+  std::vector<std::string> make_ros_messages(const std::vector<ImuSample> &rows) {
+    std::vector<std::string> out;
+    out.reserve(rows.size());
+    char buf[1024];
+    for (const auto &r : rows) {
+      int n = std::snprintf(
+          buf, sizeof(buf),
+          "{\"header\":{\"stamp\":{\"sec\":%lld,\"nanosec\":%lld},"
+          "\"frame_id\":\"vectornav\"},"
+          "\"orientation\":{\"x\":0.01,\"y\":-0.02,\"z\":0.7,\"w\":0.71},"
+          "\"orientation_covariance\":[0.0001,0,0,0,0.0001,0,0,0,0.0001],"
+          "\"angular_velocity\":{\"x\":0.001,\"y\":0.002,\"z\":-0.003},"
+          "\"angular_velocity_covariance\":[0.0001,0,0,0,0.0001,0,0,0,0.0001],"
+          "\"linear_acceleration\":{\"x\":%.9f,\"y\":%.9f,\"z\":%.9f},"
+          "\"linear_acceleration_covariance\":[0.01,0,0,0,0.01,0,0,0,0.01]}",
+          static_cast<long long>(r.ts_ns / 1'000'000'000LL),
+          static_cast<long long>(r.ts_ns % 1'000'000'000LL), r.x, r.y, r.z);
+      out.emplace_back(buf, size_t(n));
+    }
+    return out;
+  }
+
+  // Packed {x, y, z, intensity} scan with ~10% no-return (NaN) points, the
+  // layout of the demo lidar entry.
+  std::string make_point_cloud(size_t n) {
+    std::mt19937_64 rng(7);
+    std::uniform_real_distribution<float> pos(-50.0f, 50.0f);
+    std::uniform_real_distribution<float> inten(0.0f, 3000.0f);
+    std::vector<common::PointData> pts(n);
+    for (size_t i = 0; i < n; ++i) {
+      if (i % 10 == 3) {
+        pts[i] = {NAN, NAN, NAN, 0.0f};
+      } else {
+        pts[i] = {pos(rng), pos(rng), pos(rng) * 0.1f, inten(rng)};
+      }
+    }
+    return std::string(reinterpret_cast<const char *>(pts.data()),
+                       n * sizeof(common::PointData));
+  }
+
+  template <typename T> void keep(const T &value) {
+    asm volatile("" : : "g"(&value) : "memory");
+  }
+
+  // --- output ---------------------------------------------------------------
+
+  void print_table(const std::vector<BenchResult> &results) {
+    std::cout << std::left << std::setw(28) << "case" << std::right
+              << std::setw(12) << "MB/s" << std::setw(16) << "records/s"
+              << std::setw(14) << "allocs/rec" << "\n";
+    std::cout << std::string(70, '-') << "\n";
+    for (const auto &r : results) {
+      std::cout << std::left << std::setw(28) << r.name << std::right
+                << std::fixed << std::setprecision(1) << std::setw(12)
+                << r.mb_per_s() << std::setw(16) << std::setprecision(0)
+                << r.records_per_s() << std::setw(14) << std::setprecision(3)
+                << r.allocs_per_record() << "\n";
+    }
+  }
+
+  void print_json(const std::vector<BenchResult> &results) {
+    nlohmann::json out = nlohmann::json::array();
+    for (const auto &r : results) {
+      out.push_back({{"name", r.name},
+                     {"bytes", r.bytes},
+                     {"records", r.records},
+                     {"seconds", r.seconds},
+                     {"mb_per_s", r.mb_per_s()},
+                     {"records_per_s", r.records_per_s()},
+                     {"allocs_per_record", r.allocs_per_record()}});
+    }
+    std::cout << out.dump(2) << "\n";
+  }
+
+  BenchOptions parse_args(int argc, char **argv) {
+    BenchOptions opts;
+    for (int i = 1; i < argc; ++i) {
+      std::string_view arg = argv[i];
+      if (arg == "--json") {
+        opts.json = true;
+      } else if (arg == "--iterations" && i + 1 < argc) {
+        opts.iterations = std::max(1, std::atoi(argv[++i]));
+      } else if (arg == "--scale" && i + 1 < argc) {
+        opts.scale = std::max(1, std::atoi(argv[++i]));
+      } else if (arg == "--filter" && i + 1 < argc) {
+        opts.filter = argv[++i];
+      } else {
+        std::cerr << "usage: bench [--json] [--iterations N] [--scale N] "
+                     "[--filter SUBSTR]\n";
+        std::exit(2);
+      }
+    }
+    return opts;
+  }
+}
+
+int main(int argc, char **argv) {
+  const BenchOptions opts = parse_args(argc, argv);
+  std::vector<BenchResult> results;
+  auto add = [&](const std::string &name, size_t bytes, size_t records,
+                 const std::function<void()> &fn) {
+    if (!opts.filter.empty() && name.find(opts.filter) == std::string::npos) {
+      return;
+    }
+    results.push_back(run_case(opts, name, bytes, records, fn));
+  };
+
+  // ~20 MB of CSV/JSON rows, ~100 MB of ROS messages, 8 scans of 128k points.
+  const auto imu = make_imu(250'000 * opts.scale);
+  const std::string csv = make_csv(imu);
+  const std::string json_rows = make_json_rows(imu);
+  const auto ros = make_ros_messages(imu);
+  size_t ros_bytes = 0;
+  for (const auto &m : ros) ros_bytes += m.size();
+  std::vector<std::string> scans;
+  for (int i = 0; i < 8; ++i) scans.push_back(make_point_cloud(131'072 * opts.scale));
+  const size_t scan_points = scans.size() * scans[0].size() / sizeof(common::PointData);
+
+  common::AccelerationFrame frame;
+  frame.reserve(imu.size());
+
+  add("csv/decode", csv.size(), imu.size(), [&] {
+    frame.clear();
+    common::decode_csv(csv, true, frame);
+    keep(frame);
+  });
+
+  add("csv/schema", csv.size(), imu.size(), [&] {
+    frame.clear();
+    common::ImuSchema::decode_csv(
+        csv, true, [&](const common::AccelerationData &row) { frame.push_back(row); });
+    keep(frame);
+  });
+
+  add("csv/stream_64k", csv.size(), imu.size(), [&] {
+    frame.clear();
+    auto sink = [&](const common::AccelerationData &row) { frame.push_back(row); };
+    auto on_error = [](size_t, std::string_view, common::CsvStatus) {};
+    common::CsvStreamDecoder<decltype(sink), decltype(on_error)> dec(true, sink, on_error);
+    for (size_t i = 0; i < csv.size(); i += 65536) {
+      dec.feed(std::string_view(csv).substr(i, 65536));
+    }
+    dec.finish();
+    keep(frame);
+  });
+
+  add("json_rows/sax", json_rows.size(), imu.size(), [&] {
+    frame.clear();
+    common::decode_json(json_rows, common::select_columns_schema(), frame);
+    keep(frame);
+  });
+
+  add("json_rows/schema", json_rows.size(), imu.size(), [&] {
+    frame.clear();
+    common::decode_json(json_rows, common::ImuSchema{},
+                        [&](const common::AccelerationData &row) { frame.push_back(row); });
+    keep(frame);
+  });
+
+  add("json_rows/stream_64k", json_rows.size(), imu.size(), [&] {
+    frame.clear();
+    auto sink = [&](const common::AccelerationData &row) { frame.push_back(row); };
+    common::JsonStreamDecoder<decltype(sink)> dec(common::select_columns_schema(), sink);
+    for (size_t i = 0; i < json_rows.size(); i += 65536) {
+      dec.feed(std::string_view(json_rows).substr(i, 65536));
+    }
+    dec.finish();
+    keep(frame);
+  });
+
+  add("json_rows/dom", json_rows.size(), imu.size(), [&] {
+    frame.clear();
+    auto rows = nlohmann::json::parse(json_rows);
+    for (const auto &row : rows) {
+      frame.push_back({row["ts_ns"].get<int64_t>(),
+                       row["linear_acceleration_x"].get<double>(),
+                       row["linear_acceleration_y"].get<double>(),
+                       row["linear_acceleration_z"].get<double>()});
+    }
+    keep(frame);
+  });
+
+  add("ros_json/sax", ros_bytes, ros.size(), [&] {
+    frame.clear();
+    for (const auto &m : ros) {
+      common::decode_json(m, common::ros_imu_schema(), frame);
+    }
+    keep(frame);
+  });
+
+  add("ros_json/dom", ros_bytes, ros.size(), [&] {
+    frame.clear();
+    for (const auto &m : ros) {
+      auto data = nlohmann::json::parse(m);
+      int64_t sec = data["header"]["stamp"]["sec"].get<int64_t>();
+      int64_t nsec = data["header"]["stamp"]["nanosec"].get<int64_t>();
+      frame.push_back({sec * 1'000'000'000LL + nsec,
+                       data["linear_acceleration"]["x"].get<double>(),
+                       data["linear_acceleration"]["y"].get<double>(),
+                       data["linear_acceleration"]["z"].get<double>()});
+    }
+    keep(frame);
+  });
+
+  // The same messages as CDR in one MCAP file, the raw form of the mcap
+  // entry, with each chunk compression this build supports. Each file is
+  // read back once first; a writer/reader mismatch fails the run.
+  for (const std::string compression : {"", "lz4", "zstd"}) {
+    if (!common::mcap::supports(compression)) continue;
+    common::mcap::Writer writer(compression);
+    const auto channel = writer.add_channel(
+        writer.add_schema("sensor_msgs/msg/Imu", "ros2msg", ""), "/vectornav/IMU", "cdr");
+    std::string msg;
+    bool written = !writer.write(uint16_t(channel + 1), 0, msg);  // not a channel
+    for (const auto &r : imu) {
+      common::encode_cdr_imu({r.ts_ns, r.x, r.y, r.z}, msg, "vectornav");
+      written = writer.write(channel, uint64_t(r.ts_ns), msg) && written;
+    }
+    const std::string file = writer.finish();
+    common::McapReader reader({"/vectornav/IMU"});
+    size_t matching = 0;
+    auto check = common::decode_mcap_imu(file, reader, [&](const common::AccelerationData &row) {
+      const auto &r = imu[std::min(matching, imu.size() - 1)];
+      if (row.ts_ns == r.ts_ns && row.linear_acceleration_x == r.x &&
+          row.linear_acceleration_y == r.y && row.linear_acceleration_z == r.z) {
+        ++matching;
+      }
+    });
+    if (!written || check.status != common::McapStatus::kOk || check.messages != imu.size() ||
+        check.rows != imu.size() || check.bad_messages != 0 || matching != imu.size()) {
+      std::cerr << "mcap round trip failed (" << (compression.empty() ? "none" : compression)
+                << "): " << common::to_string(check.status) << ", " << check.rows << "/"
+                << imu.size() << " rows, " << check.bad_messages << " bad, " << matching
+                << " matching\n";
+      return 1;
+    }
+    add("ros_cdr/mcap" + (compression.empty() ? "" : "_" + compression), file.size(),
+        imu.size(), [&] {
+          frame.clear();
+          common::decode_mcap_imu(
+              file, reader, [&](const common::AccelerationData &row) { frame.push_back(row); });
+          keep(frame);
+        });
+  }
+
+  add("pointcloud/view+stats", scan_points * sizeof(common::PointData),
+      scan_points, [&] {
+        for (const auto &blob : scans) {
+          auto view = common::PointCloudView::from_blob(blob);
+          auto st = common::point_cloud_stats(view.points());
+          keep(st);
+        }
+      });
+
+  // The same points in a 48-byte Ouster-style layout (float intensity at 16,
+  // then time/reflectivity/ring), native and byte-swapped.
+  common::PointLayout os_layout;
+  os_layout.point_step = 48;
+  os_layout.intensity.offset = 16;
+  common::PointLayout os_swapped = os_layout;
+  os_swapped.big_endian = std::endian::native == std::endian::little;
+  std::string os_blob, os_swapped_blob;
+  {
+    const auto points = common::PointCloudView::from_blob(scans[0]).points();
+    os_blob.assign(points.size() * 48, '\0');
+    os_swapped_blob.assign(points.size() * 48, '\0');
+    for (size_t i = 0; i < points.size(); ++i) {
+      const float v[4] = {points[i].x, points[i].y, points[i].z, points[i].intensity};
+      const size_t offsets[4] = {0, 4, 8, 16};
+      for (int f = 0; f < 4; ++f) {
+        char bytes[4];
+        std::memcpy(bytes, &v[f], 4);
+        std::memcpy(&os_blob[i * 48 + offsets[f]], bytes, 4);
+        std::reverse(bytes, bytes + 4);
+        std::memcpy(&os_swapped_blob[i * 48 + offsets[f]], bytes, 4);
+      }
+    }
+  }
+  const size_t os_points = os_blob.size() / 48;
+  add("pointcloud/decode_os48", os_blob.size(), os_points, [&] {
+    auto view = common::PointCloudView::from_blob(os_blob, os_layout);
+    keep(view);
+  });
+
+  add("pointcloud/decode_strided", os_swapped_blob.size(), os_points, [&] {
+    auto view = common::PointCloudView::from_blob(os_swapped_blob, os_swapped);
+    keep(view);
+  });
+
+  add("pointcloud/voxel_0.2m", scan_points * sizeof(common::PointData),
+      scan_points, [&] {
+        for (const auto &blob : scans) {
+          auto view = common::PointCloudView::from_blob(blob);
+          auto cloud = common::voxel_downsample(view.points(), {.leaf = 0.2f});
+          keep(cloud);
+        }
+      });
+
+  common::AccelerationFrame stats_frame;
+  for (const auto &s : imu) stats_frame.push_back({s.ts_ns, s.x, s.y, s.z});
+  add("stats/frame_stats", stats_frame.size() * 32, stats_frame.size(), [&] {
+    auto st = common::frame_stats(stats_frame);
+    keep(st);
+  });
+
+  add("stats/column_stats", stats_frame.size() * 8, stats_frame.size(), [&] {
+    auto st = common::column_stats(stats_frame.acc_x());
+    keep(st);
+  });
+
+  auto predicate = *common::Predicate::compile(
+      R"({"$or":[{"$gt":[{"$abs":["@acc_x"]},10]},{"@acc_z":{"$lt":-5}}]})",
+      common::imu_predicate_columns());
+  add("predicate/abs_or_lt", stats_frame.size() * 24, stats_frame.size(), [&] {
+    auto n = common::count_matching(stats_frame, predicate);
+    keep(n);
+  });
+
+  add("lod/build", stats_frame.size() * sizeof(common::AccelerationData),
+      stats_frame.size(), [&] {
+        common::LodPyramid lod;
+        lod.add(stats_frame);
+        lod.finish();
+        keep(lod);
+      });
+
+  common::LodPyramid lod;
+  lod.add(stats_frame);
+  lod.finish();
+  const int64_t lod_from = stats_frame.ts_ns().front();
+  const int64_t lod_to = stats_frame.ts_ns().back() + 1;
+  add("lod/view_1000px", 0, 1000, [&] {
+    auto view = lod.view(lod_from, lod_to, 1000);
+    keep(view);
+  });
+
+  constexpr size_t kTimes = 100'000;
+  add("parse_time", kTimes * std::strlen(common::START_STR), kTimes, [&] {
+    for (size_t i = 0; i < kTimes; ++i) {
+      auto t = common::parse_time(common::START_STR);
+      keep(t);
+    }
+  });
+
+  add("e2e/csv_stream+stats", csv.size(), imu.size(), [&] {
+    frame.clear();
+    auto sink = [&](const common::AccelerationData &row) { frame.push_back(row); };
+    auto on_error = [](size_t, std::string_view, common::CsvStatus) {};
+    common::CsvStreamDecoder<decltype(sink), decltype(on_error)> dec(true, sink, on_error);
+    for (size_t i = 0; i < csv.size(); i += 65536) {
+      dec.feed(std::string_view(csv).substr(i, 65536));
+    }
+    dec.finish();
+    frame.sort_by_time();
+    auto st = common::frame_stats(frame);
+    keep(st);
+  });
+
+  // The CSV split into one-second records, captured to a file and replayed
+  // through the same sharded query path the extractors use. A replay that
+  // fails or loses rows fails the run instead of being timed.
+  const auto capture_path =
+      std::filesystem::temp_directory_path() / "reduct_bench_csv.rcap";
+  {
+    auto writer = common::CaptureWriter::open(capture_path);
+    if (!writer) {
+      std::cerr << "Cannot create " << capture_path << "\n";
+      return 1;
+    }
+    const uint32_t stream = writer->stream_id("csv", common::capture::stream_key({}));
+    for (size_t i = 0; i < imu.size(); i += 400) {
+      size_t end = std::min(imu.size(), i + 400);
+      std::vector<ImuSample> part(imu.begin() + long(i), imu.begin() + long(end));
+      std::string blob = make_csv(part);
+      writer->write_record(stream, imu[i].ts_ns / 1000, {}, "text/csv", blob);
+    }
+    writer->write_window(stream, INT64_MIN, INT64_MAX);
+  }
+  auto player = std::shared_ptr<const common::RecordSource>(
+      common::ReplaySource::open(capture_path));
+  if (!player) {
+    std::cerr << "Cannot replay " << capture_path << "\n";
+    std::filesystem::remove(capture_path);
+    return 1;
+  }
+  std::string replay_error;
+  auto check_replay = [&](const char *name, const common::AccelerationFrame &rows,
+                          const reduct::Error &err) {
+    if (!replay_error.empty()) return;  // keep the first failure
+    if (err != reduct::Error::kOk) {
+      replay_error = std::string(name) + ": " + err.message;
+    } else if (rows.size() != imu.size()) {
+      replay_error = std::string(name) + ": " + std::to_string(rows.size()) + "/" +
+                     std::to_string(imu.size()) + " rows";
+    }
+  };
+  add("e2e/replay_csv_sharded", csv.size(), imu.size(), [&] {
+    auto connect = [&] { return std::make_unique<common::SharedSource>(player); };
+    auto [rows, err] = common::query_sharded<common::AccelerationFrame>(
+        connect, "csv", std::nullopt, std::nullopt, {},
+        [](const reduct::IBucket::ReadableRecord &rec, common::AccelerationFrame &out) {
+          common::stream_csv(
+              rec, true, [&](const common::AccelerationData &row) { out.push_back(row); },
+              [](size_t, std::string_view, common::CsvStatus) {});
+          return true;
+        });
+    check_replay("e2e/replay_csv_sharded", rows, err);
+    keep(rows);
+  });
+  add("e2e/replay_csv_pipelined", csv.size(), imu.size(), [&] {
+    auto connect = [&] { return std::make_unique<common::SharedSource>(player); };
+    auto [rows, err] = common::query_pipelined<common::AccelerationFrame>(
+        connect, "csv", std::nullopt, std::nullopt, {},
+        [](const common::PipelineItem &item, common::AccelerationFrame &out) {
+          common::decode_csv(item.blob, true, out);
+        });
+    check_replay("e2e/replay_csv_pipelined", rows, err);
+    keep(rows);
+  });
+  std::filesystem::remove(capture_path);
+  if (!replay_error.empty()) {
+    std::cerr << "replay failed (" << replay_error << ")\n";
+    return 1;
+  }
+
+  if (opts.json) {
+    print_json(results);
+  } else {
+    print_table(results);
+  }
+  return 0;
+}
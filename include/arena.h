@@ -0,0 +1,155 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include "mpmc_ring.h"
+
+namespace common {
+  // Passes allocations through to `upstream` and counts them.
+  class CountingResource : public std::pmr::memory_resource {
+  public:
+    explicit CountingResource(
+        std::pmr::memory_resource *upstream = std::pmr::new_delete_resource())
+        : upstream_(upstream) {}
+
+    uint64_t allocations() const { return allocations_; }
+    uint64_t bytes() const { return bytes_; }
+
+  private:
+    void *do_allocate(size_t bytes, size_t align) override {
+      ++allocations_;
+      bytes_ += bytes;
+      return upstream_->allocate(bytes, align);
+    }
+    void do_deallocate(void *p, size_t bytes, size_t align) override {
+      upstream_->deallocate(p, bytes, align);
+    }
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+      return this == &other;
+    }
+
+    std::pmr::memory_resource *upstream_;
+    uint64_t allocations_ = 0;
+    uint64_t bytes_ = 0;
+  };
+
+  // Scratch memory for decoding one record (or one batch): a monotonic
+  // resource over a block that is kept between records, so everything
+  // allocated while decoding is dropped at once by reset() and the next
+  // record starts from the same block. A record that outgrows the block
+  // spills to the heap; the next reset() grows the block to cover it, up to
+  // kMaxCapacity, so in steady state decoding allocates nothing.
+  class RecordArena {
+  public:
+    // Outliers beyond this keep spilling rather than pinning the memory.
+    static constexpr size_t kMaxCapacity = 16 * 1024 * 1024;
+
+    explicit RecordArena(size_t capacity = 64 * 1024) { rebuild(capacity); }
+
+    RecordArena(const RecordArena &) = delete;
+    RecordArena &operator=(const RecordArena &) = delete;
+
+    std::pmr::memory_resource *resource() { return &*monotonic_; }
+
+    void reset() {
+      const uint64_t spilled = spill_.bytes() - spilled_at_reset_;
+      const size_t grown =
+          std::min(std::bit_ceil(capacity_ + size_t(spilled)), kMaxCapacity);
+      if (spilled > 0 && grown > capacity_) {
+        rebuild(grown);
+      } else {
+        monotonic_->release();
+      }
+      spilled_at_reset_ = spill_.bytes();
+      ++resets_;
+    }
+
+    size_t capacity() const { return capacity_; }
+    uint64_t resets() const { return resets_; }
+    // Heap allocations made because a record didn't fit the block.
+    uint64_t spills() const { return spill_.allocations(); }
+
+    // Nesting depth of ArenaScopes on this arena.
+    size_t depth = 0;
+
+  private:
+    void rebuild(size_t capacity) {
+      monotonic_.reset();
+      capacity_ = capacity;
+      block_ = std::make_unique<std::byte[]>(capacity_);
+      monotonic_.emplace(block_.get(), capacity_, &spill_);
+    }
+
+    CountingResource spill_;
+    std::unique_ptr<std::byte[]> block_;
+    size_t capacity_ = 0;
+    std::optional<std::pmr::monotonic_buffer_resource> monotonic_;
+    uint64_t spilled_at_reset_ = 0;
+    uint64_t resets_ = 0;
+  };
+
+  inline RecordArena &thread_arena() {
+    thread_local RecordArena arena;
+    return arena;
+  }
+
+  // Marks the lifetime of one record's scratch memory on the calling
+  // thread's arena. Scopes nest: only the outermost one resets the arena, so
+  // a decoder opening its own scope inside a per-record scope of the query
+  // loop is fine. Nothing allocated from resource() may outlive the scope.
+  class ArenaScope {
+  public:
+    ArenaScope() : arena_(thread_arena()) { ++arena_.depth; }
+    ~ArenaScope() {
+      if (--arena_.depth == 0) arena_.reset();
+    }
+
+    ArenaScope(const ArenaScope &) = delete;
+    ArenaScope &operator=(const ArenaScope &) = delete;
+
+    std::pmr::memory_resource *resource() { return arena_.resource(); }
+
+  private:
+    RecordArena &arena_;
+  };
+
+  // Lock-free free list of objects that own heap buffers, e.g. blob strings,
+  // so a buffer released by a consumer is handed back to the producer with
+  // its capacity intact. Objects released into a full pool are dropped.
+  template <typename T>
+  class ObjectPool {
+  public:
+    explicit ObjectPool(size_t capacity) : free_(capacity) {}
+
+    T acquire() {
+      T value{};
+      free_.try_pop(value);
+      return value;
+    }
+
+    void release(T &&value) { free_.try_push(value); }
+
+  private:
+    MpmcRing<T> free_;
+  };
+
+  using BlobPool = ObjectPool<std::string>;
+
+  // Reads the whole blob into `out`, reusing its capacity.
+  template <typename Record>
+  auto read_blob(const Record &rec, std::string &out) {
+    out.clear();
+    out.reserve(rec.size);
+    return rec.Read([&](std::string_view chunk) {
+      out.append(chunk);
+      return true;
+    });
+  }
+}
@@ -0,0 +1,277 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <reduct/client.h>
+#include "arena.h"
+#include "bounded_queue.h"
+#include "data_structures.h"
+#include "parallel_query.h"
+#include "profiling.h"
+
+namespace common {
+  // One entry taking part in a join. decode(record, rows) appends the rows of
+  // one record and returns false to stop the query, as in query_sharded().
+  struct JoinInput {
+    std::string name;  // column prefix in the joined frame
+    std::string entry;
+    reduct::IBucket::QueryOptions options;
+    std::function<bool(const reduct::IBucket::ReadableRecord &, AccelerationFrame &)>
+        decode;
+  };
+
+  enum class AsofDirection {
+    kBackward,  // latest row at or before the base row
+    kForward,   // earliest row at or after it
+    kNearest,   // whichever is closer; the earlier one on a tie
+  };
+
+  struct AsofOptions {
+    int64_t tolerance_ns = 5'000'000;
+    AsofDirection direction = AsofDirection::kNearest;
+    size_t queue_records = 64;  // decoded records buffered per input
+  };
+
+  struct JoinStats {
+    std::string name;
+    size_t rows = 0;           // rows consumed before the base ran out
+    size_t matched = 0;        // base rows that found a row of this input
+    size_t out_of_order = 0;   // rows older than the row before them, skipped
+  };
+
+  // Time-aligned columns: one ts_ns axis taken from the base input and,
+  // per input, "<name>.acc_x/y/z". Every other input also gets
+  // "<name>.lag_ns", the matched row's offset from the base row. Values
+  // without a match within the tolerance are NaN.
+  class AlignedFrame {
+  public:
+    size_t size() const { return ts_ns_.size(); }
+    bool empty() const { return ts_ns_.empty(); }
+
+    std::span<const int64_t> ts_ns() const { return ts_ns_; }
+    const std::vector<std::string> &names() const { return names_; }
+    std::span<const double> column(size_t i) const { return columns_[i]; }
+
+    std::optional<size_t> find(std::string_view name) const {
+      for (size_t i = 0; i < names_.size(); ++i) {
+        if (names_[i] == name) return i;
+      }
+      return std::nullopt;
+    }
+
+    size_t add_column(std::string name) {
+      names_.push_back(std::move(name));
+      columns_.emplace_back();
+      return columns_.size() - 1;
+    }
+
+    // Appends a row; the caller then pushes one value to every column.
+    void push_time(int64_t ts_ns) { ts_ns_.push_back(ts_ns); }
+    void push(size_t column, double value) { columns_[column].push_back(value); }
+
+    std::vector<JoinStats> stats;
+
+  private:
+    std::vector<int64_t> ts_ns_;
+    std::vector<std::string> names_;
+    std::vector<std::vector<double>> columns_;
+  };
+
+  namespace detail {
+    // Consumer side of one input: walks the decoded records in order,
+    // pulling the next one from the producer's queue when the current one
+    // is used up.
+    class JoinCursor {
+    public:
+      explicit JoinCursor(BoundedQueue<AccelerationFrame> &queue) : queue_(queue) {}
+
+      // Null once the input is exhausted.
+      const AccelerationFrame *peek() {
+        while (pos_ >= chunk_.size()) {
+          auto next = queue_.pop();
+          if (!next) return nullptr;
+          chunk_ = std::move(*next);
+          pos_ = 0;
+        }
+        return &chunk_;
+      }
+      int64_t ts() const { return chunk_.ts_ns()[pos_]; }
+      AccelerationData row() const { return chunk_.row(pos_); }
+      void advance() { ++pos_; }
+
+    private:
+      BoundedQueue<AccelerationFrame> &queue_;
+      AccelerationFrame chunk_;
+      size_t pos_ = 0;
+    };
+  }
+
+  // Streams several entries side by side and as-of joins them on ts_ns.
+  // inputs[0] is the base: every one of its rows becomes a row of the
+  // result and the other inputs are matched against it within
+  // tolerance_ns.
+  //
+  // Each input is queried on its own thread and its decoded records are
+  // handed over through a bounded queue. The join is a single merge pass,
+  // O(total rows), because an entry's records arrive in timestamp order;
+  // nothing is materialized or sorted per entry. Rows that go back in time
+  // within an input are counted in JoinStats::out_of_order and skipped. A
+  // full queue stalls its query, so memory stays at queue_records decoded
+  // records per input however long the range is.
+  template <typename Connect>
+  reduct::Result<AlignedFrame>
+  asof_join(const Connect &connect, std::vector<JoinInput> inputs,
+            std::optional<Time> start, std::optional<Time> stop,
+            const AsofOptions &options = {}) {
+    profile::Scope join_scope("join");
+    AlignedFrame out;
+    if (inputs.empty()) return {std::move(out), reduct::Error::kOk};
+
+    const size_t n = inputs.size();
+    std::vector<std::unique_ptr<BoundedQueue<AccelerationFrame>>> queues;
+    std::vector<reduct::Error> errors(n, reduct::Error::kOk);
+    for (size_t i = 0; i < n; ++i) {
+      queues.push_back(
+          std::make_unique<BoundedQueue<AccelerationFrame>>(options.queue_records));
+    }
+
+    std::vector<std::thread> producers;
+    producers.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+      producers.emplace_back([&, i] {
+        static auto &record_stage = profile::stage("join.record");
+        auto &queue = *queues[i];
+        auto bucket = connect();
+        if (!bucket) {
+          errors[i] = reduct::Error{.code = -1, .message = "Failed to connect bucket"};
+          queue.close();
+          return;
+        }
+        auto err = bucket->Query(
+            inputs[i].entry, start, stop, inputs[i].options,
+            [&](const reduct::IBucket::ReadableRecord &rec) {
+              ArenaScope arena;
+              profile::Scope scope(record_stage);
+              scope.bytes(rec.size);
+              AccelerationFrame rows;
+              if (!inputs[i].decode(rec, rows)) return false;
+              scope.rows(rows.size());
+              return rows.empty() || queue.push(std::move(rows));
+            });
+        if (err != reduct::Error::kOk) errors[i] = std::move(err);
+        queue.close();
+      });
+    }
+
+    std::vector<detail::JoinCursor> cursors;
+    cursors.reserve(n);
+    for (auto &q : queues) cursors.emplace_back(*q);
+
+    struct Columns {
+      size_t x, y, z, lag;
+    };
+    std::vector<Columns> cols(n);
+    for (size_t i = 0; i < n; ++i) {
+      const auto &name = inputs[i].name;
+      cols[i] = {out.add_column(name + ".acc_x"), out.add_column(name + ".acc_y"),
+                 out.add_column(name + ".acc_z"),
+                 i == 0 ? 0 : out.add_column(name + ".lag_ns")};
+      out.stats.push_back({.name = name});
+    }
+
+    // Per matched input: the last row at or before the current base time.
+    struct Behind {
+      bool valid = false;
+      AccelerationData row{};
+    };
+    std::vector<Behind> behind(n);
+    std::vector<int64_t> last_ts(n, std::numeric_limits<int64_t>::min());
+    constexpr double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+    auto put = [&](size_t i, const AccelerationData *row, int64_t base_ts) {
+      out.push(cols[i].x, row ? row->linear_acceleration_x : kNaN);
+      out.push(cols[i].y, row ? row->linear_acceleration_y : kNaN);
+      out.push(cols[i].z, row ? row->linear_acceleration_z : kNaN);
+      if (i > 0) out.push(cols[i].lag, row ? double(row->ts_ns - base_ts) : kNaN);
+    };
+
+    // Moves cursor i past rows that are out of order; false at the end.
+    auto next_in_order = [&](size_t i) {
+      auto &cur = cursors[i];
+      while (cur.peek()) {
+        if (cur.ts() >= last_ts[i]) return true;
+        ++out.stats[i].out_of_order;
+        cur.advance();
+      }
+      return false;
+    };
+
+    auto &base = cursors[0];
+    while (next_in_order(0)) {
+      const AccelerationData row = base.row();
+      base.advance();
+      last_ts[0] = row.ts_ns;
+      ++out.stats[0].rows;
+      out.push_time(row.ts_ns);
+      put(0, &row, row.ts_ns);
+
+      for (size_t i = 1; i < n; ++i) {
+        auto &cur = cursors[i];
+        while (next_in_order(i) && cur.ts() <= row.ts_ns) {
+          behind[i] = {true, cur.row()};
+          last_ts[i] = cur.ts();
+          ++out.stats[i].rows;
+          cur.advance();
+        }
+        std::optional<AccelerationData> ahead;
+        if (next_in_order(i)) ahead = cur.row();
+
+        const AccelerationData *best = nullptr;
+        uint64_t best_dt = 0;
+        auto consider = [&](const AccelerationData &cand) {
+          const uint64_t dt = uint64_t(std::llabs(cand.ts_ns - row.ts_ns));
+          if (dt > uint64_t(options.tolerance_ns)) return;
+          if (!best || dt < best_dt) {
+            best = &cand;
+            best_dt = dt;
+          }
+        };
+        const bool exact = behind[i].valid && behind[i].row.ts_ns == row.ts_ns;
+        switch (options.direction) {
+        case AsofDirection::kBackward:
+          if (behind[i].valid) consider(behind[i].row);
+          break;
+        case AsofDirection::kForward:
+          if (exact) consider(behind[i].row);
+          else if (ahead) consider(*ahead);
+          break;
+        case AsofDirection::kNearest:
+          if (behind[i].valid) consider(behind[i].row);
+          if (ahead) consider(*ahead);
+          break;
+        }
+        if (best) ++out.stats[i].matched;
+        put(i, best, row.ts_ns);
+      }
+    }
+
+    // The base is done, so nothing later in the other inputs can match;
+    // closing their queues stops the remaining queries.
+    for (auto &q : queues) q->close();
+    for (auto &t : producers) t.join();
+    join_scope.rows(out.size());
+
+    for (auto &err : errors) {
+      if (err != reduct::Error::kOk) return {AlignedFrame{}, std::move(err)};
+    }
+    return {std::move(out), reduct::Error::kOk};
+  }
+}
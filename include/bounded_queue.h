@@ -0,0 +1,53 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace common {
+  // Blocking multi-producer/multi-consumer queue with a fixed capacity.
+  // push() waits while the queue is full, which is how producers feel
+  // backpressure; pop() returns nullopt once the queue is closed and empty.
+  template <typename T>
+  class BoundedQueue {
+  public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity ? capacity : 1) {}
+
+    // Returns false if the queue was closed before the item could be queued.
+    bool push(T item) {
+      std::unique_lock lock(mutex_);
+      not_full_.wait(lock, [&] { return closed_ || items_.size() < capacity_; });
+      if (closed_) return false;
+      items_.push_back(std::move(item));
+      not_empty_.notify_one();
+      return true;
+    }
+
+    std::optional<T> pop() {
+      std::unique_lock lock(mutex_);
+      not_empty_.wait(lock, [&] { return closed_ || !items_.empty(); });
+      if (items_.empty()) return std::nullopt;
+      T item = std::move(items_.front());
+      items_.pop_front();
+      not_full_.notify_one();
+      return item;
+    }
+
+    void close() {
+      std::lock_guard lock(mutex_);
+      closed_ = true;
+      not_full_.notify_all();
+      not_empty_.notify_all();
+    }
+
+  private:
+    size_t capacity_;
+    std::deque<T> items_;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+  };
+}
@@ -0,0 +1,476 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "data_structures.h"
+#include "mapped_file.h"
+#include "pointcloud.h"
+#include "profiling.h"
+#include "utilities.h"
+
+// Columnar export file, made to be memory-mapped:
+//
+//   "RCOL" u32 version
+//   block*    one per block_rows rows: the ts_ns column, then every other
+//             column, each a raw array padded to 8 bytes
+//   footer    u32 n_columns, (u8 type, u32 len, name)...
+//             u64 n_blocks, (u64 offset, u64 rows, i64 first_ts, i64 last_ts,
+//                            (f64 min, f64 max) per column)...
+//             (f64 min, f64 max) per column for the whole file, u64 rows
+//   trailer   u64 footer offset, "RCOL"
+//
+// Column 0 is always ts_ns, non-decreasing across the file, so the blocks'
+// first/last ts are a sparse time index: a reader binary-searches it for the
+// blocks of a range and then the ts_ns array inside them, touching only the
+// pages it returns. NaN values are left out of min/max. Integers are in host
+// byte order, like the query cache.
+namespace common {
+  enum class ColumnType : uint8_t { kInt64, kFloat64, kFloat32 };
+
+  constexpr size_t column_width(ColumnType type) {
+    return type == ColumnType::kFloat32 ? 4 : 8;
+  }
+
+  template <typename T> constexpr ColumnType column_type_of();
+  template <> constexpr ColumnType column_type_of<int64_t>() { return ColumnType::kInt64; }
+  template <> constexpr ColumnType column_type_of<double>() { return ColumnType::kFloat64; }
+  template <> constexpr ColumnType column_type_of<float>() { return ColumnType::kFloat32; }
+
+  struct ColumnSpec {
+    std::string name;
+    ColumnType type;
+  };
+
+  struct ColumnRange {
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+
+    bool empty() const { return min > max; }
+    void add(double v) {
+      if (std::isnan(v)) return;
+      min = std::min(min, v);
+      max = std::max(max, v);
+    }
+    void merge(const ColumnRange &o) {
+      min = std::min(min, o.min);
+      max = std::max(max, o.max);
+    }
+  };
+
+  struct ColumnarBlock {
+    uint64_t offset = 0;
+    uint64_t rows = 0;
+    int64_t first_ts = 0;
+    int64_t last_ts = 0;
+  };
+
+  namespace columnar {
+    constexpr char kMagic[4] = {'R', 'C', 'O', 'L'};
+    constexpr uint32_t kVersion = 1;
+    constexpr size_t kTrailer = 12;
+
+    constexpr size_t padded(size_t bytes) { return (bytes + 7) & ~size_t(7); }
+
+    inline std::vector<ColumnSpec> imu_columns() {
+      return {{"acc_x", ColumnType::kFloat64},
+              {"acc_y", ColumnType::kFloat64},
+              {"acc_z", ColumnType::kFloat64}};
+    }
+
+    inline std::vector<ColumnSpec> point_columns() {
+      return {{"x", ColumnType::kFloat32},
+              {"y", ColumnType::kFloat32},
+              {"z", ColumnType::kFloat32},
+              {"intensity", ColumnType::kFloat32}};
+    }
+  }
+
+  // Buffers one block of rows per column and writes it out when full.
+  // append() takes n rows at once: ts_ns[n] plus, for every column after
+  // ts_ns, a pointer to n values of its type.
+  class ColumnarWriter {
+  public:
+    // `columns` excludes ts_ns, which is added as column 0.
+    ColumnarWriter(const std::filesystem::path &path, std::vector<ColumnSpec> columns,
+                   size_t block_rows = 64 * 1024)
+        : out_(path, std::ios::binary | std::ios::trunc),
+          block_rows_(std::max<size_t>(block_rows, 1)) {
+      columns_.push_back({"ts_ns", ColumnType::kInt64});
+      columns_.insert(columns_.end(), std::make_move_iterator(columns.begin()),
+                      std::make_move_iterator(columns.end()));
+      buffers_.resize(columns_.size());
+      block_ranges_.resize(columns_.size());
+      file_ranges_.resize(columns_.size());
+      for (size_t c = 0; c < columns_.size(); ++c) {
+        buffers_[c].reserve(block_rows_ * column_width(columns_[c].type));
+      }
+      out_.write(columnar::kMagic, 4);
+      put(columnar::kVersion);
+    }
+
+    ColumnarWriter(const ColumnarWriter &) = delete;
+    ColumnarWriter &operator=(const ColumnarWriter &) = delete;
+
+    ~ColumnarWriter() { close(); }
+
+    bool ok() const { return bool(out_); }
+    const std::vector<ColumnSpec> &columns() const { return columns_; }
+    uint64_t rows() const { return rows_ + block_size_; }
+
+    // Returns false, writing nothing, if ts_ns goes back in time.
+    bool append(std::span<const int64_t> ts_ns, std::span<const void *const> values) {
+      if (ts_ns.empty()) return true;
+      if (closed_ || values.size() + 1 != columns_.size() ||
+          !std::is_sorted(ts_ns.begin(), ts_ns.end()) ||
+          (rows() > 0 && ts_ns.front() < last_ts_)) {
+        return false;
+      }
+      profile::Scope scope("export");
+      scope.rows(ts_ns.size());
+      size_t done = 0;
+      while (done < ts_ns.size()) {
+        const size_t n = std::min(ts_ns.size() - done, block_rows_ - block_size_);
+        if (block_size_ == 0) first_ts_ = ts_ns[done];
+        copy(0, ts_ns.data(), done, n);
+        for (size_t c = 1; c < columns_.size(); ++c) copy(c, values[c - 1], done, n);
+        block_size_ += n;
+        done += n;
+        last_ts_ = ts_ns[done - 1];
+        if (block_size_ == block_rows_) flush_block();
+      }
+      return true;
+    }
+
+    // Writes the last block and the footer. Returns false if any write
+    // failed.
+    bool close() {
+      if (closed_) return ok();
+      closed_ = true;
+      flush_block();
+      const uint64_t footer_offset = uint64_t(out_.tellp());
+      put(uint32_t(columns_.size()));
+      for (const auto &col : columns_) {
+        put(uint8_t(col.type));
+        put(uint32_t(col.name.size()));
+        out_.write(col.name.data(), std::streamsize(col.name.size()));
+      }
+      put(uint64_t(blocks_.size()));
+      for (size_t b = 0; b < blocks_.size(); ++b) {
+        put(blocks_[b].offset);
+        put(blocks_[b].rows);
+        put(blocks_[b].first_ts);
+        put(blocks_[b].last_ts);
+        for (size_t c = 0; c < columns_.size(); ++c) {
+          put(ranges_[b * columns_.size() + c].min);
+          put(ranges_[b * columns_.size() + c].max);
+        }
+      }
+      for (const auto &r : file_ranges_) {
+        put(r.min);
+        put(r.max);
+      }
+      put(rows_);
+      put(footer_offset);
+      out_.write(columnar::kMagic, 4);
+      out_.flush();
+      return ok();
+    }
+
+  private:
+    template <typename T> void put(T v) {
+      out_.write(reinterpret_cast<const char *>(&v), sizeof(T));
+    }
+
+    template <typename T>
+    static void add_range(ColumnRange &range, const char *bytes, size_t n) {
+      for (size_t i = 0; i < n; ++i) {
+        T v;
+        std::memcpy(&v, bytes + i * sizeof(T), sizeof(T));
+        range.add(double(v));
+      }
+    }
+
+    void copy(size_t c, const void *src, size_t first, size_t n) {
+      const size_t width = column_width(columns_[c].type);
+      const auto *bytes = static_cast<const char *>(src) + first * width;
+      buffers_[c].insert(buffers_[c].end(), bytes, bytes + n * width);
+      switch (columns_[c].type) {
+      case ColumnType::kInt64: add_range<int64_t>(block_ranges_[c], bytes, n); break;
+      case ColumnType::kFloat64: add_range<double>(block_ranges_[c], bytes, n); break;
+      case ColumnType::kFloat32: add_range<float>(block_ranges_[c], bytes, n); break;
+      }
+    }
+
+    void flush_block() {
+      if (block_size_ == 0) return;
+      static constexpr char kZeros[8] = {};
+      blocks_.push_back({uint64_t(out_.tellp()), block_size_, first_ts_, last_ts_});
+      for (size_t c = 0; c < columns_.size(); ++c) {
+        auto &buf = buffers_[c];
+        out_.write(buf.data(), std::streamsize(buf.size()));
+        out_.write(kZeros, std::streamsize(columnar::padded(buf.size()) - buf.size()));
+        buf.clear();
+        ranges_.push_back(block_ranges_[c]);
+        file_ranges_[c].merge(block_ranges_[c]);
+        block_ranges_[c] = {};
+      }
+      rows_ += block_size_;
+      block_size_ = 0;
+    }
+
+    std::ofstream out_;
+    size_t block_rows_;
+    std::vector<ColumnSpec> columns_;
+    std::vector<std::vector<char>> buffers_;
+    std::vector<ColumnRange> block_ranges_;
+    std::vector<ColumnRange> file_ranges_;
+    std::vector<ColumnarBlock> blocks_;
+    std::vector<ColumnRange> ranges_;  // n_blocks x n_columns
+    size_t block_size_ = 0;
+    uint64_t rows_ = 0;
+    int64_t first_ts_ = 0;
+    int64_t last_ts_ = 0;
+    bool closed_ = false;
+  };
+
+  // Writes a time-sorted frame with columnar::imu_columns().
+  inline bool append_frame(ColumnarWriter &writer, const AccelerationFrame &frame) {
+    const void *const values[] = {frame.acc_x().data(), frame.acc_y().data(),
+                                  frame.acc_z().data()};
+    return writer.append(frame.ts_ns(), values);
+  }
+
+  // Writes a whole time-sorted frame to `path`.
+  inline bool export_frame(const std::filesystem::path &path,
+                           const AccelerationFrame &frame) {
+    ColumnarWriter writer(path, columnar::imu_columns());
+    return append_frame(writer, frame) && writer.close();
+  }
+
+  // Handles an extractor's --export=FILE flag: writes `frame` there if the flag
+  // is given and reports the outcome. Returns false only if the export failed.
+  inline bool export_frame_if_requested(int argc, char **argv,
+                                        const AccelerationFrame &frame) {
+    auto path = flag_value(argc, argv, "--export=");
+    if (!path) return true;
+    const bool ok = export_frame(*path, frame);
+    std::cout << (ok ? "Exported to " : "Failed to export to ") << *path << "\n";
+    return ok;
+  }
+
+  // Writes one scan with columnar::point_columns(), every point at the scan's
+  // timestamp.
+  inline bool append_scan(ColumnarWriter &writer, int64_t ts_ns,
+                          std::span<const PointData> points) {
+    thread_local std::vector<int64_t> ts;
+    thread_local std::vector<float> cols[4];
+    ts.assign(points.size(), ts_ns);
+    for (auto &col : cols) col.resize(points.size());
+    for (size_t i = 0; i < points.size(); ++i) {
+      cols[0][i] = points[i].x;
+      cols[1][i] = points[i].y;
+      cols[2][i] = points[i].z;
+      cols[3][i] = points[i].intensity;
+    }
+    const void *const values[] = {cols[0].data(), cols[1].data(), cols[2].data(),
+                                  cols[3].data()};
+    return writer.append(ts, values);
+  }
+
+  // Rows [begin, end) of one block.
+  struct ColumnarSlice {
+    size_t block;
+    size_t begin;
+    size_t end;
+
+    size_t size() const { return end - begin; }
+  };
+
+  // Maps an export file and serves column arrays straight from the mapping.
+  // Only the footer is read up front.
+  class ColumnarReader {
+  public:
+    static std::optional<ColumnarReader> open(const std::filesystem::path &path) {
+      profile::Scope scope("export.open");
+      auto file = MappedFile::open(path);
+      if (!file) return std::nullopt;
+      ColumnarReader reader;
+      reader.file_ = std::move(*file);
+      if (!reader.parse()) return std::nullopt;
+      return reader;
+    }
+
+    uint64_t rows() const { return rows_; }
+    const std::vector<ColumnSpec> &columns() const { return columns_; }
+    size_t n_blocks() const { return blocks_.size(); }
+    const ColumnarBlock &block(size_t b) const { return blocks_[b]; }
+
+    std::optional<size_t> find(std::string_view name) const {
+      for (size_t c = 0; c < columns_.size(); ++c) {
+        if (columns_[c].name == name) return c;
+      }
+      return std::nullopt;
+    }
+
+    const ColumnRange &range(size_t column) const { return file_ranges_[column]; }
+    const ColumnRange &range(size_t block, size_t column) const {
+      return ranges_[block * columns_.size() + column];
+    }
+
+    std::span<const int64_t> ts(size_t block) const { return values<int64_t>(block, 0); }
+
+    // Empty if T doesn't match the column's type.
+    template <typename T>
+    std::span<const T> values(size_t block, size_t column) const {
+      if (columns_[column].type != column_type_of<T>()) return {};
+      const auto &b = blocks_[block];
+      uint64_t offset = b.offset;
+      for (size_t c = 0; c < column; ++c) {
+        offset += columnar::padded(b.rows * column_width(columns_[c].type));
+      }
+      return {reinterpret_cast<const T *>(file_.view().data() + offset), size_t(b.rows)};
+    }
+
+    // Rows [begin, end) of a column of any type, widened to double.
+    void read_doubles(size_t block, size_t column, size_t begin, size_t end,
+                      std::vector<double> &out) const {
+      out.resize(end - begin);
+      auto widen = [&](auto values) {
+        std::copy(values.begin() + ptrdiff_t(begin), values.begin() + ptrdiff_t(end),
+                  out.begin());
+      };
+      switch (columns_[column].type) {
+      case ColumnType::kInt64: widen(values<int64_t>(block, column)); break;
+      case ColumnType::kFloat64: widen(values<double>(block, column)); break;
+      case ColumnType::kFloat32: widen(values<float>(block, column)); break;
+      }
+    }
+
+    // Slices holding the rows with from_ns <= ts < to_ns, in time order.
+    std::vector<ColumnarSlice> slices(int64_t from_ns, int64_t to_ns) const {
+      std::vector<ColumnarSlice> out;
+      if (from_ns >= to_ns) return out;
+      auto it = std::partition_point(blocks_.begin(), blocks_.end(),
+                                     [&](const ColumnarBlock &b) { return b.last_ts < from_ns; });
+      for (; it != blocks_.end() && it->first_ts < to_ns; ++it) {
+        const size_t b = size_t(it - blocks_.begin());
+        const auto t = ts(b);
+        const size_t begin = size_t(std::lower_bound(t.begin(), t.end(), from_ns) - t.begin());
+        const size_t end = size_t(std::lower_bound(t.begin() + begin, t.end(), to_ns) - t.begin());
+        if (begin < end) out.push_back({b, begin, end});
+      }
+      return out;
+    }
+
+  private:
+    ColumnarReader() = default;
+
+    bool parse() {
+      const auto data = file_.view();
+      if (data.size() < 8 + columnar::kTrailer ||
+          std::memcmp(data.data(), columnar::kMagic, 4) != 0 ||
+          std::memcmp(data.data() + data.size() - 4, columnar::kMagic, 4) != 0) {
+        return false;
+      }
+      uint32_t version = 0;
+      std::memcpy(&version, data.data() + 4, 4);
+      uint64_t footer = 0;
+      std::memcpy(&footer, data.data() + data.size() - columnar::kTrailer, 8);
+      if (version != columnar::kVersion || footer < 8 ||
+          footer > data.size() - columnar::kTrailer) {
+        return false;
+      }
+
+      size_t pos = size_t(footer);
+      const size_t end = data.size() - columnar::kTrailer;
+      auto get = [&](auto &v) {
+        if (end - pos < sizeof(v)) return false;
+        std::memcpy(&v, data.data() + pos, sizeof(v));
+        pos += sizeof(v);
+        return true;
+      };
+      auto get_range = [&](ColumnRange &r) { return get(r.min) && get(r.max); };
+
+      uint32_t n_columns = 0;
+      if (!get(n_columns) || n_columns == 0 || n_columns > 4096) return false;
+      columns_.resize(n_columns);
+      size_t row_bytes = 0;
+      for (auto &col : columns_) {
+        uint8_t type = 0;
+        uint32_t len = 0;
+        if (!get(type) || type > uint8_t(ColumnType::kFloat32) || !get(len) ||
+            end - pos < len) {
+          return false;
+        }
+        col.type = ColumnType(type);
+        col.name.assign(data.data() + pos, len);
+        pos += len;
+        row_bytes += column_width(col.type);
+      }
+      if (columns_[0].type != ColumnType::kInt64) return false;
+
+      uint64_t n_blocks = 0;
+      if (!get(n_blocks) || n_blocks > (end - pos) / 32) return false;
+      blocks_.resize(n_blocks);
+      ranges_.resize(n_blocks * n_columns);
+      uint64_t block_end = 8;
+      for (size_t b = 0; b < n_blocks; ++b) {
+        auto &block = blocks_[b];
+        if (!get(block.offset) || !get(block.rows) || !get(block.first_ts) ||
+            !get(block.last_ts)) {
+          return false;
+        }
+        for (size_t c = 0; c < n_columns; ++c) {
+          if (!get_range(ranges_[b * n_columns + c])) return false;
+        }
+        // Blocks are contiguous and in time order; checking it here keeps
+        // values() and slices() free of bounds checks.
+        if (block.offset != block_end || block.rows == 0 ||
+            block.rows > (footer - block.offset) / row_bytes ||
+            block.first_ts > block.last_ts ||
+            (b > 0 && block.first_ts < blocks_[b - 1].last_ts)) {
+          return false;
+        }
+        block_end = block.offset + block_size(block.rows);
+        if (block_end > footer) return false;
+      }
+      file_ranges_.resize(n_columns);
+      for (auto &r : file_ranges_) {
+        if (!get_range(r)) return false;
+      }
+      if (!get(rows_)) return false;
+      return rows_matches();
+    }
+
+    // Byte size of a block of `rows` rows, columns padded to 8 bytes.
+    uint64_t block_size(uint64_t rows) const {
+      uint64_t n = 0;
+      for (const auto &col : columns_) n += columnar::padded(rows * column_width(col.type));
+      return n;
+    }
+
+    bool rows_matches() const {
+      uint64_t n = 0;
+      for (const auto &b : blocks_) n += b.rows;
+      return n == rows_;
+    }
+
+    MappedFile file_;
+    std::vector<ColumnSpec> columns_;
+    std::vector<ColumnarBlock> blocks_;
+    std::vector<ColumnRange> ranges_;  // n_blocks x n_columns
+    std::vector<ColumnRange> file_ranges_;
+    uint64_t rows_ = 0;
+  };
+}
@@ -0,0 +1,194 @@
+#pragma once
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "arena.h"
+#include "data_structures.h"
+
+namespace common {
+  enum class CsvStatus {
+    kOk,
+    kMissingField,
+    kInvalidNumber,
+  };
+
+  inline const char *to_string(CsvStatus status) {
+    switch (status) {
+    case CsvStatus::kOk: return "ok";
+    case CsvStatus::kMissingField: return "missing field";
+    case CsvStatus::kInvalidNumber: return "invalid number";
+    }
+    return "unknown";
+  }
+
+  struct CsvDecodeResult {
+    size_t rows = 0;
+    size_t bad_lines = 0;
+  };
+
+  // Returns a pointer to the first `c` in [p, end) or `end`, comparing 16
+  // bytes at a time where SSE2 is available.
+  inline const char *find_char(const char *p, const char *end, char c) {
+#if defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+      __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+      if (mask != 0) return p + __builtin_ctz(unsigned(mask));
+      p += 16;
+    }
+#endif
+    auto hit = static_cast<const char *>(std::memchr(p, c, size_t(end - p)));
+    return hit ? hit : end;
+  }
+
+  // Parses one number at `p` and consumes the following ',' if there is one.
+  // Leading blanks and '+' are accepted, as std::stod did.
+  template <typename T>
+  CsvStatus parse_csv_field(const char *&p, const char *end, T &value) {
+    while (p != end && (*p == ' ' || *p == '\t')) ++p;
+    if (p != end && *p == '+') ++p;
+    if (p == end || *p == ',') return CsvStatus::kMissingField;
+
+    auto [next, ec] = std::from_chars(p, end, value);
+    if (ec != std::errc{}) return CsvStatus::kInvalidNumber;
+
+    while (next != end && (*next == ' ' || *next == '\t')) ++next;
+    if (next != end && *next != ',') return CsvStatus::kInvalidNumber;
+    p = next == end ? end : next + 1;
+    return CsvStatus::kOk;
+  }
+
+  // Parses "ts_ns,x,y,z" from a line without its terminator. Extra trailing
+  // columns are ignored.
+  inline CsvStatus parse_csv_row(std::string_view line, AccelerationData &row) {
+    const char *p = line.data();
+    const char *end = p + line.size();
+    CsvStatus st;
+    if ((st = parse_csv_field(p, end, row.ts_ns)) != CsvStatus::kOk) return st;
+    if ((st = parse_csv_field(p, end, row.linear_acceleration_x)) != CsvStatus::kOk) return st;
+    if ((st = parse_csv_field(p, end, row.linear_acceleration_y)) != CsvStatus::kOk) return st;
+    return parse_csv_field(p, end, row.linear_acceleration_z);
+  }
+
+  // Row format of CsvStreamDecoder: the row type and how to parse one line
+  // into it. Schemas from schema.h provide the same two members.
+  struct AccelerationCsv {
+    using row_type = AccelerationData;
+    static CsvStatus parse_csv_row(std::string_view line, AccelerationData &row) {
+      return common::parse_csv_row(line, row);
+    }
+  };
+
+  // Incremental CSV decoder. feed() takes the record in arbitrary chunks and
+  // parses every complete line in place; only a line split across two chunks
+  // is copied, into a carry buffer that is reused for the whole record and
+  // allocated from `mr`, usually the record arena. finish() parses a final
+  // unterminated line.
+  //
+  // Every parsed row goes to sink(const Format::row_type &); every malformed
+  // line goes to on_error(line_no, line, status) and is skipped. Line numbers
+  // are 1-based and count the header.
+  template <typename Sink, typename OnError, typename Format = AccelerationCsv>
+  class CsvStreamDecoder {
+  public:
+    CsvStreamDecoder(bool has_header, Sink &sink, OnError &on_error,
+                     std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : skip_header_(has_header), sink_(sink), on_error_(on_error), carry_(mr) {}
+
+    void feed(std::string_view chunk) {
+      const char *p = chunk.data();
+      const char *end = p + chunk.size();
+
+      if (!carry_.empty()) {
+        const char *eol = find_char(p, end, '\n');
+        carry_.append(p, size_t(eol - p));
+        if (eol == end) return;
+        process_line(carry_);
+        carry_.clear();
+        p = eol + 1;
+      }
+
+      while (p < end) {
+        const char *eol = find_char(p, end, '\n');
+        if (eol == end) {
+          carry_.assign(p, size_t(end - p));
+          return;
+        }
+        process_line({p, size_t(eol - p)});
+        p = eol + 1;
+      }
+    }
+
+    CsvDecodeResult finish() {
+      if (!carry_.empty()) {
+        process_line(carry_);
+        carry_.clear();
+      }
+      return result_;
+    }
+
+  private:
+    void process_line(std::string_view line) {
+      ++line_no_;
+      if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+      if (line.empty()) return;
+      if (skip_header_) {
+        skip_header_ = false;
+        return;
+      }
+
+      typename Format::row_type row{};
+      CsvStatus st = Format::parse_csv_row(line, row);
+      if (st == CsvStatus::kOk) {
+        sink_(row);
+        ++result_.rows;
+      } else {
+        on_error_(line_no_, line, st);
+        ++result_.bad_lines;
+      }
+    }
+
+    bool skip_header_;
+    Sink &sink_;
+    OnError &on_error_;
+    std::pmr::string carry_;
+    size_t line_no_ = 0;
+    CsvDecodeResult result_;
+  };
+
+  // Decodes a whole CSV blob in place.
+  template <typename Sink, typename OnError>
+  CsvDecodeResult decode_csv(std::string_view blob, bool has_header,
+                             Sink &&sink, OnError &&on_error) {
+    ArenaScope arena;
+    CsvStreamDecoder<std::remove_reference_t<Sink>,
+                     std::remove_reference_t<OnError>>
+        decoder(has_header, sink, on_error, arena.resource());
+    decoder.feed(blob);
+    return decoder.finish();
+  }
+
+  template <typename Sink>
+  CsvDecodeResult decode_csv(std::string_view blob, bool has_header,
+                             Sink &&sink) {
+    return decode_csv(blob, has_header, std::forward<Sink>(sink),
+                      [](size_t, std::string_view, CsvStatus) {});
+  }
+
+  inline CsvDecodeResult decode_csv(std::string_view blob, bool has_header,
+                                    AccelerationFrame &rows) {
+    return decode_csv(blob, has_header,
+                      [&](const AccelerationData &row) { rows.push_back(row); });
+  }
+}
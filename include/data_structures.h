@@ -1,5 +1,12 @@
 #pragma once
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <numeric>
+#include <span>
+#include <utility>
+#include <vector>
+#include "profiling.h"
 
 namespace common {
   struct AccelerationData {
@@ -8,4 +15,117 @@ namespace common {
     double linear_acceleration_y;
     double linear_acceleration_z;
   };
-}
\ No newline at end of file
+
+  // Column-oriented store for AccelerationData rows. Each column is one
+  // contiguous array, so reductions stream through a single column and the
+  // spans handed out point into the frame without copying.
+  class AccelerationFrame {
+  public:
+    static constexpr size_t kGrowChunk = 4096;
+
+    size_t size() const { return ts_ns_.size(); }
+    bool empty() const { return ts_ns_.empty(); }
+
+    void reserve(size_t n) {
+      ts_ns_.reserve(n);
+      x_.reserve(n);
+      y_.reserve(n);
+      z_.reserve(n);
+    }
+
+    void clear() {
+      ts_ns_.clear();
+      x_.clear();
+      y_.clear();
+      z_.clear();
+    }
+
+    void push_back(const AccelerationData &row) {
+      if (ts_ns_.size() == ts_ns_.capacity()) grow(1);
+      ts_ns_.push_back(row.ts_ns);
+      x_.push_back(row.linear_acceleration_x);
+      y_.push_back(row.linear_acceleration_y);
+      z_.push_back(row.linear_acceleration_z);
+    }
+
+    void append(const AccelerationFrame &other) { append(other, 0, other.size()); }
+
+    // Appends rows [begin, end) of other.
+    void append(const AccelerationFrame &other, size_t begin, size_t end) {
+      grow(end - begin);
+      auto from = std::ptrdiff_t(begin), to = std::ptrdiff_t(end);
+      ts_ns_.insert(ts_ns_.end(), other.ts_ns_.begin() + from, other.ts_ns_.begin() + to);
+      x_.insert(x_.end(), other.x_.begin() + from, other.x_.begin() + to);
+      y_.insert(y_.end(), other.y_.begin() + from, other.y_.begin() + to);
+      z_.insert(z_.end(), other.z_.begin() + from, other.z_.begin() + to);
+    }
+
+    void append(AccelerationFrame &&other) {
+      if (empty()) {
+        *this = std::move(other);
+        return;
+      }
+      append(static_cast<const AccelerationFrame &>(other));
+    }
+
+    AccelerationData row(size_t i) const {
+      return {ts_ns_[i], x_[i], y_[i], z_[i]};
+    }
+
+    std::span<const int64_t> ts_ns() const { return ts_ns_; }
+    std::span<const double> acc_x() const { return x_; }
+    std::span<const double> acc_y() const { return y_; }
+    std::span<const double> acc_z() const { return z_; }
+
+    bool is_sorted_by_time() const {
+      return std::is_sorted(ts_ns_.begin(), ts_ns_.end());
+    }
+
+    // Stable sort by timestamp through an index permutation; a frame that is
+    // already ordered costs one pass.
+    void sort_by_time() {
+      profile::Scope scope("sort");
+      scope.rows(size());
+      if (is_sorted_by_time()) return;
+      std::vector<size_t> order(size());
+      std::iota(order.begin(), order.end(), size_t(0));
+      std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return ts_ns_[a] < ts_ns_[b];
+      });
+      permute(ts_ns_, order);
+      permute(x_, order);
+      permute(y_, order);
+      permute(z_, order);
+    }
+
+  private:
+    // Grows capacity in whole chunks, at least 1.5x, so long recordings
+    // don't reallocate four columns on every doubling boundary.
+    void grow(size_t extra) {
+      size_t need = ts_ns_.size() + extra;
+      if (need <= ts_ns_.capacity()) return;
+      size_t cap = std::max(need, ts_ns_.capacity() + ts_ns_.capacity() / 2);
+      cap = (cap + kGrowChunk - 1) / kGrowChunk * kGrowChunk;
+      profile::Scope scope("frame.grow");
+      scope.bytes(size() * sizeof(AccelerationData));  // moved by the regrowth
+      reserve(cap);
+    }
+
+    template <typename T>
+    static void permute(std::vector<T> &col, const std::vector<size_t> &order) {
+      std::vector<T> out;
+      out.reserve(col.size());
+      for (size_t i : order) out.push_back(col[i]);
+      col = std::move(out);
+    }
+
+    std::vector<int64_t> ts_ns_;
+    std::vector<double> x_;
+    std::vector<double> y_;
+    std::vector<double> z_;
+  };
+
+  inline void append_batch(AccelerationFrame &dst, AccelerationFrame &&src) {
+    dst.append(std::move(src));
+  }
+}
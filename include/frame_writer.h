@@ -0,0 +1,168 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "arena.h"
+#include "bounded_queue.h"
+#include "profiling.h"
+
+namespace common {
+  enum class FsyncPolicy {
+    kNone,     // leave flushing to the OS
+    kEachFile, // fdatasync every frame before it is reported as written
+    kOnClose,  // fsync the written frames once, when the writer closes
+  };
+
+  struct FrameWriterOptions {
+    std::filesystem::path dir = "img";
+    std::string manifest = "manifest.csv";
+    size_t writers = 2;
+    size_t queue_depth = 16;
+    FsyncPolicy fsync = FsyncPolicy::kNone;
+  };
+
+  struct FrameJob {
+    std::string name;  // file name relative to the output directory
+    std::string blob;
+    int64_t ts_us;
+    std::string content_type;
+  };
+
+  // Writes frames on a pool of threads so the query callback only moves the
+  // blob into a bounded queue. When the queue is full submit() blocks, which
+  // in turn slows down the HTTP stream instead of growing memory. close()
+  // drains the queue and writes one manifest line per frame, ordered by
+  // timestamp: ts_us,size,content_type,path.
+  class AsyncFrameWriter {
+  public:
+    explicit AsyncFrameWriter(FrameWriterOptions options)
+        : options_(std::move(options)), queue_(options_.queue_depth),
+          blobs_(options_.queue_depth + options_.writers + 1) {
+      std::filesystem::create_directories(options_.dir);
+      size_t n = std::max<size_t>(1, options_.writers);
+      for (size_t i = 0; i < n; ++i) pool_.emplace_back([this] { run(); });
+    }
+
+    AsyncFrameWriter(const AsyncFrameWriter &) = delete;
+    AsyncFrameWriter &operator=(const AsyncFrameWriter &) = delete;
+
+    ~AsyncFrameWriter() { close(); }
+
+    bool submit(FrameJob job) { return queue_.push(std::move(job)); }
+
+    // A blob buffer to read the next frame into; written frames hand their
+    // buffers back, so steady-state reading doesn't allocate.
+    std::string acquire_blob() { return blobs_.acquire(); }
+
+    // Returns true if every frame and the manifest were written.
+    bool close() {
+      if (closed_) return failed_ == 0;
+      closed_ = true;
+      queue_.close();
+      for (auto &t : pool_) t.join();
+      pool_.clear();
+      if (options_.fsync == FsyncPolicy::kOnClose) {
+        for (const auto &row : manifest_) {
+          if (!sync_path(row.path)) ++failed_;
+        }
+      }
+      if (!write_manifest()) ++failed_;
+      // The new directory entries are only durable once the directory is.
+      if (options_.fsync != FsyncPolicy::kNone && !sync_path(options_.dir)) ++failed_;
+      return failed_ == 0;
+    }
+
+    size_t written() const { return written_; }
+    size_t failed() const { return failed_; }
+    std::filesystem::path manifest_path() const {
+      return options_.dir / options_.manifest;
+    }
+
+  private:
+    struct ManifestRow {
+      int64_t ts_us;
+      size_t size;
+      std::string content_type;
+      std::string path;
+    };
+
+    void run() {
+      static auto &stage = profile::stage("write");
+      while (auto job = queue_.pop()) {
+        profile::Scope scope(stage);
+        scope.bytes(job->blob.size());
+        auto path = options_.dir / job->name;
+        if (!write_file(path, job->blob, options_.fsync == FsyncPolicy::kEachFile)) {
+          ++failed_;
+          continue;
+        }
+        ++written_;
+        std::lock_guard lock(manifest_mutex_);
+        manifest_.push_back({job->ts_us, job->blob.size(),
+                             std::move(job->content_type), path.string()});
+        blobs_.release(std::move(job->blob));
+      }
+    }
+
+    static bool write_file(const std::filesystem::path &path,
+                           std::string_view data, bool sync) {
+      int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) return false;
+      bool ok = true;
+      while (!data.empty()) {
+        ssize_t n = ::write(fd, data.data(), data.size());
+        if (n < 0) {
+          if (errno == EINTR) continue;
+          ok = false;
+          break;
+        }
+        data.remove_prefix(size_t(n));
+      }
+      if (ok && sync) ok = ::fdatasync(fd) == 0;
+      return ::close(fd) == 0 && ok;
+    }
+
+    // Flushes a file or directory this writer created, without touching the
+    // rest of the file system.
+    static bool sync_path(const std::filesystem::path &path) {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) return false;
+      bool ok = ::fsync(fd) == 0;
+      return ::close(fd) == 0 && ok;
+    }
+
+    bool write_manifest() {
+      std::sort(manifest_.begin(), manifest_.end(),
+                [](const ManifestRow &a, const ManifestRow &b) {
+                  return a.ts_us < b.ts_us;
+                });
+      std::string out = "ts_us,size,content_type,path\n";
+      for (const auto &row : manifest_) {
+        out += std::to_string(row.ts_us) + "," + std::to_string(row.size) + "," +
+               row.content_type + "," + row.path + "\n";
+      }
+      return write_file(manifest_path(), out, options_.fsync != FsyncPolicy::kNone);
+    }
+
+    FrameWriterOptions options_;
+    BoundedQueue<FrameJob> queue_;
+    BlobPool blobs_;
+    std::vector<std::thread> pool_;
+    std::mutex manifest_mutex_;
+    std::vector<ManifestRow> manifest_;
+    std::atomic<size_t> written_{0};
+    std::atomic<size_t> failed_{0};
+    bool closed_ = false;
+  };
+}
@@ -0,0 +1,295 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <queue>
+#include <string>
+#include <vector>
+#include <reduct/client.h>
+#include "parallel_query.h"
+#include "profiling.h"
+#include "query_cache.h"
+
+namespace common {
+  // Counts of values by power of two: bucket k holds [2^(k-1), 2^k), bucket
+  // 0 holds 0. Fixed size, so histograms merge and save trivially.
+  struct Log2Histogram {
+    std::array<uint64_t, 65> counts{};
+
+    static size_t bucket(uint64_t v) { return size_t(std::bit_width(v)); }
+    // Smallest value of bucket k.
+    static uint64_t lower(size_t k) { return k == 0 ? 0 : uint64_t(1) << (k - 1); }
+
+    void add(uint64_t v) { ++counts[bucket(v)]; }
+    void merge(const Log2Histogram &o) {
+      for (size_t k = 0; k < counts.size(); ++k) counts[k] += o.counts[k];
+    }
+    uint64_t total() const {
+      uint64_t n = 0;
+      for (auto c : counts) n += c;
+      return n;
+    }
+
+    // Lower bound of the bucket holding the q-quantile; 0 when empty.
+    uint64_t quantile(double q) const {
+      const uint64_t n = total();
+      if (n == 0) return 0;
+      const uint64_t rank = uint64_t(q * double(n - 1));
+      uint64_t seen = 0;
+      for (size_t k = 0; k < counts.size(); ++k) {
+        seen += counts[k];
+        if (seen > rank) return lower(k);
+      }
+      return lower(counts.size() - 1);
+    }
+  };
+
+  struct InventoryOptions {
+    // Inter-arrival times at least this long are gaps.
+    int64_t min_gap_us = 1'000'000;
+    // The longest gaps kept per entry.
+    size_t max_gaps = 32;
+    // Window for the peak record rate.
+    int64_t burst_window_us = 1'000'000;
+    size_t workers = 0;  // 0 = one per entry, up to hardware concurrency
+    // Scan even when a cached inventory is still valid.
+    bool refresh = false;
+  };
+
+  struct TimeGap {
+    int64_t start_us;  // last record before the gap
+    int64_t end_us;    // first record after it
+    int64_t length_us() const { return end_us - start_us; }
+  };
+
+  // Timing profile of one entry, built from record metadata only.
+  struct EntryInventory {
+    std::string name;
+    // The entry as listed when scanned; a cached inventory is reused while
+    // these still match.
+    uint64_t listed_records = 0;
+    int64_t listed_latest_us = 0;
+    // The options the gaps and peak were computed with; a cached inventory
+    // built with others is scanned again.
+    int64_t min_gap_us = 0;
+    uint64_t max_gaps = 0;
+    int64_t burst_window_us = 0;
+
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    int64_t first_us = 0;
+    int64_t last_us = 0;
+    uint64_t out_of_order = 0;
+    Log2Histogram sizes;          // bytes per record
+    Log2Histogram inter_arrival;  // us between consecutive records
+    std::vector<TimeGap> gaps;    // longest first-to-last, in time order
+    uint64_t gap_count = 0;       // including those not kept
+    int64_t gap_us = 0;           // total time in gaps
+    uint64_t peak_records = 0;    // most records in one burst window
+    bool from_cache = false;      // loaded rather than scanned; not saved
+
+    double seconds() const { return double(last_us - first_us) / 1e6; }
+    // Records per second, gaps included.
+    double rate() const { return records > 1 && last_us > first_us ? double(records - 1) / seconds() : 0; }
+    double bytes_per_second() const { return last_us > first_us ? double(bytes) / seconds() : 0; }
+  };
+
+  namespace inventory {
+    constexpr char kMagic[4] = {'R', 'I', 'N', 'V'};
+    constexpr uint32_t kVersion = 2;
+
+    // Accumulates one entry's records in arrival order, in constant memory
+    // apart from the burst window.
+    class Builder {
+    public:
+      Builder(EntryInventory &inv, const InventoryOptions &options)
+          : inv_(inv), options_(options) {}
+
+      void add(int64_t ts_us, uint64_t size) {
+        if (inv_.records == 0) inv_.first_us = ts_us;
+        ++inv_.records;
+        inv_.bytes += size;
+        inv_.sizes.add(size);
+        if (inv_.records > 1) {
+          if (ts_us < inv_.last_us) {
+            ++inv_.out_of_order;
+            return;
+          }
+          const int64_t dt = ts_us - inv_.last_us;
+          inv_.inter_arrival.add(uint64_t(dt));
+          if (dt >= options_.min_gap_us) add_gap({inv_.last_us, ts_us});
+        }
+        inv_.last_us = ts_us;
+
+        window_.push_back(ts_us);
+        while (window_.front() <= ts_us - options_.burst_window_us) window_.pop_front();
+        inv_.peak_records = std::max<uint64_t>(inv_.peak_records, window_.size());
+      }
+
+      void finish() {
+        inv_.gaps.clear();
+        for (; !longest_.empty(); longest_.pop()) inv_.gaps.push_back(longest_.top());
+        std::sort(inv_.gaps.begin(), inv_.gaps.end(),
+                  [](const TimeGap &a, const TimeGap &b) { return a.start_us < b.start_us; });
+      }
+
+    private:
+      struct Shorter {
+        bool operator()(const TimeGap &a, const TimeGap &b) const {
+          return a.length_us() > b.length_us();
+        }
+      };
+
+      void add_gap(const TimeGap &gap) {
+        ++inv_.gap_count;
+        inv_.gap_us += gap.length_us();
+        if (options_.max_gaps == 0) return;
+        if (longest_.size() < options_.max_gaps) {
+          longest_.push(gap);
+        } else if (gap.length_us() > longest_.top().length_us()) {
+          longest_.pop();
+          longest_.push(gap);
+        }
+      }
+
+      EntryInventory &inv_;
+      const InventoryOptions &options_;
+      std::deque<int64_t> window_;
+      // Min-heap on length: the shortest kept gap is the one to drop.
+      std::priority_queue<TimeGap, std::vector<TimeGap>, Shorter> longest_;
+    };
+
+    inline std::filesystem::path path(const std::filesystem::path &root, std::string_view entry) {
+      return cache_entry_dir(root, entry, {}) / "inventory.inv";
+    }
+  }
+
+  inline bool save_inventory(const std::filesystem::path &path, const EntryInventory &inv) {
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    const auto tmp = path.string() + ".tmp";
+    {
+      std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+      auto put = [&](auto v) { out.write(reinterpret_cast<const char *>(&v), sizeof(v)); };
+      out.write(inventory::kMagic, 4);
+      put(inventory::kVersion);
+      put(uint32_t(inv.name.size()));
+      out.write(inv.name.data(), std::streamsize(inv.name.size()));
+      for (auto v : {inv.listed_records, inv.max_gaps, inv.records, inv.bytes,
+                     inv.out_of_order, inv.gap_count, inv.peak_records}) {
+        put(v);
+      }
+      for (auto v : {inv.listed_latest_us, inv.min_gap_us, inv.burst_window_us, inv.first_us,
+                     inv.last_us, inv.gap_us}) {
+        put(v);
+      }
+      put(inv.sizes.counts);
+      put(inv.inter_arrival.counts);
+      put(uint64_t(inv.gaps.size()));
+      out.write(reinterpret_cast<const char *>(inv.gaps.data()),
+                std::streamsize(inv.gaps.size() * sizeof(TimeGap)));
+      if (!out) return false;
+    }
+    std::filesystem::rename(tmp, path, ec);
+    return !ec;
+  }
+
+  inline std::optional<EntryInventory> load_inventory(const std::filesystem::path &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return std::nullopt;
+    auto get = [&](auto &v) {
+      in.read(reinterpret_cast<char *>(&v), sizeof(v));
+      return bool(in);
+    };
+    char magic[4];
+    uint32_t version = 0, name_len = 0;
+    in.read(magic, 4);
+    if (!in || !std::equal(magic, magic + 4, inventory::kMagic) || !get(version) ||
+        version != inventory::kVersion || !get(name_len) || name_len > 4096) {
+      return std::nullopt;
+    }
+    EntryInventory inv;
+    inv.name.resize(name_len);
+    in.read(inv.name.data(), name_len);
+    uint64_t n_gaps = 0;
+    if (!get(inv.listed_records) || !get(inv.max_gaps) || !get(inv.records) ||
+        !get(inv.bytes) || !get(inv.out_of_order) || !get(inv.gap_count) ||
+        !get(inv.peak_records) || !get(inv.listed_latest_us) || !get(inv.min_gap_us) ||
+        !get(inv.burst_window_us) || !get(inv.first_us) || !get(inv.last_us) ||
+        !get(inv.gap_us) || !get(inv.sizes.counts) || !get(inv.inter_arrival.counts) ||
+        !get(n_gaps) || n_gaps > (uint64_t(1) << 20)) {
+      return std::nullopt;
+    }
+    inv.gaps.resize(n_gaps);
+    in.read(reinterpret_cast<char *>(inv.gaps.data()), std::streamsize(n_gaps * sizeof(TimeGap)));
+    if (!in) return std::nullopt;
+    return inv;
+  }
+
+  // Profiles one entry with a head-only query over its whole range: only
+  // timestamps and sizes cross the network.
+  template <typename Connect>
+  reduct::Result<EntryInventory> scan_entry(const Connect &connect,
+                                            const reduct::IBucket::EntryInfo &entry,
+                                            const InventoryOptions &options = {}) {
+    profile::Scope scope("inventory.entry");
+    EntryInventory inv;
+    inv.name = entry.name;
+    inv.listed_records = entry.record_count;
+    inv.listed_latest_us = entry.latest_record.time_since_epoch().count();
+    inv.min_gap_us = options.min_gap_us;
+    inv.max_gaps = options.max_gaps;
+    inv.burst_window_us = options.burst_window_us;
+    auto bucket = connect();
+    if (!bucket) return {inv, reduct::Error{.code = -1, .message = "Failed to connect bucket"}};
+
+    inventory::Builder builder(inv, options);
+    auto err = bucket->Query(entry.name, entry.oldest_record,
+                             entry.latest_record + std::chrono::microseconds(1),
+                             {.head_only = true},
+                             [&](const reduct::IBucket::ReadableRecord &rec) {
+                               builder.add(rec.timestamp.time_since_epoch().count(), rec.size);
+                               return true;
+                             });
+    builder.finish();
+    scope.rows(inv.records);
+    return {std::move(inv), err};
+  }
+
+  // Profiles every entry concurrently, one connection per worker. Entries
+  // whose cached inventory under `cache` still matches the listing (record
+  // count and latest record) and was built with the same gap and burst
+  // options are loaded instead, unless options.refresh.
+  // Fresh scans are written back; an empty `cache` turns caching off.
+  template <typename Connect>
+  std::vector<reduct::Result<EntryInventory>>
+  scan_inventory(const Connect &connect, const std::vector<reduct::IBucket::EntryInfo> &entries,
+                 const InventoryOptions &options = {},
+                 const std::filesystem::path &cache = cache_root()) {
+    std::vector<reduct::Result<EntryInventory>> out(entries.size());
+    parallel_for(entries.size(), [&](size_t i) {
+      const auto &entry = entries[i];
+      const auto path = cache.empty() ? std::filesystem::path{} : inventory::path(cache, entry.name);
+      if (!path.empty() && !options.refresh) {
+        if (auto inv = load_inventory(path);
+            inv && inv->listed_records == entry.record_count &&
+            inv->listed_latest_us == entry.latest_record.time_since_epoch().count() &&
+            inv->min_gap_us == options.min_gap_us && inv->max_gaps == options.max_gaps &&
+            inv->burst_window_us == options.burst_window_us) {
+          inv->from_cache = true;
+          out[i] = {std::move(*inv), reduct::Error::kOk};
+          return;
+        }
+      }
+      out[i] = scan_entry(connect, entry, options);
+      if (!path.empty() && out[i].error == reduct::Error::kOk) save_inventory(path, out[i].result);
+    }, options.workers);
+    return out;
+  }
+}
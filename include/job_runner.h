@@ -0,0 +1,419 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include <reduct/client.h>
+#include "arena.h"
+#include "columnar_export.h"
+#include "data_structures.h"
+#include "frame_writer.h"
+#include "json_decoder.h"
+#include "parallel_query.h"
+#include "pointcloud.h"
+#include "profiling.h"
+#include "schema.h"
+#include "streaming.h"
+#include "utilities.h"
+
+namespace common {
+  enum class JobSink {
+    kCount,   // read and drop the payload
+    kCsv,     // IMU rows of a CSV select
+    kJson,    // IMU rows of a JSON select
+    kRos,     // IMU rows of the ROS extension's JSON
+    kFiles,   // one file per record, plus a manifest
+    kPoints,  // PointCloud2 scans, laid out by their labels
+  };
+
+  // One query of a batch and what to do with its records. `output` is the
+  // columnar export for the row and point sinks (none when empty) and the
+  // directory for kFiles (the job's name when empty).
+  struct Job {
+    std::string name;
+    std::string entry;
+    reduct::IBucket::QueryOptions options;
+    std::optional<Time> start;
+    std::optional<Time> stop;
+    JobSink sink = JobSink::kCount;
+    std::string output;
+  };
+
+  inline std::optional<JobSink> parse_sink(std::string_view name) {
+    if (name == "count") return JobSink::kCount;
+    if (name == "csv") return JobSink::kCsv;
+    if (name == "json") return JobSink::kJson;
+    if (name == "ros") return JobSink::kRos;
+    if (name == "files") return JobSink::kFiles;
+    if (name == "points") return JobSink::kPoints;
+    return std::nullopt;
+  }
+
+  // Reads a job list:
+  //   [{"name": "csv", "entry": "csv__vectornav_IMU", "sink": "csv",
+  //     "when": {...}, "start": ISO, "stop": ISO, "output": "csv.rcol"}, ...]
+  // For the csv and json sinks `when` goes into the select extension unless
+  // "ext" is given; the ros sink builds its extension from "topic". Other
+  // sinks pass "when" and "ext" to the query as they are.
+  inline std::optional<std::vector<Job>> parse_jobs(const nlohmann::json &list,
+                                                    std::string *error = nullptr) {
+    auto fail = [&](std::string message) -> std::optional<std::vector<Job>> {
+      if (error) *error = std::move(message);
+      return std::nullopt;
+    };
+    if (!list.is_array()) return fail("the job list must be an array");
+
+    std::vector<Job> jobs;
+    for (const auto &spec : list) {
+      const std::string where = "job " + std::to_string(jobs.size() + 1);
+      if (!spec.is_object() || !spec.contains("entry") || !spec["entry"].is_string()) {
+        return fail(where + ": needs an \"entry\"");
+      }
+      Job job;
+      job.entry = spec["entry"].get<std::string>();
+      job.name = spec.value("name", job.entry);
+      job.output = spec.value("output", std::string{});
+      auto sink = parse_sink(spec.value("sink", std::string("count")));
+      if (!sink) return fail(where + ": unknown sink");
+      job.sink = *sink;
+
+      try {
+        if (spec.contains("start")) job.start = parse_time(spec["start"].get<std::string>());
+        if (spec.contains("stop")) job.stop = parse_time(spec["stop"].get<std::string>());
+      } catch (const std::exception &) {
+        return fail(where + ": bad start or stop time");
+      }
+
+      std::string when = spec.contains("when") ? spec["when"].dump() : std::string{};
+      if (spec.contains("ext")) {
+        job.options.ext = spec["ext"].dump();
+      } else if (job.sink == JobSink::kCsv || job.sink == JobSink::kJson) {
+        job.options.ext = ImuSchema::select_ext(
+            job.sink == JobSink::kCsv ? SelectFormat::kCsv : SelectFormat::kJson, when);
+        when.clear();
+      } else if (job.sink == JobSink::kRos) {
+        if (!spec.contains("topic")) return fail(where + ": the ros sink needs a \"topic\"");
+        job.options.ext = nlohmann::json{{"ros", {{"extract", {{"topic", spec["topic"]}}}}}}.dump();
+      }
+      if (!when.empty()) job.options.when = when;
+      jobs.push_back(std::move(job));
+    }
+    return jobs;
+  }
+
+  struct JobRunnerOptions {
+    size_t max_queries = 4;  // jobs running at once
+    size_t max_bytes_in_flight = 64 * 1024 * 1024;
+  };
+
+  // Bytes of the records being read and decoded, across all jobs. acquire()
+  // blocks while the budget is used up, which stalls that job's HTTP stream.
+  // A record larger than the whole budget is let through alone, as in
+  // DecodePipeline::push().
+  class ByteBudget {
+  public:
+    explicit ByteBudget(size_t limit) : limit_(limit) {}
+
+    void acquire(size_t bytes) {
+      std::unique_lock lock(mutex_);
+      if (in_flight_ != 0 && in_flight_ + bytes > limit_) {
+        ++waits_;
+        released_.wait(lock, [&] { return in_flight_ == 0 || in_flight_ + bytes <= limit_; });
+      }
+      in_flight_ += bytes;
+      peak_ = std::max(peak_, in_flight_);
+    }
+
+    void release(size_t bytes) {
+      {
+        std::lock_guard lock(mutex_);
+        in_flight_ -= bytes;
+      }
+      released_.notify_all();
+    }
+
+    size_t peak() const {
+      std::lock_guard lock(mutex_);
+      return peak_;
+    }
+    uint64_t waits() const {
+      std::lock_guard lock(mutex_);
+      return waits_;
+    }
+
+  private:
+    mutable std::mutex mutex_;
+    std::condition_variable released_;
+    size_t limit_;
+    size_t in_flight_ = 0;
+    size_t peak_ = 0;
+    uint64_t waits_ = 0;
+  };
+
+  // Connections opened by connect() are handed back when a job is done and
+  // reused by the next one, so later jobs start on a warm keep-alive
+  // connection. A lease whose query failed is dropped instead.
+  template <typename Connect>
+  class SourcePool {
+  public:
+    using Pointer = std::invoke_result_t<const Connect &>;
+
+    class Lease {
+    public:
+      Lease(SourcePool *pool, Pointer source) : pool_(pool), source_(std::move(source)) {}
+      Lease(Lease &&other) noexcept
+          : pool_(std::exchange(other.pool_, nullptr)), source_(std::move(other.source_)) {}
+      Lease(const Lease &) = delete;
+      Lease &operator=(const Lease &) = delete;
+      ~Lease() {
+        if (pool_ && source_) pool_->give_back(std::move(source_));
+      }
+
+      explicit operator bool() const { return bool(source_); }
+      auto &operator*() const { return *source_; }
+      auto *operator->() const { return &*source_; }
+      void discard() { source_ = nullptr; }
+
+    private:
+      SourcePool *pool_;
+      Pointer source_;
+    };
+
+    explicit SourcePool(const Connect &connect) : connect_(connect) {}
+
+    Lease lease() {
+      {
+        std::lock_guard lock(mutex_);
+        if (!idle_.empty()) {
+          Pointer source = std::move(idle_.back());
+          idle_.pop_back();
+          return {this, std::move(source)};
+        }
+        ++opened_;
+      }
+      return {this, connect_()};
+    }
+
+    size_t opened() const {
+      std::lock_guard lock(mutex_);
+      return opened_;
+    }
+
+  private:
+    void give_back(Pointer source) {
+      std::lock_guard lock(mutex_);
+      idle_.push_back(std::move(source));
+    }
+
+    const Connect &connect_;
+    mutable std::mutex mutex_;
+    std::vector<Pointer> idle_;
+    size_t opened_ = 0;
+  };
+
+  struct JobResult {
+    std::string name;
+    reduct::Error error = reduct::Error::kOk;
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    uint64_t rows = 0;      // decoded rows or points, or files written
+    uint64_t bad_rows = 0;  // lines or records that failed to decode
+    uint64_t estimated_bytes = 0;
+    double started_s = 0;  // since the start of the run
+    double seconds = 0;
+  };
+
+  struct JobRun {
+    std::vector<JobResult> jobs;  // in the order of the job list
+    double seconds = 0;
+    size_t connections = 0;
+    size_t peak_bytes_in_flight = 0;
+    uint64_t byte_waits = 0;
+  };
+
+  // Share of the entry's bytes in [start, stop), assuming they are spread
+  // evenly over its time range as plan_shards() does.
+  inline uint64_t estimate_bytes(const reduct::IBucket::EntryInfo &entry,
+                                 std::optional<Time> start, std::optional<Time> stop) {
+    const Time entry_stop = entry.latest_record + std::chrono::microseconds(1);
+    const Time lo = std::max(start.value_or(entry.oldest_record), entry.oldest_record);
+    const Time hi = std::min(stop.value_or(entry_stop), entry_stop);
+    if (hi <= lo || entry.record_count == 0) return 0;
+    const double span = double((entry_stop - entry.oldest_record).count());
+    return uint64_t(double(entry.size) * double((hi - lo).count()) / span);
+  }
+
+  // Runs one job to completion on `source`, filling in `result`.
+  template <typename Source>
+  void run_job(Source &source, const Job &job, ByteBudget &budget, JobResult &result) {
+    static auto &record_stage = profile::stage("jobs.record");
+    AccelerationFrame frame;
+    std::unique_ptr<AsyncFrameWriter> files;
+    std::unique_ptr<ColumnarWriter> points;
+    if (job.sink == JobSink::kFiles) {
+      files = std::make_unique<AsyncFrameWriter>(
+          FrameWriterOptions{.dir = job.output.empty() ? job.name : job.output});
+    } else if (job.sink == JobSink::kPoints && !job.output.empty()) {
+      points = std::make_unique<ColumnarWriter>(job.output, columnar::point_columns());
+    }
+    std::string scan;
+
+    auto push = [&](const AccelerationData &row) { frame.push_back(row); };
+    reduct::Error read_err = reduct::Error::kOk;
+    auto err = source.Query(
+        job.entry, job.start, job.stop, job.options,
+        [&](const reduct::IBucket::ReadableRecord &rec) {
+          budget.acquire(rec.size);
+          ArenaScope arena;
+          profile::Scope scope(record_stage);
+          scope.bytes(rec.size);
+          ++result.records;
+          result.bytes += rec.size;
+
+          reduct::Error r_err = reduct::Error::kOk;
+          switch (job.sink) {
+            case JobSink::kCount:
+              r_err = rec.Read([](std::string_view) { return true; });
+              break;
+            case JobSink::kCsv: {
+              auto [res, e] = stream_csv(rec, ImuSchema{}, true, push,
+                                         [&](size_t, std::string_view, CsvStatus) {
+                                           ++result.bad_rows;
+                                         });
+              r_err = e;
+              break;
+            }
+            case JobSink::kJson:
+            case JobSink::kRos: {
+              auto [res, e] = job.sink == JobSink::kJson
+                                  ? stream_json(rec, ImuSchema{}, push)
+                                  : stream_json(rec, ros_imu_schema(), push);
+              if (res.status != JsonStatus::kOk) ++result.bad_rows;
+              r_err = e;
+              break;
+            }
+            case JobSink::kFiles: {
+              std::string blob = files->acquire_blob();
+              r_err = read_blob(rec, blob);
+              if (r_err != reduct::Error::kOk) break;
+              const int64_t ts_us = rec.timestamp.time_since_epoch().count();
+              const bool png = rec.content_type.find("png") != std::string::npos;
+              files->submit({.name = std::to_string(ts_us) + (png ? ".png" : ".jpg"),
+                             .blob = std::move(blob),
+                             .ts_us = ts_us,
+                             .content_type = rec.content_type});
+              ++result.rows;
+              break;
+            }
+            case JobSink::kPoints: {
+              r_err = read_blob(rec, scan);
+              if (r_err != reduct::Error::kOk) break;
+              auto layout = PointLayout::from_labels(rec.labels);
+              if (!layout) ++result.bad_rows;
+              auto cloud = PointCloudView::from_blob(scan, layout.value_or(PointLayout{}));
+              result.rows += cloud.points().size();
+              if (points) {
+                append_scan(*points, rec.timestamp.time_since_epoch().count() * 1000,
+                            cloud.points());
+              }
+              break;
+            }
+          }
+          budget.release(rec.size);
+          if (r_err != reduct::Error::kOk) {
+            read_err = r_err;
+            return false;
+          }
+          return true;
+        });
+    if (err == reduct::Error::kOk) err = read_err;
+
+    if (job.sink == JobSink::kCsv || job.sink == JobSink::kJson || job.sink == JobSink::kRos) {
+      result.rows = frame.size();
+      if (err == reduct::Error::kOk && !job.output.empty() && !frame.empty()) {
+        frame.sort_by_time();
+        if (!export_frame(job.output, frame)) {
+          err = {.code = -1, .message = "Failed to export to " + job.output};
+        }
+      }
+    } else if (files && !files->close() && err == reduct::Error::kOk) {
+      err = {.code = -1, .message = "Failed to write " + std::to_string(files->failed()) + " file(s)"};
+    } else if (points && !points->close() && err == reduct::Error::kOk) {
+      err = {.code = -1, .message = "Failed to export to " + job.output};
+    }
+    result.error = std::move(err);
+  }
+
+  // Runs a batch of jobs in one process. Up to max_queries jobs run at once,
+  // each on a connection leased from one pool, so the batch pays for at most
+  // max_queries connections instead of one client per job. The records of
+  // all running jobs share one byte budget. Jobs start largest first by
+  // their estimated bytes, so the batch takes about as long as its slowest
+  // job rather than the sum of all of them.
+  template <typename Connect>
+  JobRun run_jobs(const Connect &connect, const std::vector<Job> &jobs,
+                  const JobRunnerOptions &options = {}) {
+    profile::Scope scope("jobs");
+    JobRun run;
+    run.jobs.resize(jobs.size());
+    SourcePool<Connect> pool(connect);
+    ByteBudget budget(options.max_bytes_in_flight);
+
+    std::vector<size_t> order(jobs.size());
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      order[i] = i;
+      run.jobs[i].name = jobs[i].name;
+    }
+    if (auto source = pool.lease()) {
+      profile::Scope plan_scope("jobs.plan");
+      auto [entries, err] = source->GetEntryList();
+      for (size_t i = 0; i < jobs.size() && err == reduct::Error::kOk; ++i) {
+        auto it = std::find_if(entries.begin(), entries.end(),
+                               [&](const auto &e) { return e.name == jobs[i].entry; });
+        if (it == entries.end()) {
+          run.jobs[i].error = {.code = 404, .message = "No entry " + jobs[i].entry};
+        } else {
+          run.jobs[i].estimated_bytes = estimate_bytes(*it, jobs[i].start, jobs[i].stop);
+        }
+      }
+      std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return run.jobs[a].estimated_bytes > run.jobs[b].estimated_bytes;
+      });
+    }
+
+    const auto t0 = std::chrono::steady_clock::now();
+    auto since = [&](std::chrono::steady_clock::time_point t) {
+      return std::chrono::duration<double>(t - t0).count();
+    };
+    parallel_for(order.size(), [&](size_t k) {
+      auto &result = run.jobs[order[k]];
+      if (result.error != reduct::Error::kOk) return;
+      const auto started = std::chrono::steady_clock::now();
+      result.started_s = since(started);
+      auto source = pool.lease();
+      if (!source) {
+        result.error = {.code = -1, .message = "Failed to connect bucket"};
+        return;
+      }
+      run_job(*source, jobs[order[k]], budget, result);
+      if (result.error != reduct::Error::kOk) source.discard();
+      result.seconds = since(std::chrono::steady_clock::now()) - result.started_s;
+    }, std::max<size_t>(1, options.max_queries));
+
+    run.seconds = since(std::chrono::steady_clock::now());
+    run.connections = pool.opened();
+    run.peak_bytes_in_flight = budget.peak();
+    run.byte_waits = budget.waits();
+    return run;
+  }
+}
@@ -0,0 +1,375 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "arena.h"
+#include "data_structures.h"
+
+namespace common {
+  enum class JsonField {
+    kTsNs,
+    kTsSec,
+    kTsNanosec,
+    kAccX,
+    kAccY,
+    kAccZ,
+  };
+
+  struct JsonFieldSpec {
+    std::vector<std::string> path;
+    JsonField target;
+  };
+
+  // Fields to project out of a document. row_depth is the nesting level of
+  // the object that holds one row: 1 for a message that is itself the row,
+  // 2 for an array of row objects.
+  struct JsonSchema {
+    std::vector<JsonFieldSpec> fields;
+    size_t row_depth;
+  };
+
+  enum class JsonStatus {
+    kOk,
+    kSyntaxError,
+    kMissingField,
+  };
+
+  inline const char *to_string(JsonStatus status) {
+    switch (status) {
+    case JsonStatus::kOk: return "ok";
+    case JsonStatus::kSyntaxError: return "syntax error";
+    case JsonStatus::kMissingField: return "missing field";
+    }
+    return "unknown";
+  }
+
+  struct JsonDecodeResult {
+    size_t rows = 0;
+    size_t incomplete_rows = 0;
+    JsonStatus status = JsonStatus::kOk;
+  };
+
+  // Rows produced by the "select.columns" extension:
+  // [{"ts_ns": ..., "linear_acceleration_x": ..., ...}, ...]
+  inline const JsonSchema &select_columns_schema() {
+    static const JsonSchema schema{
+        {{{"ts_ns"}, JsonField::kTsNs},
+         {{"linear_acceleration_x"}, JsonField::kAccX},
+         {{"linear_acceleration_y"}, JsonField::kAccY},
+         {{"linear_acceleration_z"}, JsonField::kAccZ}},
+        2};
+    return schema;
+  }
+
+  // sensor_msgs/Imu as emitted by the "ros.extract" extension.
+  inline const JsonSchema &ros_imu_schema() {
+    static const JsonSchema schema{
+        {{{"header", "stamp", "sec"}, JsonField::kTsSec},
+         {{"header", "stamp", "nanosec"}, JsonField::kTsNanosec},
+         {{"linear_acceleration", "x"}, JsonField::kAccX},
+         {{"linear_acceleration", "y"}, JsonField::kAccY},
+         {{"linear_acceleration", "z"}, JsonField::kAccZ}},
+        1};
+    return schema;
+  }
+
+  // nlohmann SAX handler that keeps only the schema fields. Each open
+  // container carries a bitmask of the schema entries whose path still
+  // matches, so subtrees outside the projection cost one mask test per
+  // event and nothing is stored for them.
+  template <typename Sink>
+  class AccelerationSax {
+  public:
+    using json = nlohmann::json;
+
+    AccelerationSax(const JsonSchema &schema, Sink &sink)
+        : AccelerationSax(schema, sink, schema.row_depth) {}
+
+    // Overrides the schema's row depth, e.g. to decode one row object that
+    // was cut out of a larger document.
+    AccelerationSax(const JsonSchema &schema, Sink &sink, size_t row_depth,
+                    std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : schema_(schema), row_depth_(row_depth), sink_(sink), stack_(mr) {
+      for (size_t i = 0; i < schema_.fields.size() && i < 64; ++i) {
+        all_mask_ |= uint64_t(1) << i;
+      }
+      stack_.reserve(8);
+    }
+
+    const JsonDecodeResult &result() const { return result_; }
+
+    bool null() { return skip_value(); }
+    bool boolean(bool) { return skip_value(); }
+    bool number_integer(json::number_integer_t v) { return set_value(v, double(v)); }
+    bool number_unsigned(json::number_unsigned_t v) {
+      return set_value(int64_t(v), double(v));
+    }
+    bool number_float(json::number_float_t v, const json::string_t &) {
+      return set_value(int64_t(v), v);
+    }
+    bool string(json::string_t &) { return skip_value(); }
+    bool binary(json::binary_t &) { return skip_value(); }
+
+    bool start_object(std::size_t) {
+      uint64_t mask = 0;
+      if (stack_.size() + 1 == row_depth_) {
+        mask = all_mask_;
+        row_ = {};
+        seen_ = 0;
+        sec_ = nanosec_ = 0;
+        stamped_ = false;
+      } else if (in_row() && !stack_.back().array) {
+        mask = narrow(key_mask_, level() + 1);
+      }
+      stack_.push_back({mask, false});
+      key_mask_ = 0;
+      return true;
+    }
+
+    bool end_object() {
+      if (stack_.size() == row_depth_) emit_row();
+      stack_.pop_back();
+      key_mask_ = 0;
+      return true;
+    }
+
+    bool start_array(std::size_t) {
+      stack_.push_back({0, true});
+      key_mask_ = 0;
+      return true;
+    }
+
+    bool end_array() {
+      stack_.pop_back();
+      key_mask_ = 0;
+      return true;
+    }
+
+    bool key(json::string_t &name) {
+      key_mask_ = 0;
+      uint64_t mask = stack_.back().mask;
+      if (mask == 0) return true;
+      const size_t lvl = level();
+      for (size_t i = 0; mask != 0; ++i, mask >>= 1) {
+        if ((mask & 1) && schema_.fields[i].path[lvl] == name) {
+          key_mask_ |= uint64_t(1) << i;
+        }
+      }
+      return true;
+    }
+
+    bool parse_error(std::size_t, const std::string &,
+                     const nlohmann::detail::exception &) {
+      result_.status = JsonStatus::kSyntaxError;
+      return false;
+    }
+
+  private:
+    struct Level {
+      uint64_t mask;
+      bool array;
+    };
+
+    bool in_row() const { return stack_.size() >= row_depth_; }
+    size_t level() const { return stack_.size() - row_depth_; }
+
+    // Entries of `mask` whose path is longer than `depth` keys.
+    uint64_t narrow(uint64_t mask, size_t depth) const {
+      uint64_t out = 0;
+      for (size_t i = 0; mask != 0; ++i, mask >>= 1) {
+        if ((mask & 1) && schema_.fields[i].path.size() > depth) {
+          out |= uint64_t(1) << i;
+        }
+      }
+      return out;
+    }
+
+    bool skip_value() {
+      key_mask_ = 0;
+      return true;
+    }
+
+    bool set_value(int64_t i, double d) {
+      uint64_t mask = key_mask_;
+      key_mask_ = 0;
+      if (mask == 0) return true;
+      const size_t lvl = level();
+      for (size_t f = 0; mask != 0; ++f, mask >>= 1) {
+        if (!(mask & 1) || schema_.fields[f].path.size() != lvl + 1) continue;
+        switch (schema_.fields[f].target) {
+        case JsonField::kTsNs: row_.ts_ns = i; break;
+        case JsonField::kTsSec: sec_ = i; stamped_ = true; break;
+        case JsonField::kTsNanosec: nanosec_ = i; stamped_ = true; break;
+        case JsonField::kAccX: row_.linear_acceleration_x = d; break;
+        case JsonField::kAccY: row_.linear_acceleration_y = d; break;
+        case JsonField::kAccZ: row_.linear_acceleration_z = d; break;
+        }
+        seen_ |= uint64_t(1) << f;
+      }
+      return true;
+    }
+
+    void emit_row() {
+      if (seen_ != all_mask_) {
+        ++result_.incomplete_rows;
+        result_.status = JsonStatus::kMissingField;
+        return;
+      }
+      if (stamped_) {
+        row_.ts_ns = sec_ * 1'000'000'000LL + nanosec_;
+      }
+      sink_(row_);
+      ++result_.rows;
+    }
+
+    const JsonSchema &schema_;
+    size_t row_depth_;
+    Sink &sink_;
+    std::pmr::vector<Level> stack_;
+    uint64_t all_mask_ = 0;
+    uint64_t key_mask_ = 0;
+    uint64_t seen_ = 0;
+    int64_t sec_ = 0;
+    int64_t nanosec_ = 0;
+    bool stamped_ = false;
+    AccelerationData row_{};
+    JsonDecodeResult result_;
+  };
+
+  // Decodes the projected fields of `blob` into sink(const AccelerationData &)
+  // without building a DOM. Rows missing a schema field are skipped and
+  // counted; a syntax error stops decoding.
+  template <typename Sink>
+  JsonDecodeResult decode_json(std::string_view blob, const JsonSchema &schema,
+                               Sink &&sink, size_t row_depth) {
+    ArenaScope arena;
+    AccelerationSax<std::remove_reference_t<Sink>> sax(schema, sink, row_depth,
+                                                       arena.resource());
+    nlohmann::json::sax_parse(blob.data(), blob.data() + blob.size(), &sax);
+    return sax.result();
+  }
+
+  template <typename Sink>
+  JsonDecodeResult decode_json(std::string_view blob, const JsonSchema &schema,
+                               Sink &&sink) {
+    return decode_json(blob, schema, std::forward<Sink>(sink), schema.row_depth);
+  }
+
+  inline JsonDecodeResult decode_json(std::string_view blob,
+                                      const JsonSchema &schema,
+                                      AccelerationFrame &rows) {
+    return decode_json(blob, schema,
+                       [&](const AccelerationData &row) { rows.push_back(row); });
+  }
+
+  // Incremental JSON decoder. feed() scans each chunk for the boundaries of
+  // row objects (tracking nesting and string state). The rows completed by a
+  // chunk are gathered into one "[row,row,...]" batch and parsed together at
+  // the end of feed(), so the parser is set up once per chunk rather than
+  // once per row. Only a row split across chunks is copied into the carry
+  // buffer, so memory is bounded by the chunk and the largest row, not the
+  // record. For schemas whose row is the whole document (row_depth 1) this
+  // degrades to buffering that document. Both buffers come from `mr`,
+  // usually the record arena.
+  //
+  // A malformed row stops the parse of its batch, so the rows after it in
+  // the same chunk are dropped with it.
+  //
+  // Format is a JsonSchema or a compile-time Schema from schema.h; rows are
+  // decoded by the decode_json() overload for it.
+  template <typename Sink, typename Format = JsonSchema>
+  class JsonStreamDecoder {
+  public:
+    JsonStreamDecoder(const Format &schema, Sink &sink,
+                      std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : schema_(schema), sink_(sink), carry_(mr), batch_(mr) {}
+
+    void feed(std::string_view chunk) {
+      size_t begin = in_row_ ? 0 : std::string_view::npos;
+      for (size_t i = 0; i < chunk.size(); ++i) {
+        const char c = chunk[i];
+        if (in_string_) {
+          if (escaped_) {
+            escaped_ = false;
+          } else if (c == '\\') {
+            escaped_ = true;
+          } else if (c == '"') {
+            in_string_ = false;
+          }
+          continue;
+        }
+
+        switch (c) {
+        case '"':
+          in_string_ = true;
+          break;
+        case '{':
+        case '[':
+          if (c == '{' && depth_ + 1 == schema_.row_depth) {
+            in_row_ = true;
+            begin = i;
+          }
+          ++depth_;
+          break;
+        case '}':
+        case ']':
+          if (depth_ == 0) {
+            result_.status = JsonStatus::kSyntaxError;
+            return;
+          }
+          --depth_;
+          if (in_row_ && depth_ + 1 == schema_.row_depth) {
+            batch_.push_back(batch_.empty() ? '[' : ',');
+            if (!carry_.empty()) {
+              batch_.append(carry_);
+              carry_.clear();
+            }
+            batch_.append(chunk.substr(begin, i + 1 - begin));
+            in_row_ = false;
+          }
+          break;
+        default:
+          break;
+        }
+      }
+      if (in_row_) carry_.append(chunk.substr(begin));
+      flush();
+    }
+
+    JsonDecodeResult finish() {
+      flush();
+      if (in_row_ || depth_ != 0 || in_string_) {
+        result_.status = JsonStatus::kSyntaxError;
+      }
+      carry_.clear();
+      return result_;
+    }
+
+  private:
+    void flush() {
+      if (batch_.empty()) return;
+      batch_.push_back(']');
+      auto r = decode_json(std::string_view(batch_), schema_, sink_, 2);
+      result_.rows += r.rows;
+      result_.incomplete_rows += r.incomplete_rows;
+      if (r.status != JsonStatus::kOk) result_.status = r.status;
+      batch_.clear();
+    }
+
+    const Format &schema_;
+    Sink &sink_;
+    std::pmr::string carry_;
+    std::pmr::string batch_;
+    size_t depth_ = 0;
+    bool in_row_ = false;
+    bool in_string_ = false;
+    bool escaped_ = false;
+    JsonDecodeResult result_;
+  };
+}
@@ -0,0 +1,373 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <reduct/client.h>
+#include "arena.h"
+#include "data_structures.h"
+#include "profiling.h"
+
+namespace common {
+  // The last `capacity` IMU samples, one fixed array per column. push()
+  // overwrites the oldest sample once full; sequence numbers keep counting,
+  // so a sample can be addressed by seq while it is still held.
+  class SampleRing {
+  public:
+    explicit SampleRing(size_t capacity)
+        : ts_ns_(std::max<size_t>(capacity, 1)), x_(ts_ns_.size()), y_(ts_ns_.size()),
+          z_(ts_ns_.size()) {}
+
+    size_t capacity() const { return ts_ns_.size(); }
+    size_t size() const { return size_t(std::min<uint64_t>(next_, capacity())); }
+    bool empty() const { return next_ == 0; }
+
+    // Sequence numbers held: [first_seq(), end_seq()).
+    uint64_t first_seq() const { return next_ - size(); }
+    uint64_t end_seq() const { return next_; }
+
+    uint64_t push(const AccelerationData &row) {
+      const size_t i = slot(next_);
+      ts_ns_[i] = row.ts_ns;
+      x_[i] = row.linear_acceleration_x;
+      y_[i] = row.linear_acceleration_y;
+      z_[i] = row.linear_acceleration_z;
+      return next_++;
+    }
+
+    int64_t ts_ns(uint64_t seq) const { return ts_ns_[slot(seq)]; }
+    double value(uint64_t seq, size_t column) const {
+      const size_t i = slot(seq);
+      return column == 0 ? x_[i] : column == 1 ? y_[i] : z_[i];
+    }
+
+    // Copies the held samples, oldest first, e.g. for a plot refresh.
+    void snapshot(AccelerationFrame &out) const {
+      out.clear();
+      out.reserve(size());
+      for (uint64_t s = first_seq(); s < end_seq(); ++s) {
+        const size_t i = slot(s);
+        out.push_back({ts_ns_[i], x_[i], y_[i], z_[i]});
+      }
+    }
+
+  private:
+    size_t slot(uint64_t seq) const { return size_t(seq % capacity()); }
+
+    std::vector<int64_t> ts_ns_;
+    std::vector<double> x_;
+    std::vector<double> y_;
+    std::vector<double> z_;
+    uint64_t next_ = 0;
+  };
+
+  struct RollingStats {
+    size_t count = 0;
+    size_t nan_count = 0;
+    double min = std::numeric_limits<double>::quiet_NaN();
+    double max = std::numeric_limits<double>::quiet_NaN();
+    double mean = std::numeric_limits<double>::quiet_NaN();
+    double stddev = std::numeric_limits<double>::quiet_NaN();
+  };
+
+  // Min/max/mean/stddev of one ring column over a suffix of the ring.
+  // Samples enter with add(seq) and leave, oldest first, with evict(seq).
+  // Mean and variance are Welford updates run forwards and backwards; min
+  // and max are monotonic queues of sequence numbers, so every operation is
+  // amortized O(1). The queues are circular buffers sized to the ring, so
+  // nothing is allocated after construction.
+  class RollingColumn {
+  public:
+    RollingColumn(const SampleRing &ring, size_t column)
+        : ring_(ring), column_(column), min_q_(ring.capacity()), max_q_(ring.capacity()) {}
+
+    void add(uint64_t seq) {
+      const double v = ring_.value(seq, column_);
+      if (std::isnan(v)) {
+        ++nan_count_;
+        return;
+      }
+      ++count_;
+      const double d = v - mean_;
+      mean_ += d / double(count_);
+      m2_ += d * (v - mean_);
+      min_q_.push(seq, [&](uint64_t s) { return ring_.value(s, column_) >= v; });
+      max_q_.push(seq, [&](uint64_t s) { return ring_.value(s, column_) <= v; });
+    }
+
+    // Must be called before the ring overwrites `seq`.
+    void evict(uint64_t seq) {
+      const double v = ring_.value(seq, column_);
+      if (std::isnan(v)) {
+        --nan_count_;
+        return;
+      }
+      if (--count_ == 0) {
+        mean_ = m2_ = 0;
+      } else {
+        const double d = v - mean_;
+        mean_ -= d / double(count_);
+        // Rounding can leave m2 a hair below zero.
+        m2_ = std::max(0.0, m2_ - d * (v - mean_));
+      }
+      min_q_.pop_if_front(seq);
+      max_q_.pop_if_front(seq);
+    }
+
+    RollingStats stats() const {
+      RollingStats s;
+      s.count = count_;
+      s.nan_count = nan_count_;
+      if (count_ == 0) return s;
+      s.min = ring_.value(min_q_.front(), column_);
+      s.max = ring_.value(max_q_.front(), column_);
+      s.mean = mean_;
+      s.stddev = count_ > 1 ? std::sqrt(m2_ / double(count_ - 1)) : 0.0;
+      return s;
+    }
+
+  private:
+    class MonotonicQueue {
+    public:
+      explicit MonotonicQueue(size_t capacity) : seqs_(capacity) {}
+
+      template <typename Dominated> void push(uint64_t seq, Dominated dominated) {
+        while (size_ > 0 && dominated(back())) --size_;
+        seqs_[(head_ + size_++) % seqs_.size()] = seq;
+      }
+      void pop_if_front(uint64_t seq) {
+        if (size_ > 0 && front() == seq) {
+          head_ = (head_ + 1) % seqs_.size();
+          --size_;
+        }
+      }
+      uint64_t front() const { return seqs_[head_]; }
+
+    private:
+      uint64_t back() const { return seqs_[(head_ + size_ - 1) % seqs_.size()]; }
+
+      std::vector<uint64_t> seqs_;
+      size_t head_ = 0;
+      size_t size_ = 0;
+    };
+
+    const SampleRing &ring_;
+    size_t column_;
+    size_t count_ = 0;
+    size_t nan_count_ = 0;
+    double mean_ = 0;
+    double m2_ = 0;
+    MonotonicQueue min_q_;
+    MonotonicQueue max_q_;
+  };
+
+  enum class ThresholdOp { kAbsGreater, kGreater, kLess };
+
+  struct ThresholdRule {
+    std::string name;
+    size_t column = 0;  // 0 = acc_x, 1 = acc_y, 2 = acc_z
+    ThresholdOp op = ThresholdOp::kAbsGreater;
+    double threshold = 10.0;
+
+    bool test(double v) const {
+      switch (op) {
+      case ThresholdOp::kAbsGreater: return std::abs(v) > threshold;
+      case ThresholdOp::kGreater: return v > threshold;
+      case ThresholdOp::kLess: return v < threshold;
+      }
+      return false;
+    }
+  };
+
+  // A rule turning true (kEnter) or back to false (kExit). An exit carries
+  // the excursion: when it started, how many samples it lasted and the value
+  // furthest past the threshold.
+  struct ThresholdEvent {
+    enum Kind { kEnter, kExit };
+    Kind kind;
+    size_t rule;
+    int64_t ts_ns;
+    int64_t since_ns;
+    size_t samples;
+    double peak;
+  };
+
+  struct LiveTailOptions {
+    size_t capacity = 64 * 1024;       // samples held for snapshots
+    int64_t window_ns = 5'000'000'000;  // rolling stats window
+  };
+
+  // Consumes a live stream of IMU samples in constant memory: a SampleRing
+  // of the latest samples, rolling stats of each column over the last
+  // window_ns (or the whole ring, if the window holds more than it), and
+  // threshold events. The window follows the newest timestamp seen; late
+  // samples are added but don't move it back.
+  class LiveTail {
+  public:
+    using OnEvent = std::function<void(const ThresholdEvent &)>;
+
+    explicit LiveTail(LiveTailOptions options = {}, std::vector<ThresholdRule> rules = {},
+                      OnEvent on_event = {})
+        : options_(options), ring_(options.capacity),
+          columns_{RollingColumn(ring_, 0), RollingColumn(ring_, 1), RollingColumn(ring_, 2)},
+          rules_(std::move(rules)), active_(rules_.size()), on_event_(std::move(on_event)) {}
+
+    LiveTail(const LiveTail &) = delete;
+    LiveTail &operator=(const LiveTail &) = delete;
+
+    void push(const AccelerationData &row) {
+      // The ring is about to overwrite its oldest sample; drop it from the
+      // window first if it is still in it.
+      if (ring_.size() == ring_.capacity() && window_begin_ == ring_.first_seq()) evict();
+      const uint64_t seq = ring_.push(row);
+      newest_ns_ = std::max(newest_ns_, row.ts_ns);
+      for (auto &c : columns_) c.add(seq);
+      while (window_begin_ < seq && ring_.ts_ns(window_begin_) < newest_ns_ - options_.window_ns) {
+        evict();
+      }
+      ++total_;
+      check_rules(row);
+    }
+
+    RollingStats stats(size_t column) const { return columns_[column].stats(); }
+    const SampleRing &ring() const { return ring_; }
+    const std::vector<ThresholdRule> &rules() const { return rules_; }
+    uint64_t total() const { return total_; }
+    // Samples in the rolling window.
+    size_t window_size() const { return size_t(ring_.end_seq() - window_begin_); }
+    int64_t newest_ns() const { return newest_ns_; }
+
+  private:
+    struct Excursion {
+      bool on = false;
+      int64_t since_ns = 0;
+      size_t samples = 0;
+      double peak = 0;
+    };
+
+    void evict() {
+      for (auto &c : columns_) c.evict(window_begin_);
+      ++window_begin_;
+    }
+
+    void check_rules(const AccelerationData &row) {
+      const double values[3] = {row.linear_acceleration_x, row.linear_acceleration_y,
+                                row.linear_acceleration_z};
+      for (size_t r = 0; r < rules_.size(); ++r) {
+        const auto &rule = rules_[r];
+        const double v = values[rule.column];
+        auto &ex = active_[r];
+        if (rule.test(v)) {
+          const bool further = rule.op == ThresholdOp::kAbsGreater ? std::abs(v) > std::abs(ex.peak)
+                               : rule.op == ThresholdOp::kGreater  ? v > ex.peak
+                                                                   : v < ex.peak;
+          if (!ex.on) {
+            ex = {true, row.ts_ns, 0, v};
+            emit({ThresholdEvent::kEnter, r, row.ts_ns, row.ts_ns, 1, v});
+          } else if (further) {
+            ex.peak = v;
+          }
+          ++ex.samples;
+        } else if (ex.on && !std::isnan(v)) {
+          ex.on = false;
+          emit({ThresholdEvent::kExit, r, row.ts_ns, ex.since_ns, ex.samples, ex.peak});
+        }
+      }
+    }
+
+    void emit(const ThresholdEvent &event) {
+      if (on_event_) on_event_(event);
+    }
+
+    LiveTailOptions options_;
+    SampleRing ring_;
+    RollingColumn columns_[3];
+    std::vector<ThresholdRule> rules_;
+    std::vector<Excursion> active_;
+    OnEvent on_event_;
+    uint64_t window_begin_ = 0;
+    int64_t newest_ns_ = std::numeric_limits<int64_t>::min();
+    uint64_t total_ = 0;
+  };
+
+  struct TailOptions {
+    std::chrono::milliseconds poll_interval{500};
+    // Where to start; the default is now, so no history is read.
+    std::optional<reduct::IBucket::Time> start;
+  };
+
+  // Follows `entry` by polling it, calling decode(record) for each new record
+  // until `stop` is set or decode returns false. decode may also return a
+  // reduct::Error, which stops the tail unless it is kOk. Each poll is an
+  // open-ended, non-continuous query from just past the last record seen, so
+  // nothing is read twice.
+  // A poll that brings nothing, or fails, is followed by a pause of one poll
+  // interval; after an error the source is reconnected. A continuous query
+  // is not used because it only hands back control when a record arrives,
+  // so on a quiet entry `stop` would never be seen. Here it is checked per
+  // record and during the pause, and the call returns soon after it is set.
+  // It also returns with the error of a record that failed to read or decode.
+  template <typename Connect, typename Decode>
+  reduct::Error tail_entry(const Connect &connect, const std::string &entry,
+                           reduct::IBucket::QueryOptions options, Decode &&decode,
+                           const std::atomic<bool> &stop, const TailOptions &tail = {}) {
+    using Time = reduct::IBucket::Time;
+    options.continuous = false;
+    Time next = tail.start.value_or(
+        std::chrono::time_point_cast<std::chrono::microseconds>(std::chrono::system_clock::now()));
+
+    using Record = reduct::IBucket::ReadableRecord;
+    reduct::Error record_err = reduct::Error::kOk;
+    bool done = false;  // decode asked to stop
+    decltype(connect()) bucket;
+    while (!stop) {
+      if (!bucket) bucket = connect();
+      bool got = false;
+      if (bucket) {
+        auto err = bucket->Query(entry, next, std::nullopt, options, [&](const Record &rec) {
+          if (stop) return false;
+          got = true;
+          profile::Scope scope("tail.record");
+          scope.bytes(rec.size);
+          ArenaScope arena;
+          next = rec.timestamp + std::chrono::microseconds(1);
+          if constexpr (std::is_same_v<std::invoke_result_t<Decode &, const Record &>,
+                                       reduct::Error>) {
+            record_err = decode(rec);
+            done = record_err != reduct::Error::kOk;
+            return !done;
+          } else {
+            // Keep a read failure, which decode can only report as false.
+            Record local = rec;
+            local.Read = [&](reduct::IBucket::ReadCallback cb) {
+              auto read_err = rec.Read(std::move(cb));
+              if (read_err != reduct::Error::kOk) record_err = read_err;
+              return read_err;
+            };
+            done = !bool(decode(local));
+            return !done;
+          }
+        });
+        if (record_err != reduct::Error::kOk) return record_err;
+        if (done) return reduct::Error::kOk;
+        if (err != reduct::Error::kOk) bucket = nullptr;
+      }
+      if (got) continue;
+      const auto until = std::chrono::steady_clock::now() + tail.poll_interval;
+      while (!stop && std::chrono::steady_clock::now() < until) {
+        std::this_thread::sleep_for(
+            std::min<std::chrono::milliseconds>(tail.poll_interval, std::chrono::milliseconds(50)));
+      }
+    }
+    return reduct::Error::kOk;
+  }
+}
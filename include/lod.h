@@ -0,0 +1,443 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+#include "data_structures.h"
+#include "profiling.h"
+
+// Level-of-detail pyramid for plotting long recordings. Level 0 splits time
+// into buckets of base_width_ns and every level above is `fanout` times
+// coarser. Each bucket keeps the count and the min/max/sum of every column,
+// so a zoom window is drawn from the coarsest level that still gives one
+// bucket per pixel: O(pixels) work whatever the number of samples.
+namespace common {
+  struct LodOptions {
+    int64_t base_width_ns = 1'000'000;  // 1 ms
+    uint32_t fanout = 4;
+    uint32_t levels = 12;               // up to ~70 min per top bucket
+  };
+
+  struct LodStat {
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    double sum = 0.0;
+
+    void add(double v) {
+      min = std::min(min, v);
+      max = std::max(max, v);
+      sum += v;
+    }
+    void merge(const LodStat &o) {
+      min = std::min(min, o.min);
+      max = std::max(max, o.max);
+      sum += o.sum;
+    }
+  };
+
+  // Buckets of one level, sorted by index. Bucket b covers
+  // [index[b] * width_ns, (index[b] + 1) * width_ns); its column c stats
+  // are stats[b * n_columns + c]. Empty buckets are not stored.
+  struct LodLevel {
+    int64_t width_ns = 0;
+    std::vector<int64_t> index;
+    std::vector<uint64_t> count;
+    std::vector<LodStat> stats;
+  };
+
+  // A window of one level, ready to draw.
+  struct LodView {
+    uint32_t level = 0;
+    int64_t width_ns = 0;
+    size_t n_columns = 0;
+    std::vector<int64_t> ts_ns;  // bucket start
+    std::vector<uint64_t> count;
+    std::vector<LodStat> stats;  // [bucket * n_columns + column]
+
+    size_t size() const { return ts_ns.size(); }
+    double mean(size_t bucket, size_t column) const {
+      return stats[bucket * n_columns + column].sum / double(count[bucket]);
+    }
+  };
+
+  // Largest-Triangle-Three-Buckets: picks n_out of the points (x, y) that
+  // keep the visual shape of the line. Returns their indices, always
+  // including the first and the last point.
+  inline std::vector<size_t> lttb(std::span<const double> x, std::span<const double> y,
+                                  size_t n_out) {
+    const size_t n = std::min(x.size(), y.size());
+    std::vector<size_t> out;
+    if (n_out >= n || n_out < 3) {
+      for (size_t i = 0; i < n; ++i) out.push_back(i);
+      return out;
+    }
+    out.reserve(n_out);
+    const double every = double(n - 2) / double(n_out - 2);
+    size_t a = 0;
+    out.push_back(0);
+    for (size_t i = 0; i < n_out - 2; ++i) {
+      // Average of the next bucket is the third corner of the triangle.
+      size_t avg_begin = size_t(double(i + 1) * every) + 1;
+      size_t avg_end = std::min(size_t(double(i + 2) * every) + 1, n);
+      double avg_x = 0, avg_y = 0;
+      for (size_t j = avg_begin; j < avg_end; ++j) {
+        avg_x += x[j];
+        avg_y += y[j];
+      }
+      const double len = double(std::max<size_t>(avg_end - avg_begin, 1));
+      avg_x /= len;
+      avg_y /= len;
+
+      size_t begin = size_t(double(i) * every) + 1;
+      size_t end = size_t(double(i + 1) * every) + 1;
+      double best_area = -1;
+      size_t best = begin;
+      for (size_t j = begin; j < end; ++j) {
+        double area = std::abs((x[a] - avg_x) * (y[j] - y[a]) -
+                               (x[a] - x[j]) * (avg_y - y[a]));
+        if (area > best_area) {
+          best_area = area;
+          best = j;
+        }
+      }
+      out.push_back(best);
+      a = best;
+    }
+    out.push_back(n - 1);
+    return out;
+  }
+
+  // Built incrementally from rows in (mostly) time order. Each level keeps
+  // one open bucket; a row moving past it closes the bucket, which is then
+  // folded into the level above, so a row costs O(1) amortized. Rows older
+  // than the open bucket are merged into the stored one and every level
+  // above it directly. Pyramids of disjoint time ranges, e.g. query shards,
+  // are combined with merge().
+  class LodPyramid {
+  public:
+    static constexpr char kMagic[4] = {'R', 'L', 'O', 'D'};
+    static constexpr uint32_t kVersion = 1;
+
+    // IMU columns by default.
+    LodPyramid() : LodPyramid({"acc_x", "acc_y", "acc_z"}) {}
+
+    explicit LodPyramid(std::vector<std::string> columns, LodOptions options = {})
+        : options_(options), columns_(std::move(columns)) {
+      options_.fanout = std::max<uint32_t>(options_.fanout, 2);
+      options_.levels = std::max<uint32_t>(options_.levels, 1);
+      levels_.resize(options_.levels);
+      open_.resize(options_.levels);
+      int64_t width = std::max<int64_t>(options_.base_width_ns, 1);
+      for (auto &level : levels_) {
+        level.width_ns = width;
+        width = width > std::numeric_limits<int64_t>::max() / options_.fanout
+                    ? std::numeric_limits<int64_t>::max()
+                    : width * options_.fanout;
+      }
+      for (auto &bucket : open_) bucket.stats.resize(columns_.size());
+      row_stats_.resize(columns_.size());
+    }
+
+    const LodOptions &options() const { return options_; }
+    const std::vector<std::string> &columns() const { return columns_; }
+    size_t n_levels() const { return levels_.size(); }
+
+    // Rows added; finish() first to read the levels.
+    size_t size() const { return rows_; }
+
+    const LodLevel &level(size_t k) const { return levels_[k]; }
+
+    void add(int64_t ts_ns, std::span<const double> values) {
+      ++rows_;
+      for (size_t c = 0; c < columns_.size(); ++c) {
+        row_stats_[c] = {values[c], values[c], values[c]};
+      }
+      add_bucket(0, floor_div(ts_ns, levels_[0].width_ns), 1, row_stats_.data());
+    }
+
+    void add(const AccelerationData &row) {
+      const double values[] = {row.linear_acceleration_x, row.linear_acceleration_y,
+                               row.linear_acceleration_z};
+      add(row.ts_ns, values);
+    }
+
+    void add(const AccelerationFrame &frame) {
+      for (size_t i = 0; i < frame.size(); ++i) add(frame.row(i));
+    }
+
+    // Closes the open buckets so every level is complete. Rows can still be
+    // added afterwards.
+    void finish() {
+      for (size_t k = 0; k < levels_.size(); ++k) close(k);
+    }
+
+    // Combines another pyramid with the same columns and options into this
+    // one, level by level.
+    void merge(LodPyramid &&other) {
+      finish();
+      other.finish();
+      if (rows_ == 0) {
+        *this = std::move(other);
+        return;
+      }
+      rows_ += other.rows_;
+      const size_t nc = columns_.size();
+      for (size_t k = 0; k < levels_.size(); ++k) {
+        LodLevel &a = levels_[k];
+        const LodLevel &b = other.levels_[k];
+        if (b.index.empty()) continue;
+        if (a.index.empty() || a.index.back() < b.index.front()) {
+          a.index.insert(a.index.end(), b.index.begin(), b.index.end());
+          a.count.insert(a.count.end(), b.count.begin(), b.count.end());
+          a.stats.insert(a.stats.end(), b.stats.begin(), b.stats.end());
+          continue;
+        }
+        LodLevel out;
+        out.width_ns = a.width_ns;
+        size_t i = 0, j = 0;
+        auto take = [&](const LodLevel &from, size_t at) {
+          out.index.push_back(from.index[at]);
+          out.count.push_back(from.count[at]);
+          out.stats.insert(out.stats.end(), from.stats.begin() + ptrdiff_t(at * nc),
+                           from.stats.begin() + ptrdiff_t((at + 1) * nc));
+        };
+        while (i < a.index.size() || j < b.index.size()) {
+          if (j == b.index.size() || (i < a.index.size() && a.index[i] < b.index[j])) {
+            take(a, i++);
+          } else if (i == a.index.size() || b.index[j] < a.index[i]) {
+            take(b, j++);
+          } else {
+            take(a, i++);
+            out.count.back() += b.count[j];
+            for (size_t c = 0; c < nc; ++c) {
+              out.stats[out.stats.size() - nc + c].merge(b.stats[j * nc + c]);
+            }
+            ++j;
+          }
+        }
+        a = std::move(out);
+      }
+    }
+
+    // The finest level that covers [start_ns, stop_ns) in at most `pixels`
+    // buckets, or the top level if none does.
+    LodView view(int64_t start_ns, int64_t stop_ns, size_t pixels) const {
+      profile::Scope scope("lod.view");
+      const double span = double(std::max<int64_t>(stop_ns - start_ns, 1));
+      const double min_width = span / double(std::max<size_t>(pixels, 1));
+      // Widths grow with the level, so the first one wide enough is the answer.
+      auto it = std::lower_bound(levels_.begin(), levels_.end() - 1, min_width,
+                                 [](const LodLevel &level, double width) {
+                                   return double(level.width_ns) < width;
+                                 });
+      LodView out = slice(uint32_t(it - levels_.begin()), start_ns, stop_ns);
+      scope.rows(out.size());
+      return out;
+    }
+
+    // Mean of `column` reduced to about `pixels` points with LTTB. The input
+    // is the finest level with at most kLttbOversample * pixels buckets,
+    // placed at the bucket centres, so this is O(pixels) as well.
+    static constexpr size_t kLttbOversample = 8;
+
+    std::pair<std::vector<int64_t>, std::vector<double>>
+    lttb_view(int64_t start_ns, int64_t stop_ns, size_t pixels, size_t column) const {
+      LodView v = view(start_ns, stop_ns, pixels * kLttbOversample);
+      std::vector<double> x(v.size()), y(v.size());
+      for (size_t b = 0; b < v.size(); ++b) {
+        x[b] = double(v.ts_ns[b]) + double(v.width_ns) / 2;
+        y[b] = v.mean(b, column);
+      }
+      std::pair<std::vector<int64_t>, std::vector<double>> out;
+      for (size_t i : lttb(x, y, pixels)) {
+        out.first.push_back(int64_t(x[i]));
+        out.second.push_back(y[i]);
+      }
+      return out;
+    }
+
+    // "RLOD" + u32 version, then the options, the column names and each
+    // level's buckets as arrays. Host byte order, like the query cache.
+    bool save(const std::filesystem::path &path) {
+      finish();
+      std::error_code ec;
+      std::filesystem::create_directories(path.parent_path(), ec);
+      const auto tmp = path.string() + ".tmp";
+      {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        auto put = [&](auto v) { out.write(reinterpret_cast<const char *>(&v), sizeof(v)); };
+        auto put_array = [&](const auto &vec) {
+          put(uint64_t(vec.size()));
+          out.write(reinterpret_cast<const char *>(vec.data()),
+                    std::streamsize(vec.size() * sizeof(vec[0])));
+        };
+        out.write(kMagic, 4);
+        put(kVersion);
+        put(options_.base_width_ns);
+        put(options_.fanout);
+        put(options_.levels);
+        put(uint64_t(rows_));
+        put(uint32_t(columns_.size()));
+        for (const auto &name : columns_) {
+          put(uint32_t(name.size()));
+          out.write(name.data(), std::streamsize(name.size()));
+        }
+        for (const auto &level : levels_) {
+          put_array(level.index);
+          put_array(level.count);
+          put_array(level.stats);
+        }
+        if (!out) return false;
+      }
+      std::filesystem::rename(tmp, path, ec);
+      return !ec;
+    }
+
+    static std::optional<LodPyramid> load(const std::filesystem::path &path) {
+      profile::Scope scope("lod.load");
+      std::ifstream in(path, std::ios::binary);
+      if (!in) return std::nullopt;
+      auto get = [&](auto &v) {
+        in.read(reinterpret_cast<char *>(&v), sizeof(v));
+        return bool(in);
+      };
+      auto get_array = [&](auto &vec) {
+        uint64_t n = 0;
+        if (!get(n) || n > (uint64_t(1) << 40)) return false;
+        vec.resize(n);
+        in.read(reinterpret_cast<char *>(vec.data()),
+                std::streamsize(n * sizeof(vec[0])));
+        return bool(in);
+      };
+
+      char magic[4];
+      uint32_t version = 0, n_columns = 0;
+      uint64_t rows = 0;
+      LodOptions options;
+      in.read(magic, 4);
+      if (!in || !std::equal(magic, magic + 4, kMagic) || !get(version) ||
+          version != kVersion || !get(options.base_width_ns) || !get(options.fanout) ||
+          !get(options.levels) || !get(rows) || !get(n_columns) || n_columns > 4096) {
+        return std::nullopt;
+      }
+      std::vector<std::string> columns(n_columns);
+      for (auto &name : columns) {
+        uint32_t len = 0;
+        if (!get(len) || len > 4096) return std::nullopt;
+        name.resize(len);
+        in.read(name.data(), len);
+      }
+      LodPyramid pyramid(std::move(columns), options);
+      pyramid.rows_ = rows;
+      for (auto &level : pyramid.levels_) {
+        if (!get_array(level.index) || !get_array(level.count) ||
+            !get_array(level.stats) || level.count.size() != level.index.size() ||
+            level.stats.size() != level.index.size() * n_columns) {
+          return std::nullopt;
+        }
+      }
+      return pyramid;
+    }
+
+  private:
+    struct Bucket {
+      int64_t index = 0;
+      uint64_t count = 0;  // 0 = no open bucket
+      std::vector<LodStat> stats;
+    };
+
+    static int64_t floor_div(int64_t a, int64_t b) {
+      int64_t q = a / b;
+      return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+    }
+
+    int64_t parent_index(int64_t index) const {
+      return floor_div(index, int64_t(options_.fanout));
+    }
+
+    void add_bucket(size_t k, int64_t index, uint64_t count, const LodStat *stats) {
+      Bucket &open = open_[k];
+      const LodLevel &level = levels_[k];
+      if (open.count > 0 && index == open.index) {
+        open.count += count;
+        for (size_t c = 0; c < open.stats.size(); ++c) open.stats[c].merge(stats[c]);
+      } else if ((open.count > 0 && index > open.index) ||
+                 (open.count == 0 &&
+                  (level.index.empty() || index > level.index.back()))) {
+        close(k);
+        open.index = index;
+        open.count = count;
+        std::copy_n(stats, open.stats.size(), open.stats.begin());
+      } else {
+        // Late: the bucket was already closed and folded upwards, so the
+        // levels above get this contribution directly.
+        merge_stored(k, index, count, stats);
+        if (k + 1 < levels_.size()) add_bucket(k + 1, parent_index(index), count, stats);
+      }
+    }
+
+    void close(size_t k) {
+      Bucket &open = open_[k];
+      if (open.count == 0) return;
+      LodLevel &level = levels_[k];
+      level.index.push_back(open.index);
+      level.count.push_back(open.count);
+      level.stats.insert(level.stats.end(), open.stats.begin(), open.stats.end());
+      if (k + 1 < levels_.size()) {
+        add_bucket(k + 1, parent_index(open.index), open.count, open.stats.data());
+      }
+      open.count = 0;
+    }
+
+    void merge_stored(size_t k, int64_t index, uint64_t count, const LodStat *stats) {
+      LodLevel &level = levels_[k];
+      const size_t nc = columns_.size();
+      auto it = std::lower_bound(level.index.begin(), level.index.end(), index);
+      const size_t at = size_t(it - level.index.begin());
+      if (it == level.index.end() || *it != index) {
+        level.index.insert(it, index);
+        level.count.insert(level.count.begin() + ptrdiff_t(at), 0);
+        level.stats.insert(level.stats.begin() + ptrdiff_t(at * nc), nc, LodStat{});
+      }
+      level.count[at] += count;
+      for (size_t c = 0; c < nc; ++c) level.stats[at * nc + c].merge(stats[c]);
+    }
+
+    LodView slice(uint32_t k, int64_t start_ns, int64_t stop_ns) const {
+      const LodLevel &level = levels_[k];
+      const size_t nc = columns_.size();
+      LodView out{.level = k, .width_ns = level.width_ns, .n_columns = nc,
+                  .ts_ns = {}, .count = {}, .stats = {}};
+      auto first = std::lower_bound(level.index.begin(), level.index.end(),
+                                    floor_div(start_ns, level.width_ns));
+      auto last = std::lower_bound(first, level.index.end(),
+                                   floor_div(stop_ns - 1, level.width_ns) + 1);
+      const size_t b = size_t(first - level.index.begin());
+      const size_t e = size_t(last - level.index.begin());
+      out.ts_ns.reserve(e - b);
+      for (size_t i = b; i < e; ++i) out.ts_ns.push_back(level.index[i] * level.width_ns);
+      out.count.assign(level.count.begin() + ptrdiff_t(b), level.count.begin() + ptrdiff_t(e));
+      out.stats.assign(level.stats.begin() + ptrdiff_t(b * nc),
+                       level.stats.begin() + ptrdiff_t(e * nc));
+      return out;
+    }
+
+    LodOptions options_;
+    std::vector<std::string> columns_;
+    std::vector<LodLevel> levels_;
+    std::vector<Bucket> open_;
+    std::vector<LodStat> row_stats_;
+    size_t rows_ = 0;
+  };
+
+  inline void append_batch(LodPyramid &dst, LodPyramid &&src) {
+    dst.merge(std::move(src));
+  }
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace common {
+  // Read-only memory mapping of a whole file.
+  class MappedFile {
+  public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    MappedFile(MappedFile &&other) noexcept { *this = std::move(other); }
+    MappedFile &operator=(MappedFile &&other) noexcept {
+      std::swap(data_, other.data_);
+      std::swap(size_, other.size_);
+      return *this;
+    }
+    ~MappedFile() {
+      if (data_ != nullptr) munmap(const_cast<char *>(data_), size_);
+    }
+
+    static std::optional<MappedFile> open(const std::filesystem::path &path) {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) return std::nullopt;
+      struct stat st {};
+      if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return std::nullopt;
+      }
+      void *p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (p == MAP_FAILED) return std::nullopt;
+      MappedFile file;
+      file.data_ = static_cast<const char *>(p);
+      file.size_ = size_t(st.st_size);
+      return file;
+    }
+
+    std::string_view view() const { return {data_, size_}; }
+
+  private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+  };
+}
@@ -0,0 +1,640 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "data_structures.h"
+#include "profiling.h"
+
+// Client-side reading of raw MCAP records, as stored in the "mcap" entry,
+// and CDR decoding of the IMU messages in them. Chunks compressed with lz4
+// or zstd need the library at build time (HAVE_LZ4 / HAVE_ZSTD, set by
+// CMake when it finds them); without it those chunks are reported as
+// kUnsupportedCompression.
+namespace common {
+  enum class McapStatus {
+    kOk,
+    kBadMagic,
+    kTruncated,                // a record runs past the end of the file
+    kUnsupportedCompression,
+    kDecompressFailed,
+  };
+
+  inline const char *to_string(McapStatus status) {
+    switch (status) {
+    case McapStatus::kOk: return "ok";
+    case McapStatus::kBadMagic: return "not an MCAP file";
+    case McapStatus::kTruncated: return "truncated record";
+    case McapStatus::kUnsupportedCompression: return "unsupported chunk compression";
+    case McapStatus::kDecompressFailed: return "chunk decompression failed";
+    }
+    return "unknown";
+  }
+
+  namespace mcap {
+    constexpr char kMagic[8] = {'\x89', 'M', 'C', 'A', 'P', '0', '\r', '\n'};
+
+    enum Opcode : uint8_t {
+      kHeader = 0x01,
+      kFooter = 0x02,
+      kSchema = 0x03,
+      kChannel = 0x04,
+      kMessage = 0x05,
+      kChunk = 0x06,
+      kMessageIndex = 0x07,
+      kDataEnd = 0x0F,
+    };
+
+    // Whether chunks with this compression ("", "lz4" or "zstd") can be read
+    // and written by this build.
+    inline bool supports(std::string_view compression) {
+      if (compression.empty()) return true;
+#ifdef HAVE_LZ4
+      if (compression == "lz4") return true;
+#endif
+#ifdef HAVE_ZSTD
+      if (compression == "zstd") return true;
+#endif
+      return false;
+    }
+
+    template <typename T> T load(const char *p, bool swap) {
+      char bytes[sizeof(T)];
+      std::memcpy(bytes, p, sizeof(T));
+      if (swap) std::reverse(bytes, bytes + sizeof(T));
+      T v;
+      std::memcpy(&v, bytes, sizeof(T));
+      return v;
+    }
+
+    // Reads the little-endian fields of one record. A read past the end
+    // returns zeros and clears ok().
+    class Cursor {
+    public:
+      explicit Cursor(std::string_view data) : data_(data) {}
+
+      template <typename T> T get() {
+        if (!ok_ || data_.size() - pos_ < sizeof(T)) {
+          ok_ = false;
+          return T{};
+        }
+        T v = load<T>(data_.data() + pos_, std::endian::native == std::endian::big);
+        pos_ += sizeof(T);
+        return v;
+      }
+
+      std::string_view bytes(uint64_t n) {
+        if (!ok_ || data_.size() - pos_ < n) {
+          ok_ = false;
+          return {};
+        }
+        auto out = data_.substr(pos_, size_t(n));
+        pos_ += size_t(n);
+        return out;
+      }
+
+      std::string_view str() { return bytes(get<uint32_t>()); }
+      std::string_view rest() { return bytes(data_.size() - pos_); }
+      bool ok() const { return ok_; }
+
+    private:
+      std::string_view data_;
+      size_t pos_ = 0;
+      bool ok_ = true;
+    };
+
+    struct Channel {
+      uint16_t id = 0;
+      std::string topic;
+      std::string message_encoding;  // e.g. "cdr"
+      std::string schema_name;       // e.g. "sensor_msgs/msg/Imu"
+      std::string schema_encoding;   // e.g. "ros2msg"
+    };
+
+    struct Message {
+      const Channel *channel;
+      uint32_t sequence;
+      uint64_t log_time;      // ns
+      uint64_t publish_time;  // ns
+      std::string_view data;
+    };
+
+    struct ReadStats {
+      size_t chunks = 0;
+      size_t chunks_skipped = 0;  // no wanted channel, not decompressed
+      size_t messages = 0;        // on wanted channels
+      size_t decompressed_bytes = 0;
+    };
+  }
+
+  // Walks the records of one MCAP file held in memory and calls
+  // on_message(const mcap::Message &) for each message on a wanted topic,
+  // or on any topic when `topics` is empty. Chunks are decompressed into a
+  // buffer kept across files, so use one reader per thread. When the
+  // file's summary lists its channels and a chunk is followed by its
+  // message indexes, chunks without a wanted channel are skipped without
+  // being decompressed.
+  class McapReader {
+  public:
+    explicit McapReader(std::vector<std::string> topics = {}) : topics_(std::move(topics)) {}
+
+    template <typename OnMessage>
+    McapStatus read(std::string_view file, OnMessage &&on_message) {
+      static auto &stage = profile::stage("mcap.read");
+      profile::Scope scope(stage);
+      scope.bytes(file.size());
+      schemas_.clear();
+      channels_.clear();
+      wanted_.clear();
+      if (file.size() < 8 || std::memcmp(file.data(), mcap::kMagic, 8) != 0) {
+        return McapStatus::kBadMagic;
+      }
+      const bool closed =
+          file.size() >= 16 && std::memcmp(file.data() + file.size() - 8, mcap::kMagic, 8) == 0;
+      const std::string_view data = file.substr(0, closed ? file.size() - 8 : file.size());
+      if (closed) read_summary(data);
+      const size_t before = stats_.messages;
+      auto status = walk(data, 8, true, on_message);
+      scope.rows(stats_.messages - before);
+      return status;
+    }
+
+    // Totals over every file read so far.
+    const mcap::ReadStats &stats() const { return stats_; }
+
+  private:
+    struct Schema {
+      std::string name;
+      std::string encoding;
+    };
+
+    struct Record {
+      uint8_t op;
+      std::string_view body;
+      size_t next;
+    };
+
+    // The record at `pos`; next is npos when it runs past the end.
+    static Record record_at(std::string_view data, size_t pos) {
+      if (data.size() - pos < 9) return {0, {}, std::string_view::npos};
+      const uint64_t len = mcap::load<uint64_t>(data.data() + pos + 1,
+                                                std::endian::native == std::endian::big);
+      if (data.size() - pos - 9 < len) return {0, {}, std::string_view::npos};
+      return {uint8_t(data[pos]), data.substr(pos + 9, size_t(len)), pos + 9 + size_t(len)};
+    }
+
+    template <typename OnMessage>
+    McapStatus walk(std::string_view data, size_t pos, bool top_level, OnMessage &on_message) {
+      while (pos < data.size()) {
+        const Record rec = record_at(data, pos);
+        if (rec.next == std::string_view::npos) return McapStatus::kTruncated;
+        switch (rec.op) {
+        case mcap::kSchema: add_schema(rec.body); break;
+        case mcap::kChannel: add_channel(rec.body); break;
+        case mcap::kMessage: emit(rec.body, on_message); break;
+        case mcap::kChunk:
+          if (top_level) {
+            if (auto status = chunk(data, rec, on_message); status != McapStatus::kOk) {
+              return status;
+            }
+          }
+          break;
+        case mcap::kDataEnd:
+        case mcap::kFooter:
+          if (top_level) return McapStatus::kOk;
+          break;
+        default: break;
+        }
+        pos = rec.next;
+      }
+      return McapStatus::kOk;
+    }
+
+    // Schemas and channels from the summary section, found through the
+    // footer just before the closing magic.
+    void read_summary(std::string_view data) {
+      constexpr size_t kFooterRecord = 9 + 20;
+      if (data.size() < 8 + kFooterRecord) return;
+      const size_t footer_pos = data.size() - kFooterRecord;
+      const Record footer = record_at(data, footer_pos);
+      if (footer.op != mcap::kFooter || footer.body.size() != 20) return;
+      mcap::Cursor c(footer.body);
+      const uint64_t summary_start = c.get<uint64_t>();
+      if (summary_start < 8 || summary_start >= footer_pos) return;
+      auto ignore = [](const mcap::Message &) {};
+      walk(data.substr(0, footer_pos), size_t(summary_start), false, ignore);
+    }
+
+    void add_schema(std::string_view body) {
+      mcap::Cursor c(body);
+      const uint16_t id = c.get<uint16_t>();
+      Schema schema{std::string(c.str()), std::string(c.str())};
+      if (!c.ok()) return;
+      if (schemas_.size() <= id) schemas_.resize(size_t(id) + 1);
+      schemas_[id] = std::move(schema);
+    }
+
+    void add_channel(std::string_view body) {
+      mcap::Cursor c(body);
+      mcap::Channel channel;
+      channel.id = c.get<uint16_t>();
+      const uint16_t schema_id = c.get<uint16_t>();
+      channel.topic = c.str();
+      channel.message_encoding = c.str();
+      if (!c.ok()) return;
+      if (schema_id < schemas_.size()) {
+        channel.schema_name = schemas_[schema_id].name;
+        channel.schema_encoding = schemas_[schema_id].encoding;
+      }
+      const size_t id = channel.id;
+      if (channels_.size() <= id) {
+        channels_.resize(id + 1);
+        wanted_.resize(id + 1, kUnknown);
+      }
+      wanted_[id] = topics_.empty() || std::find(topics_.begin(), topics_.end(),
+                                                 channel.topic) != topics_.end()
+                        ? kWanted
+                        : kUnwanted;
+      channels_[id] = std::move(channel);
+    }
+
+    uint8_t wanted(uint16_t id) const { return id < wanted_.size() ? wanted_[id] : kUnknown; }
+
+    template <typename OnMessage> void emit(std::string_view body, OnMessage &on_message) {
+      mcap::Cursor c(body);
+      const uint16_t id = c.get<uint16_t>();
+      if (wanted(id) != kWanted) return;
+      mcap::Message msg{&channels_[id], c.get<uint32_t>(), c.get<uint64_t>(),
+                        c.get<uint64_t>(), {}};
+      msg.data = c.rest();
+      if (!c.ok()) return;
+      ++stats_.messages;
+      on_message(msg);
+    }
+
+    template <typename OnMessage>
+    McapStatus chunk(std::string_view data, const Record &rec, OnMessage &on_message) {
+      ++stats_.chunks;
+      if (!topics_.empty() && skippable(data, rec.next)) {
+        ++stats_.chunks_skipped;
+        return McapStatus::kOk;
+      }
+      mcap::Cursor c(rec.body);
+      c.get<uint64_t>();  // message_start_time
+      c.get<uint64_t>();  // message_end_time
+      const uint64_t size = c.get<uint64_t>();
+      c.get<uint32_t>();  // uncompressed_crc, not checked
+      const std::string_view compression = c.str();
+      const std::string_view records = c.bytes(c.get<uint64_t>());
+      if (!c.ok()) return McapStatus::kTruncated;
+
+      std::string_view plain = records;
+      if (!compression.empty()) {
+        auto status = decompress(compression, records, size);
+        if (status != McapStatus::kOk) return status;
+        plain = buffer_;
+      }
+      stats_.decompressed_bytes += plain.size();
+      return walk(plain, 0, false, on_message);
+    }
+
+    // True when the message indexes right after the chunk name only known
+    // channels and none of them is wanted.
+    bool skippable(std::string_view data, size_t pos) const {
+      bool indexed = false;
+      while (pos < data.size()) {
+        const Record rec = record_at(data, pos);
+        if (rec.op != mcap::kMessageIndex) break;
+        mcap::Cursor c(rec.body);
+        const uint16_t id = c.get<uint16_t>();
+        if (!c.ok() || wanted(id) != kUnwanted) return false;
+        indexed = true;
+        pos = rec.next;
+      }
+      return indexed;
+    }
+
+    McapStatus decompress(std::string_view compression, std::string_view src, uint64_t size) {
+      static auto &stage = profile::stage("mcap.decompress");
+      profile::Scope scope(stage);
+      scope.bytes(size_t(size));
+      if (size > (uint64_t(1) << 34)) return McapStatus::kDecompressFailed;
+      buffer_.resize(size_t(size));
+#ifdef HAVE_LZ4
+      if (compression == "lz4") {
+        LZ4F_dctx *ctx = nullptr;
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION))) {
+          return McapStatus::kDecompressFailed;
+        }
+        size_t in_pos = 0, out_pos = 0, hint = 1;
+        while (hint != 0 && in_pos < src.size() && out_pos <= buffer_.size()) {
+          size_t in_size = src.size() - in_pos;
+          size_t out_size = buffer_.size() - out_pos;
+          hint = LZ4F_decompress(ctx, buffer_.data() + out_pos, &out_size,
+                                 src.data() + in_pos, &in_size, nullptr);
+          if (LZ4F_isError(hint) || (in_size == 0 && out_size == 0)) break;
+          in_pos += in_size;
+          out_pos += out_size;
+        }
+        LZ4F_freeDecompressionContext(ctx);
+        return hint == 0 && out_pos == buffer_.size() ? McapStatus::kOk
+                                                      : McapStatus::kDecompressFailed;
+      }
+#endif
+#ifdef HAVE_ZSTD
+      if (compression == "zstd") {
+        const size_t n = ZSTD_decompress(buffer_.data(), buffer_.size(), src.data(), src.size());
+        return !ZSTD_isError(n) && n == buffer_.size() ? McapStatus::kOk
+                                                       : McapStatus::kDecompressFailed;
+      }
+#endif
+      (void)compression;
+      (void)src;
+      return McapStatus::kUnsupportedCompression;
+    }
+
+    static constexpr uint8_t kUnknown = 0;
+    static constexpr uint8_t kWanted = 1;
+    static constexpr uint8_t kUnwanted = 2;
+
+    std::vector<std::string> topics_;
+    std::vector<Schema> schemas_;            // by schema id
+    std::vector<mcap::Channel> channels_;    // by channel id
+    std::vector<uint8_t> wanted_;            // by channel id
+    std::string buffer_;                     // decompressed chunk
+    mcap::ReadStats stats_;
+  };
+
+  // sensor_msgs/msg/Imu in ROS 2's CDR: a 4-byte encapsulation header whose
+  // second byte gives the byte order, then the fields, each aligned to its
+  // size counting from the end of the header. Only header.stamp and
+  // linear_acceleration are read; the fields in between have a fixed size
+  // once past the frame_id string.
+  inline bool decode_cdr_imu(std::string_view data, AccelerationData &row) {
+    if (data.size() < 4 || data[0] != 0 || (data[1] != 0 && data[1] != 1)) return false;
+    const bool swap = (data[1] == 1) != (std::endian::native == std::endian::little);
+    const char *p = data.data() + 4;
+    const size_t n = data.size() - 4;
+    if (n < 12) return false;
+    const int32_t sec = mcap::load<int32_t>(p, swap);
+    const uint32_t nanosec = mcap::load<uint32_t>(p + 4, swap);
+    const uint32_t frame_id_len = mcap::load<uint32_t>(p + 8, swap);  // with the NUL
+    if (frame_id_len > n) return false;
+    size_t pos = (12 + size_t(frame_id_len) + 7) & ~size_t(7);
+    // orientation, orientation_covariance, angular_velocity and its covariance
+    pos += (4 + 9 + 3 + 9) * sizeof(double);
+    if (pos + 3 * sizeof(double) > n) return false;
+    row.ts_ns = int64_t(sec) * 1'000'000'000LL + int64_t(nanosec);
+    row.linear_acceleration_x = mcap::load<double>(p + pos, swap);
+    row.linear_acceleration_y = mcap::load<double>(p + pos + 8, swap);
+    row.linear_acceleration_z = mcap::load<double>(p + pos + 16, swap);
+    return true;
+  }
+
+  // The inverse of decode_cdr_imu(), little-endian, with identity
+  // orientation and zero covariances and angular velocity.
+  inline void encode_cdr_imu(const AccelerationData &row, std::string &out,
+                             std::string_view frame_id = "imu") {
+    out.assign({0, 1, 0, 0});
+    auto put = [&](auto v) {
+      char bytes[sizeof(v)];
+      std::memcpy(bytes, &v, sizeof(v));
+      if constexpr (std::endian::native == std::endian::big) std::reverse(bytes, bytes + sizeof(v));
+      out.append(bytes, sizeof(v));
+    };
+    put(int32_t(row.ts_ns / 1'000'000'000LL));
+    put(uint32_t(row.ts_ns % 1'000'000'000LL));
+    put(uint32_t(frame_id.size() + 1));
+    out.append(frame_id);
+    out.push_back('\0');
+    out.resize(4 + ((out.size() - 4 + 7) & ~size_t(7)), '\0');
+    for (double v : {0.0, 0.0, 0.0, 1.0}) put(v);
+    for (int i = 0; i < 9 + 3 + 9; ++i) put(0.0);
+    put(row.linear_acceleration_x);
+    put(row.linear_acceleration_y);
+    put(row.linear_acceleration_z);
+    for (int i = 0; i < 9; ++i) put(0.0);
+  }
+
+  inline bool is_cdr_imu(const mcap::Channel &channel) {
+    return channel.message_encoding == "cdr" && (channel.schema_name == "sensor_msgs/msg/Imu" ||
+                                                 channel.schema_name == "sensor_msgs/Imu");
+  }
+
+  struct McapDecodeResult {
+    size_t messages = 0;      // on the reader's topics
+    size_t rows = 0;
+    size_t bad_messages = 0;  // not a CDR sensor_msgs/msg/Imu, or malformed
+    McapStatus status = McapStatus::kOk;
+  };
+
+  // Decodes the IMU messages of one MCAP file straight into rows, with the
+  // header stamp as ts_ns like ros_imu_schema().
+  template <typename Sink>
+  McapDecodeResult decode_mcap_imu(std::string_view file, McapReader &reader, Sink &&sink) {
+    McapDecodeResult result;
+    AccelerationData row{};
+    int last = -1;  // channel id of the previous message
+    bool imu = false;
+    result.status = reader.read(file, [&](const mcap::Message &msg) {
+      ++result.messages;
+      if (msg.channel->id != last) {
+        last = msg.channel->id;
+        imu = is_cdr_imu(*msg.channel);
+      }
+      if (imu && decode_cdr_imu(msg.data, row)) {
+        sink(row);
+        ++result.rows;
+      } else {
+        ++result.bad_messages;
+      }
+    });
+    return result;
+  }
+
+  namespace mcap {
+    // Builds an MCAP file in memory: schemas and channels up front and again
+    // in the summary, messages in chunks of about chunk_size uncompressed
+    // bytes, each followed by its message indexes. Used to make local files
+    // for mcap_imu and the benchmarks. A compression this build does not
+    // support (see supports()) writes uncompressed chunks.
+    class Writer {
+    public:
+      explicit Writer(std::string compression = {}, size_t chunk_size = 1024 * 1024)
+          : compression_(supports(compression) ? std::move(compression) : std::string{}),
+            chunk_size_(chunk_size) {
+        out_.append(kMagic, 8);
+        begin(out_, kHeader);
+        put_str(out_, "ros2");
+        put_str(out_, "reduct-examples");
+        end(out_);
+      }
+
+      const std::string &compression() const { return compression_; }
+
+      uint16_t add_schema(std::string_view name, std::string_view encoding,
+                          std::string_view data) {
+        const auto id = uint16_t(schemas_.size() + 1);
+        std::string rec;
+        begin(rec, kSchema);
+        put(rec, id);
+        put_str(rec, name);
+        put_str(rec, encoding);
+        put_str(rec, data);
+        end(rec);
+        schemas_.push_back(rec);
+        out_ += rec;
+        return id;
+      }
+
+      uint16_t add_channel(uint16_t schema_id, std::string_view topic,
+                           std::string_view message_encoding) {
+        const auto id = uint16_t(channels_.size() + 1);
+        std::string rec;
+        begin(rec, kChannel);
+        put(rec, id);
+        put(rec, schema_id);
+        put_str(rec, topic);
+        put_str(rec, message_encoding);
+        put(rec, uint32_t(0));  // no metadata
+        end(rec);
+        channels_.push_back(rec);
+        index_.resize(channels_.size() + 1);
+        out_ += rec;
+        return id;
+      }
+
+      // Returns false, writing nothing, for a channel id add_channel() did not
+      // hand out.
+      bool write(uint16_t channel, uint64_t log_time, std::string_view data) {
+        if (channel == 0 || channel >= index_.size()) return false;
+        if (chunk_.empty()) chunk_start_ = log_time;
+        chunk_start_ = std::min(chunk_start_, log_time);
+        chunk_end_ = std::max(chunk_end_, log_time);
+        index_[channel].push_back({log_time, chunk_.size()});
+        begin(chunk_, kMessage);
+        put(chunk_, channel);
+        put(chunk_, uint32_t(sequence_++));
+        put(chunk_, log_time);
+        put(chunk_, log_time);
+        chunk_.append(data);
+        end(chunk_);
+        if (chunk_.size() >= chunk_size_) flush();
+        return true;
+      }
+
+      std::string finish() {
+        flush();
+        begin(out_, kDataEnd);
+        put(out_, uint32_t(0));
+        end(out_);
+        const uint64_t summary_start = out_.size();
+        for (const auto &rec : schemas_) out_ += rec;
+        for (const auto &rec : channels_) out_ += rec;
+        begin(out_, kFooter);
+        put(out_, summary_start);
+        put(out_, uint64_t(0));  // no summary offsets
+        put(out_, uint32_t(0));
+        end(out_);
+        out_.append(kMagic, 8);
+        return std::move(out_);
+      }
+
+    private:
+      struct IndexEntry {
+        uint64_t log_time;
+        uint64_t offset;
+      };
+
+      template <typename T> static void put(std::string &out, T v) {
+        char bytes[sizeof(T)];
+        std::memcpy(bytes, &v, sizeof(T));
+        if constexpr (std::endian::native == std::endian::big) std::reverse(bytes, bytes + sizeof(T));
+        out.append(bytes, sizeof(T));
+      }
+      static void put_str(std::string &out, std::string_view s) {
+        put(out, uint32_t(s.size()));
+        out.append(s);
+      }
+      // Opens a record; end() fills in its length.
+      void begin(std::string &out, Opcode op) {
+        out.push_back(char(op));
+        open_ = out.size();
+        put(out, uint64_t(0));
+      }
+      void end(std::string &out) {
+        std::string len;
+        put(len, uint64_t(out.size() - open_ - 8));
+        std::memcpy(out.data() + open_, len.data(), 8);
+      }
+
+      void flush() {
+        if (chunk_.empty()) return;
+        std::string_view records = chunk_;
+        std::string packed;
+#ifdef HAVE_LZ4
+        if (compression_ == "lz4") {
+          packed.resize(LZ4F_compressFrameBound(chunk_.size(), nullptr));
+          packed.resize(LZ4F_compressFrame(packed.data(), packed.size(), chunk_.data(),
+                                           chunk_.size(), nullptr));
+          records = packed;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        if (compression_ == "zstd") {
+          packed.resize(ZSTD_compressBound(chunk_.size()));
+          packed.resize(ZSTD_compress(packed.data(), packed.size(), chunk_.data(),
+                                      chunk_.size(), 1));
+          records = packed;
+        }
+#endif
+        begin(out_, kChunk);
+        put(out_, chunk_start_);
+        put(out_, chunk_end_);
+        put(out_, uint64_t(chunk_.size()));
+        put(out_, uint32_t(0));  // no CRC
+        put_str(out_, compression_);
+        put(out_, uint64_t(records.size()));
+        out_.append(records);
+        end(out_);
+
+        for (size_t id = 1; id < index_.size(); ++id) {
+          if (index_[id].empty()) continue;
+          begin(out_, kMessageIndex);
+          put(out_, uint16_t(id));
+          put(out_, uint32_t(index_[id].size() * sizeof(IndexEntry)));
+          for (const auto &e : index_[id]) {
+            put(out_, e.log_time);
+            put(out_, e.offset);
+          }
+          end(out_);
+          index_[id].clear();
+        }
+        chunk_.clear();
+        chunk_end_ = 0;
+      }
+
+      std::string compression_;
+      size_t chunk_size_;
+      std::string out_;
+      std::string chunk_;
+      size_t open_ = 0;
+      std::vector<std::string> schemas_;
+      std::vector<std::string> channels_;
+      std::vector<std::vector<IndexEntry>> index_;  // by channel id, current chunk
+      uint64_t chunk_start_ = 0;
+      uint64_t chunk_end_ = 0;
+      uint32_t sequence_ = 0;
+    };
+  }
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <utility>
+
+namespace common {
+  // Bounded lock-free multi-producer/multi-consumer ring (Vyukov's
+  // sequence-per-cell design). Every cell carries a sequence number that
+  // tells producers and consumers whose turn it is, so neither side takes a
+  // lock and a slot is only touched by the thread that claimed it. The
+  // capacity is rounded up to a power of two; T must be default
+  // constructible and movable.
+  template <typename T>
+  class MpmcRing {
+  public:
+    explicit MpmcRing(size_t capacity)
+        : mask_(std::bit_ceil(std::max<size_t>(capacity, 2)) - 1),
+          cells_(std::make_unique<Cell[]>(mask_ + 1)) {
+      for (size_t i = 0; i <= mask_; ++i) {
+        cells_[i].seq.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    MpmcRing(const MpmcRing &) = delete;
+    MpmcRing &operator=(const MpmcRing &) = delete;
+
+    size_t capacity() const { return mask_ + 1; }
+
+    // Leaves `value` untouched and returns false if the ring is full.
+    bool try_push(T &value) {
+      size_t pos = head_.load(std::memory_order_relaxed);
+      for (;;) {
+        Cell &cell = cells_[pos & mask_];
+        const size_t seq = cell.seq.load(std::memory_order_acquire);
+        const auto diff = intptr_t(seq) - intptr_t(pos);
+        if (diff == 0) {
+          if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            cell.value = std::move(value);
+            cell.seq.store(pos + 1, std::memory_order_release);
+            return true;
+          }
+        } else if (diff < 0) {
+          return false;
+        } else {
+          pos = head_.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    bool try_pop(T &out) {
+      size_t pos = tail_.load(std::memory_order_relaxed);
+      for (;;) {
+        Cell &cell = cells_[pos & mask_];
+        const size_t seq = cell.seq.load(std::memory_order_acquire);
+        const auto diff = intptr_t(seq) - intptr_t(pos + 1);
+        if (diff == 0) {
+          if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            out = std::move(cell.value);
+            cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+            return true;
+          }
+        } else if (diff < 0) {
+          return false;
+        } else {
+          pos = tail_.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+  private:
+    struct Cell {
+      std::atomic<size_t> seq;
+      T value;
+    };
+
+    const size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+  };
+
+  // Spin, then yield, then sleep: keeps a waiting thread cheap when the
+  // other side is merely a little behind, without burning a core when it
+  // is stalled on the network.
+  class Backoff {
+  public:
+    void wait() {
+      if (n_ < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+      } else if (n_ < 128) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+      ++n_;
+    }
+    void reset() { n_ = 0; }
+
+  private:
+    uint32_t n_ = 0;
+  };
+}
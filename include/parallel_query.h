@@ -0,0 +1,236 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <reduct/client.h>
+#include "arena.h"
+#include "common.h"
+#include "profiling.h"
+
+namespace common {
+  using Time = reduct::IBucket::Time;
+
+  struct TimeWindow {
+    Time start;
+    Time stop;  // exclusive, as in IBucket::Query
+  };
+
+  struct ShardOptions {
+    size_t workers = 0;                        // 0 = hardware_concurrency
+    size_t max_shards = 0;                     // 0 = 4 shards per worker
+    size_t target_shard_bytes = 4 * 1024 * 1024;
+  };
+
+  // One client per process: every bucket handle below is opened from it, so
+  // workers and jobs share its settings instead of building their own. The
+  // result is null, with the error set, if the client could not be built.
+  inline reduct::Result<const reduct::IClient *> shared_client() {
+    static const std::unique_ptr<reduct::IClient> client =
+        reduct::IClient::Build(URL, {.api_token = TOKEN});
+    if (!client) {
+      return {nullptr, reduct::Error{.code = -1,
+                                     .message = "Failed to build a client for " +
+                                                std::string(URL)}};
+    }
+    return {client.get(), reduct::Error::kOk};
+  }
+
+  inline std::unique_ptr<reduct::IBucket> connect_bucket() {
+    static std::mutex mutex;
+    std::lock_guard lock(mutex);
+    auto [client, c_err] = shared_client();
+    if (c_err != reduct::Error::kOk) return nullptr;
+    auto [bucket, err] = client->GetBucket(BUCKET);
+    if (err != reduct::Error::kOk) return nullptr;
+    return std::move(bucket);
+  }
+
+  // Works with anything exposing GetEntryList(), e.g. IBucket or QueryCache.
+  template <typename Source>
+  std::optional<reduct::IBucket::EntryInfo>
+  find_entry(const Source &bucket, const std::string &name) {
+    auto [entries, err] = bucket.GetEntryList();
+    if (err != reduct::Error::kOk) return std::nullopt;
+    for (auto &e : entries) {
+      if (e.name == name) return e;
+    }
+    return std::nullopt;
+  }
+
+  inline size_t resolve_workers(const ShardOptions &opts) {
+    if (opts.workers > 0) return opts.workers;
+    return std::max<size_t>(1, std::thread::hardware_concurrency());
+  }
+
+  // Calls fn(i) for i in [0, n) on up to `workers` threads.
+  template <typename Fn>
+  void parallel_for(size_t n, Fn fn, size_t workers = 0) {
+    std::atomic<size_t> next{0};
+    auto run = [&] {
+      for (size_t i = next++; i < n; i = next++) fn(i);
+    };
+    size_t n_workers = std::min(resolve_workers({.workers = workers}), n);
+    std::vector<std::thread> pool;
+    pool.reserve(n_workers);
+    for (size_t i = 0; i < n_workers; ++i) pool.emplace_back(run);
+    for (auto &t : pool) t.join();
+  }
+
+  // Splits [start, stop) into equal-duration windows sized so that each one
+  // carries roughly target_shard_bytes, assuming the entry's bytes are spread
+  // evenly between its oldest and latest record.
+  inline std::vector<TimeWindow>
+  plan_shards(const reduct::IBucket::EntryInfo &entry, Time start, Time stop,
+              const ShardOptions &opts = {}) {
+    if (stop <= start) return {{start, stop}};
+
+    const Time entry_stop = entry.latest_record + std::chrono::microseconds(1);
+    const Time lo = std::max(start, entry.oldest_record);
+    const Time hi = std::min(stop, entry_stop);
+    if (hi <= lo || entry.record_count == 0) return {{start, stop}};
+
+    const double span = double((entry_stop - entry.oldest_record).count());
+    const double fraction = double((hi - lo).count()) / span;
+    const double est_bytes = double(entry.size) * fraction;
+    const double est_records = double(entry.record_count) * fraction;
+
+    size_t max_shards =
+        opts.max_shards > 0 ? opts.max_shards : 4 * resolve_workers(opts);
+    size_t n = size_t(est_bytes / double(std::max<size_t>(1, opts.target_shard_bytes))) + 1;
+    n = std::min({n, max_shards, size_t(est_records) + 1,
+                  size_t((hi - lo).count())});
+    n = std::max<size_t>(n, 1);
+
+    std::vector<TimeWindow> windows;
+    windows.reserve(n);
+    const auto step = (hi - lo) / int64_t(n);
+    Time cursor = start;
+    for (size_t i = 1; i < n; ++i) {
+      Time edge = lo + step * int64_t(i);
+      windows.push_back({cursor, edge});
+      cursor = edge;
+    }
+    windows.push_back({cursor, stop});
+    return windows;
+  }
+
+  template <typename T>
+  void append_batch(std::vector<T> &dst, std::vector<T> &&src) {
+    if (dst.empty()) {
+      dst = std::move(src);
+      return;
+    }
+    dst.insert(dst.end(), std::make_move_iterator(src.begin()),
+               std::make_move_iterator(src.end()));
+  }
+
+  // Runs one query per shard on a pool of workers and merges the per-shard
+  // batches in window order. ReductStore returns records of an entry in
+  // timestamp order and the windows don't overlap, so the merged batch is
+  // ordered without sorting. Options that count records across the whole
+  // query ($limit, $each_n, $each_t) would apply per shard, so use a single
+  // shard for those.
+  //
+  // Each worker opens its own connection through connect(), which returns a
+  // pointer to an IBucket or anything with the same Query() signature.
+  // decode(record, batch) fills the shard-local batch and returns false to
+  // stop the query; it is called from several threads at once, each record
+  // inside an ArenaScope.
+  template <typename Batch, typename Connect, typename Decode>
+  reduct::Result<Batch>
+  query_sharded(const Connect &connect, const std::string &entry,
+                const std::vector<TimeWindow> &windows,
+                const reduct::IBucket::QueryOptions &options, Decode decode,
+                const ShardOptions &opts = {}) {
+    profile::Scope query_scope("query");
+    std::vector<Batch> batches(windows.size());
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    std::mutex err_mutex;
+    reduct::Error first_error = reduct::Error::kOk;
+
+    auto fail = [&](reduct::Error err) {
+      std::lock_guard lock(err_mutex);
+      if (!failed.exchange(true)) first_error = std::move(err);
+    };
+
+    auto worker = [&] {
+      auto bucket = connect();
+      if (!bucket) {
+        fail(reduct::Error{.code = -1, .message = "Failed to connect bucket"});
+        return;
+      }
+      static auto &shard_stage = profile::stage("query.shard");
+      static auto &record_stage = profile::stage("query.record");
+      for (size_t i = next++; i < windows.size() && !failed; i = next++) {
+        auto &batch = batches[i];
+        profile::Scope shard_scope(shard_stage);
+        auto err = bucket->Query(
+            entry, windows[i].start, windows[i].stop, options,
+            [&](const reduct::IBucket::ReadableRecord &rec) {
+              if (failed) return false;
+              ArenaScope arena;
+              profile::Scope scope(record_stage);
+              scope.bytes(rec.size);
+              if constexpr (requires { batch.size(); }) {
+                const size_t before = batch.size();
+                bool keep_going = decode(rec, batch);
+                scope.rows(batch.size() - before);
+                return keep_going;
+              } else {
+                return decode(rec, batch);
+              }
+            });
+        if (err != reduct::Error::kOk) fail(std::move(err));
+      }
+    };
+
+    size_t n_workers = std::min(resolve_workers(opts), windows.size());
+    std::vector<std::thread> pool;
+    pool.reserve(n_workers);
+    for (size_t i = 0; i < n_workers; ++i) pool.emplace_back(worker);
+    for (auto &t : pool) t.join();
+
+    if (failed) return {Batch{}, first_error};
+
+    Batch merged{};
+    for (auto &batch : batches) append_batch(merged, std::move(batch));
+    return {std::move(merged), reduct::Error::kOk};
+  }
+
+  // Plans the shards from the entry's size and record count and runs them.
+  template <typename Batch, typename Connect, typename Decode>
+  reduct::Result<Batch>
+  query_sharded(const Connect &connect, const std::string &entry,
+                std::optional<Time> start, std::optional<Time> stop,
+                const reduct::IBucket::QueryOptions &options, Decode decode,
+                const ShardOptions &opts = {}) {
+    auto bucket = connect();
+    if (!bucket) {
+      return {Batch{},
+              reduct::Error{.code = -1, .message = "Failed to connect bucket"}};
+    }
+
+    std::optional<reduct::IBucket::EntryInfo> info;
+    {
+      profile::Scope scope("query.plan");
+      info = find_entry(*bucket, entry);
+    }
+    Time lo = start.value_or(info ? info->oldest_record : Time{});
+    Time hi = stop.value_or(info ? info->latest_record + std::chrono::microseconds(1)
+                                 : Time::max());
+    std::vector<TimeWindow> windows =
+        info ? plan_shards(*info, lo, hi, opts)
+             : std::vector<TimeWindow>{{lo, hi}};
+    return query_sharded<Batch>(connect, entry, windows, options,
+                                std::move(decode), opts);
+  }
+}
@@ -0,0 +1,232 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <reduct/client.h>
+#include "arena.h"
+#include "data_structures.h"
+#include "mpmc_ring.h"
+#include "parallel_query.h"
+#include "profiling.h"
+
+namespace common {
+  struct PipelineOptions {
+    size_t decoders = 0;                        // 0 = hardware_concurrency
+    size_t ring_slots = 256;
+    size_t max_bytes_in_flight = 64 * 1024 * 1024;
+  };
+
+  // One record handed from the Query callback to a decoder.
+  struct PipelineItem {
+    uint64_t seq = 0;  // arrival order
+    reduct::IBucket::Time timestamp{};
+    reduct::IBucket::LabelMap labels;
+    std::string content_type;
+    std::string blob;
+  };
+
+  template <typename T>
+  void append_range(std::vector<T> &dst, const std::vector<T> &src, size_t begin,
+                    size_t end) {
+    dst.insert(dst.end(), src.begin() + std::ptrdiff_t(begin),
+               src.begin() + std::ptrdiff_t(end));
+  }
+
+  inline void append_range(AccelerationFrame &dst, const AccelerationFrame &src,
+                           size_t begin, size_t end) {
+    dst.append(src, begin, end);
+  }
+
+  // Decouples reading records from decoding them. push() reads the blob and
+  // moves it into a lock-free ring, so the Query callback returns as soon as
+  // the bytes are off the socket. A pool of decoders drains the ring, each
+  // appending to its own batch. finish() stitches the per-decoder batches
+  // together in record timestamp order, which gives the same result as
+  // decoding serially.
+  //
+  // push() blocks while the ring is full or more than max_bytes_in_flight
+  // are queued, which stalls the HTTP stream instead of growing memory.
+  // decode(item, batch) is called from several threads at once, inside an
+  // ArenaScope, so it can use thread_arena() for per-record scratch. Items
+  // go back to a pool once decoded and their blob and label buffers are
+  // reused by later records.
+  template <typename Batch, typename Decode>
+  class DecodePipeline {
+  public:
+    DecodePipeline(Decode decode, PipelineOptions options = {})
+        : decode_(std::move(decode)), options_(options),
+          ring_(options.ring_slots), items_(ring_.capacity() * 2) {
+      const size_t n = resolve_workers({.workers = options.decoders});
+      outputs_.resize(n);
+      pool_.reserve(n);
+      for (size_t i = 0; i < n; ++i) pool_.emplace_back([this, i] { run(outputs_[i]); });
+    }
+
+    DecodePipeline(const DecodePipeline &) = delete;
+    DecodePipeline &operator=(const DecodePipeline &) = delete;
+
+    ~DecodePipeline() { close(); }
+
+    // Returns false if the record could not be read; the error is kept for
+    // finish().
+    bool push(const reduct::IBucket::ReadableRecord &rec) {
+      static auto &stage = profile::stage("pipeline.push");
+      profile::Scope scope(stage);
+      scope.bytes(rec.size);
+
+      PipelineItem item = items_.acquire();
+      item.seq = next_seq_.fetch_add(1, std::memory_order_relaxed);
+      item.timestamp = rec.timestamp;
+      item.labels = rec.labels;
+      item.content_type = rec.content_type;
+      auto err = read_blob(rec, item.blob);
+      if (err != reduct::Error::kOk) {
+        std::lock_guard lock(error_mutex_);
+        if (error_ == reduct::Error::kOk) error_ = std::move(err);
+        return false;
+      }
+
+      const size_t bytes = item.blob.size();
+      // Check and reserve in one step, so concurrent pushes cannot both pass
+      // the limit check and overshoot it together.
+      Backoff backoff;
+      size_t queued = bytes_in_flight_.load(std::memory_order_acquire);
+      for (;;) {
+        if (queued != 0 && queued + bytes > options_.max_bytes_in_flight) {
+          backoff.wait();
+          queued = bytes_in_flight_.load(std::memory_order_acquire);
+        } else if (bytes_in_flight_.compare_exchange_weak(queued, queued + bytes,
+                                                          std::memory_order_acq_rel,
+                                                          std::memory_order_acquire)) {
+          break;
+        }
+      }
+      backoff.reset();
+      while (!ring_.try_push(item)) backoff.wait();
+      return true;
+    }
+
+    reduct::Result<Batch> finish() {
+      close();
+
+      struct Piece {
+        int64_t ts;
+        uint64_t seq;
+        const Batch *batch;
+        size_t begin, end;
+      };
+      std::vector<Piece> pieces;
+      for (const auto &out : outputs_) {
+        for (const auto &seg : out.segments) {
+          pieces.push_back({seg.ts, seg.seq, &out.batch, seg.begin, seg.end});
+        }
+      }
+      std::sort(pieces.begin(), pieces.end(), [](const Piece &a, const Piece &b) {
+        return std::tie(a.ts, a.seq) < std::tie(b.ts, b.seq);
+      });
+
+      Batch merged{};
+      for (const auto &p : pieces) append_range(merged, *p.batch, p.begin, p.end);
+      outputs_.clear();
+
+      std::lock_guard lock(error_mutex_);
+      return {std::move(merged), error_};
+    }
+
+  private:
+    struct Segment {
+      int64_t ts;
+      uint64_t seq;
+      size_t begin, end;
+    };
+
+    struct Output {
+      Batch batch{};
+      std::vector<Segment> segments;
+    };
+
+    void close() {
+      if (pool_.empty()) return;
+      closed_.store(true, std::memory_order_release);
+      for (auto &t : pool_) t.join();
+      pool_.clear();
+    }
+
+    void run(Output &out) {
+      static auto &stage = profile::stage("pipeline.decode");
+      PipelineItem item;
+      Backoff backoff;
+      for (;;) {
+        if (!ring_.try_pop(item)) {
+          // closed_ is only set once every push() has returned, so an empty
+          // ring seen after it is final.
+          if (!closed_.load(std::memory_order_acquire)) {
+            backoff.wait();
+            continue;
+          }
+          if (!ring_.try_pop(item)) return;
+        }
+        backoff.reset();
+        {
+          ArenaScope arena;
+          profile::Scope scope(stage);
+          scope.bytes(item.blob.size());
+          const size_t begin = out.batch.size();
+          decode_(std::as_const(item), out.batch);
+          scope.rows(out.batch.size() - begin);
+          if (out.batch.size() > begin) {
+            out.segments.push_back({item.timestamp.time_since_epoch().count(),
+                                    item.seq, begin, out.batch.size()});
+          }
+        }
+        bytes_in_flight_.fetch_sub(item.blob.size(), std::memory_order_acq_rel);
+        items_.release(std::move(item));
+      }
+    }
+
+    Decode decode_;
+    PipelineOptions options_;
+    MpmcRing<PipelineItem> ring_;
+    ObjectPool<PipelineItem> items_;
+    std::vector<Output> outputs_;
+    std::vector<std::thread> pool_;
+    std::atomic<uint64_t> next_seq_{0};
+    std::atomic<size_t> bytes_in_flight_{0};
+    std::atomic<bool> closed_{false};
+    std::mutex error_mutex_;
+    reduct::Error error_ = reduct::Error::kOk;
+  };
+
+  struct Unbatched {};
+  inline void append_batch(Unbatched &, Unbatched &&) {}
+
+  // query_sharded() with the decoding moved off the Query callbacks: the
+  // shard workers only read records into the pipeline and decode(item,
+  // batch) runs on the decoder pool. Batch needs size() so each record's
+  // rows can be put back in timestamp order.
+  template <typename Batch, typename Connect, typename Decode>
+  reduct::Result<Batch>
+  query_pipelined(const Connect &connect, const std::string &entry,
+                  std::optional<Time> start, std::optional<Time> stop,
+                  const reduct::IBucket::QueryOptions &options, Decode decode,
+                  const PipelineOptions &pipeline_opts = {},
+                  const ShardOptions &shard_opts = {}) {
+    DecodePipeline<Batch, Decode> pipeline(std::move(decode), pipeline_opts);
+    auto [unused, q_err] = query_sharded<Unbatched>(
+        connect, entry, start, stop, options,
+        [&](const reduct::IBucket::ReadableRecord &rec, Unbatched &) {
+          return pipeline.push(rec);
+        },
+        shard_opts);
+    auto result = pipeline.finish();
+    if (q_err != reduct::Error::kOk) return {Batch{}, q_err};
+    return result;
+  }
+}
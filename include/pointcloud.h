@@ -0,0 +1,420 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace common {
+  struct PointData {
+    float x;
+    float y;
+    float z;
+    float intensity;
+  };
+  static_assert(sizeof(PointData) == 16, "PointData must match the packed layout");
+
+  // sensor_msgs/PointField datatypes.
+  enum class PointFieldType : uint8_t {
+    kInt8 = 1,
+    kUint8,
+    kInt16,
+    kUint16,
+    kInt32,
+    kUint32,
+    kFloat32,
+    kFloat64
+  };
+
+  inline size_t point_field_size(PointFieldType type) {
+    switch (type) {
+    case PointFieldType::kInt8:
+    case PointFieldType::kUint8: return 1;
+    case PointFieldType::kInt16:
+    case PointFieldType::kUint16: return 2;
+    case PointFieldType::kInt32:
+    case PointFieldType::kUint32:
+    case PointFieldType::kFloat32: return 4;
+    case PointFieldType::kFloat64: return 8;
+    }
+    return 0;
+  }
+
+  struct PointField {
+    uint32_t offset = 0;
+    PointFieldType type = PointFieldType::kFloat32;
+    bool present = false;
+  };
+
+  // Where x, y, z and intensity sit in a PointCloud2 point. Other fields
+  // (ring, time, reflectivity, padding) are skipped by point_step.
+  struct PointLayout {
+    uint32_t point_step = sizeof(PointData);
+    // Bytes per row and points per row of an organized cloud whose rows are
+    // padded; 0 when the points are contiguous.
+    uint32_t row_step = 0;
+    uint32_t width = 0;
+    bool big_endian = false;
+    PointField x{0, PointFieldType::kFloat32, true};
+    PointField y{4, PointFieldType::kFloat32, true};
+    PointField z{8, PointFieldType::kFloat32, true};
+    PointField intensity{12, PointFieldType::kFloat32, true};
+
+    // The packed 16-byte layout of PointData.
+    bool packed() const {
+      return point_step == sizeof(PointData) && !big_endian && !padded_rows() &&
+             xyz_floats(0) && intensity.present && intensity.offset == 12 &&
+             intensity.type == PointFieldType::kFloat32;
+    }
+
+    // x, y, z as three consecutive float32 starting at `offset`.
+    bool xyz_floats(uint32_t offset) const {
+      return x.offset == offset && y.offset == offset + 4 && z.offset == offset + 8 &&
+             x.type == PointFieldType::kFloat32 && y.type == PointFieldType::kFloat32 &&
+             z.type == PointFieldType::kFloat32;
+    }
+
+    bool padded_rows() const {
+      return row_step > 0 && width > 0 && row_step != width * point_step;
+    }
+
+    bool valid() const {
+      auto fits = [&](const PointField &f) {
+        return !f.present || f.offset + point_field_size(f.type) <= point_step;
+      };
+      return point_step > 0 && x.present && y.present && z.present && fits(x) && fits(y) &&
+             fits(z) && fits(intensity) && (row_step == 0 || row_step >= width * point_step);
+    }
+
+    // Parses the PointCloud2 metadata a record carries in its labels:
+    //
+    //   point_step    bytes per point
+    //   fields        name:offset:datatype[:count],... with the datatype as
+    //                 the PointField code (7) or name (float32)
+    //   is_bigendian  optional, "1"/"true"
+    //   row_step, width  optional, for clouds with padded rows
+    //
+    // Without a fields label the blob is taken as packed PointData. Unknown
+    // fields are ignored; "intensity", "reflectivity" and "signal" are read
+    // as intensity, in that order of preference.
+    template <typename Labels>
+    static std::optional<PointLayout> from_labels(const Labels &labels) {
+      PointLayout layout;
+      auto get = [&](const char *key) -> std::optional<std::string_view> {
+        auto it = labels.find(key);
+        if (it == labels.end()) return std::nullopt;
+        return std::string_view(it->second);
+      };
+      auto fields = get("fields");
+      if (!fields) return layout;
+
+      auto number = [](std::string_view s) -> std::optional<uint32_t> {
+        if (s.empty() || s.size() > 9) return std::nullopt;
+        uint32_t v = 0;
+        for (char c : s) {
+          if (c < '0' || c > '9') return std::nullopt;
+          v = v * 10 + uint32_t(c - '0');
+        }
+        return v;
+      };
+      auto step = get("point_step");
+      if (!step) return std::nullopt;
+      layout.point_step = number(*step).value_or(0);
+      if (auto big = get("is_bigendian")) layout.big_endian = *big == "1" || *big == "true";
+      if (auto row = get("row_step")) layout.row_step = number(*row).value_or(0);
+      if (auto width = get("width")) layout.width = number(*width).value_or(0);
+
+      layout.x.present = layout.y.present = layout.z.present = false;
+      layout.intensity.present = false;
+      int intensity_rank = 0;
+      std::string_view rest = *fields;
+      while (!rest.empty()) {
+        const size_t comma = rest.find(',');
+        std::string_view field = rest.substr(0, comma);
+        rest = comma == std::string_view::npos ? std::string_view{} : rest.substr(comma + 1);
+
+        std::string_view part[4];
+        size_t n_parts = 0;
+        while (n_parts < 4) {
+          const size_t colon = field.find(':');
+          part[n_parts++] = field.substr(0, colon);
+          if (colon == std::string_view::npos) break;
+          field.remove_prefix(colon + 1);
+        }
+        if (n_parts < 3) return std::nullopt;
+        auto offset = number(part[1]);
+        auto type = parse_type(part[2]);
+        if (!offset || !type) return std::nullopt;
+        const PointField f{*offset, *type, true};
+
+        const std::string_view name = part[0];
+        if (name == "x") {
+          layout.x = f;
+        } else if (name == "y") {
+          layout.y = f;
+        } else if (name == "z") {
+          layout.z = f;
+        } else {
+          const int rank = name == "intensity" ? 3 : name == "reflectivity" ? 2
+                           : name == "signal"  ? 1 : 0;
+          if (rank > intensity_rank) {
+            layout.intensity = f;
+            intensity_rank = rank;
+          }
+        }
+      }
+      if (!layout.valid()) return std::nullopt;
+      return layout;
+    }
+
+  private:
+    static std::optional<PointFieldType> parse_type(std::string_view s) {
+      static constexpr std::string_view kNames[] = {"int8",   "uint8",  "int16",
+                                                    "uint16", "int32",  "uint32",
+                                                    "float32", "float64"};
+      for (size_t i = 0; i < 8; ++i) {
+        if (s == kNames[i] || (s.size() == 1 && s[0] == char('1' + i))) {
+          return PointFieldType(i + 1);
+        }
+      }
+      return std::nullopt;
+    }
+  };
+
+  namespace pointcloud_detail {
+    template <typename T> T load(const char *p) {
+      T v;
+      std::memcpy(&v, p, sizeof(T));
+      return v;
+    }
+
+    // Kernel for the common layouts: x, y, z as three float32 at `xyz` and
+    // intensity of type I (void when absent) at `in`. Step is the point step
+    // when it is one of the usual sizes, so the loads are at constant
+    // strides, or 0 to use `step`.
+    template <size_t Step, typename I>
+    void decode_xyzi(const char *data, size_t n, size_t step, uint32_t xyz, uint32_t in,
+                     PointData *out) {
+      const size_t s = Step ? Step : step;
+      for (size_t k = 0; k < n; ++k) {
+        const char *p = data + k * s;
+        std::memcpy(&out[k].x, p + xyz, 3 * sizeof(float));
+        if constexpr (std::is_void_v<I>) {
+          out[k].intensity = std::numeric_limits<float>::quiet_NaN();
+        } else {
+          out[k].intensity = float(load<I>(p + in));
+        }
+      }
+    }
+
+    inline float read_field(const char *p, const PointField &f, bool swap) {
+      if (!f.present) return std::numeric_limits<float>::quiet_NaN();
+      char bytes[8];
+      const size_t size = point_field_size(f.type);
+      std::memcpy(bytes, p + f.offset, size);
+      if (swap) std::reverse(bytes, bytes + size);
+      switch (f.type) {
+      case PointFieldType::kInt8: return float(load<int8_t>(bytes));
+      case PointFieldType::kUint8: return float(load<uint8_t>(bytes));
+      case PointFieldType::kInt16: return float(load<int16_t>(bytes));
+      case PointFieldType::kUint16: return float(load<uint16_t>(bytes));
+      case PointFieldType::kInt32: return float(load<int32_t>(bytes));
+      case PointFieldType::kUint32: return float(load<uint32_t>(bytes));
+      case PointFieldType::kFloat32: return load<float>(bytes);
+      case PointFieldType::kFloat64: return float(load<double>(bytes));
+      }
+      return std::numeric_limits<float>::quiet_NaN();
+    }
+
+    // Any valid layout, one field at a time.
+    inline void decode_strided(const char *data, size_t n, const PointLayout &layout,
+                               PointData *out) {
+      const bool swap = layout.big_endian != (std::endian::native == std::endian::big);
+      for (size_t k = 0; k < n; ++k) {
+        const char *p = data + k * layout.point_step;
+        out[k] = {read_field(p, layout.x, swap), read_field(p, layout.y, swap),
+                  read_field(p, layout.z, swap), read_field(p, layout.intensity, swap)};
+      }
+    }
+
+    using Kernel = void (*)(const char *, size_t, const PointLayout &, PointData *);
+
+    template <size_t Step, typename I>
+    void kernel(const char *data, size_t n, const PointLayout &layout, PointData *out) {
+      decode_xyzi<Step, I>(data, n, layout.point_step, layout.x.offset,
+                           layout.intensity.offset, out);
+    }
+
+    template <typename I> Kernel pick_step(uint32_t step) {
+      switch (step) {
+      case 16: return kernel<16, I>;
+      case 32: return kernel<32, I>;
+      case 48: return kernel<48, I>;
+      default: return kernel<0, I>;
+      }
+    }
+
+    // Chosen once per cloud, so the per-point loop has no dispatch.
+    inline Kernel pick(const PointLayout &layout) {
+      if (layout.big_endian != (std::endian::native == std::endian::big) ||
+          !layout.xyz_floats(layout.x.offset)) {
+        return decode_strided;
+      }
+      if (!layout.intensity.present) return pick_step<void>(layout.point_step);
+      switch (layout.intensity.type) {
+      case PointFieldType::kFloat32: return pick_step<float>(layout.point_step);
+      case PointFieldType::kUint16: return pick_step<uint16_t>(layout.point_step);
+      case PointFieldType::kUint8: return pick_step<uint8_t>(layout.point_step);
+      default: return decode_strided;
+      }
+    }
+  }
+
+  // Decodes the points of a PointCloud2 blob into `out`. Trailing bytes short
+  // of a whole point (or row) are ignored.
+  inline void decode_points(std::string_view blob, const PointLayout &layout,
+                            std::vector<PointData> &out) {
+    out.clear();
+    if (!layout.valid()) return;
+    const auto kernel = pointcloud_detail::pick(layout);
+    if (!layout.padded_rows()) {
+      const size_t n = blob.size() / layout.point_step;
+      out.resize(n);
+      kernel(blob.data(), n, layout, out.data());
+      return;
+    }
+    const size_t rows = blob.size() / layout.row_step;
+    out.resize(rows * layout.width);
+    for (size_t r = 0; r < rows; ++r) {
+      kernel(blob.data() + r * layout.row_step, layout.width, layout,
+             out.data() + r * layout.width);
+    }
+  }
+
+  // Points of a PointCloud2 blob. A packed {x, y, z, intensity} float blob
+  // is aliased, and must outlive the view, unless it isn't float-aligned;
+  // other layouts and unaligned blobs are decoded once into an owned buffer.
+  class PointCloudView {
+  public:
+    PointCloudView() = default;
+    PointCloudView(const PointCloudView &) = delete;
+    PointCloudView &operator=(const PointCloudView &) = delete;
+    PointCloudView(PointCloudView &&) = default;
+    PointCloudView &operator=(PointCloudView &&) = default;
+
+    static PointCloudView from_blob(std::string_view blob) {
+      PointCloudView view;
+      const size_t n = blob.size() / sizeof(PointData);
+      if (reinterpret_cast<uintptr_t>(blob.data()) % alignof(PointData) == 0) {
+        view.points_ = {reinterpret_cast<const PointData *>(blob.data()), n};
+      } else {
+        view.storage_.resize(n);
+        std::memcpy(view.storage_.data(), blob.data(), n * sizeof(PointData));
+        view.points_ = view.storage_;
+      }
+      return view;
+    }
+
+    // Any PointCloud2 layout; only the packed one can alias the blob.
+    static PointCloudView from_blob(std::string_view blob, const PointLayout &layout) {
+      if (layout.packed()) return from_blob(blob);
+      PointCloudView view;
+      decode_points(blob, layout, view.storage_);
+      view.points_ = view.storage_;
+      return view;
+    }
+
+    std::span<const PointData> points() const { return points_; }
+    size_t size() const { return points_.size(); }
+    bool copied() const { return !storage_.empty(); }
+
+  private:
+    std::span<const PointData> points_;
+    std::vector<PointData> storage_;
+  };
+
+  // Ranges over the points whose x, y and z are all non-NaN.
+  struct PointCloudStats {
+    size_t total = 0;
+    size_t valid = 0;
+    PointData min{std::numeric_limits<float>::infinity(),
+                  std::numeric_limits<float>::infinity(),
+                  std::numeric_limits<float>::infinity(),
+                  std::numeric_limits<float>::infinity()};
+    PointData max{-std::numeric_limits<float>::infinity(),
+                  -std::numeric_limits<float>::infinity(),
+                  -std::numeric_limits<float>::infinity(),
+                  -std::numeric_limits<float>::infinity()};
+
+    void merge(const PointCloudStats &other) {
+      total += other.total;
+      valid += other.valid;
+      min = {std::min(min.x, other.min.x), std::min(min.y, other.min.y),
+             std::min(min.z, other.min.z),
+             std::min(min.intensity, other.min.intensity)};
+      max = {std::max(max.x, other.max.x), std::max(max.y, other.max.y),
+             std::max(max.z, other.max.z),
+             std::max(max.intensity, other.max.intensity)};
+    }
+  };
+
+  inline bool is_valid_point(const PointData &p) {
+    return !std::isnan(p.x) && !std::isnan(p.y) && !std::isnan(p.z);
+  }
+
+  // Full-resolution NaN filter and min/max. A packed point is exactly one
+  // SSE register, so every point costs a load, an ordered-compare and two
+  // min/max ops with invalid points blended to +/-inf instead of branching.
+  inline PointCloudStats point_cloud_stats(std::span<const PointData> points) {
+    PointCloudStats s;
+    s.total = points.size();
+#if defined(__SSE2__)
+    const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    const __m128 ninf = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+    __m128 vmin = inf;
+    __m128 vmax = ninf;
+    size_t valid = 0;
+    for (const auto &p : points) {
+      __m128 v = _mm_loadu_ps(&p.x);
+      int ord = _mm_movemask_ps(_mm_cmpord_ps(v, v));
+      bool ok = (ord & 7) == 7;
+      __m128 keep = _mm_castsi128_ps(_mm_set1_epi32(-int32_t(ok)));
+      // _mm_min_ps/_mm_max_ps return the second operand on NaN, so a NaN
+      // intensity on a valid point never replaces the running value.
+      vmin = _mm_min_ps(_mm_or_ps(_mm_and_ps(keep, v), _mm_andnot_ps(keep, inf)), vmin);
+      vmax = _mm_max_ps(_mm_or_ps(_mm_and_ps(keep, v), _mm_andnot_ps(keep, ninf)), vmax);
+      valid += size_t(ok);
+    }
+    s.valid = valid;
+    _mm_storeu_ps(&s.min.x, vmin);
+    _mm_storeu_ps(&s.max.x, vmax);
+#else
+    for (const auto &p : points) {
+      if (!is_valid_point(p)) continue;
+      ++s.valid;
+      s.min.x = std::min(s.min.x, p.x);
+      s.min.y = std::min(s.min.y, p.y);
+      s.min.z = std::min(s.min.z, p.z);
+      s.max.x = std::max(s.max.x, p.x);
+      s.max.y = std::max(s.max.y, p.y);
+      s.max.z = std::max(s.max.z, p.z);
+      if (!std::isnan(p.intensity)) {
+        s.min.intensity = std::min(s.min.intensity, p.intensity);
+        s.max.intensity = std::max(s.max.intensity, p.intensity);
+      }
+    }
+#endif
+    return s;
+  }
+}
@@ -0,0 +1,486 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "data_structures.h"
+#include "profiling.h"
+
+namespace common {
+  // A `when` condition compiled for local evaluation over columns of
+  // doubles. The JSON syntax is the server's:
+  //
+  //   {"$gt": [{"$abs": ["@acc_x"]}, 10]}       operator with an operand list
+  //   {"@acc_z": {"$lt": -5, "$gt": -20}}       column with operator object
+  //   {"$and": [...]}, {"$or": [...]}, {"$not": [...]}
+  //   $eq $ne $gt $gte $lt $lte $in $nin, $abs $add $sub $mult $div
+  //
+  // "@name" refers to a column. Keys of one object are ANDed. Query
+  // directives ($each_n, $each_t, $limit) select records, not rows, so they
+  // are skipped and listed in ignored(). Comparisons with NaN are false,
+  // except $ne.
+  //
+  // compile() turns the tree into a flat register program, folding
+  // constants on the way. evaluate() runs it block by block: each
+  // instruction is a tight loop over a block of rows, specialised on
+  // whether its operands are arrays or constants, so the compiler
+  // vectorizes it and a block's registers stay in L1.
+  class Predicate {
+  public:
+    static constexpr size_t kBlock = 1024;
+
+    static std::optional<Predicate> compile(std::string_view when,
+                                            std::vector<std::string> columns,
+                                            std::string *error = nullptr) {
+      Predicate p;
+      p.columns_ = std::move(columns);
+      auto fail = [&](std::string message) -> std::optional<Predicate> {
+        if (error) *error = std::move(message);
+        return std::nullopt;
+      };
+      auto json = nlohmann::json::parse(when, nullptr, false);
+      if (json.is_discarded()) return fail("invalid JSON");
+      if (!json.is_object()) return fail("condition must be an object");
+      Compiler c{p, {}};
+      auto result = c.object(json);
+      if (!c.error.empty()) return fail(std::move(c.error));
+      p.result_ = c.to_mask(result);
+      if (!c.error.empty()) return fail(std::move(c.error));
+      return p;
+    }
+
+    const std::vector<std::string> &columns() const { return columns_; }
+    const std::vector<std::string> &ignored() const { return ignored_; }
+    size_t size() const { return program_.size(); }
+
+    // mask[i] = condition on row i, for `n` rows of the compiled columns.
+    void evaluate(std::span<const double *const> columns, size_t n, uint8_t *mask) const {
+      Scratch scratch(*this);
+      for (size_t base = 0; base < n; base += kBlock) {
+        const size_t len = std::min(kBlock, n - base);
+        run(columns, base, len, scratch);
+        if (result_.kind == Node::kBool) {
+          std::fill_n(mask + base, len, uint8_t(result_.value_bool() != 0));
+        } else {
+          std::copy_n(scratch.mask(result_.index), len, mask + base);
+        }
+      }
+    }
+
+    // Number of rows that match.
+    size_t count(std::span<const double *const> columns, size_t n) const {
+      Scratch scratch(*this);
+      size_t matched = 0;
+      for (size_t base = 0; base < n; base += kBlock) {
+        const size_t len = std::min(kBlock, n - base);
+        if (result_.kind == Node::kBool) {
+          matched += result_.value_bool() != 0 ? len : 0;
+          continue;
+        }
+        run(columns, base, len, scratch);
+        const uint8_t *m = scratch.mask(result_.index);
+        size_t k = 0;
+        for (size_t i = 0; i < len; ++i) k += m[i];
+        matched += k;
+      }
+      return matched;
+    }
+
+  private:
+    enum class Op : uint8_t {
+      kAbs, kAdd, kSub, kMul, kDiv,        // value registers
+      kEq, kNe, kGt, kGe, kLt, kLe,        // value x value -> mask
+      kAnd, kOr, kNot,                     // mask registers
+    };
+
+    struct Operand {
+      enum Kind : uint8_t { kColumn, kConst, kReg };
+      Kind kind;
+      uint32_t index = 0;
+      double value = 0;
+    };
+
+    struct Instr {
+      Op op;
+      uint32_t dst;
+      Operand a;
+      Operand b;
+    };
+
+    // A compiled subexpression: a value operand, a mask register or a
+    // boolean known at compile time.
+    struct Node {
+      enum Kind : uint8_t { kValue, kMask, kBool, kError };
+      Kind kind = kError;
+      Operand value{};
+      uint32_t index = 0;
+      double value_bool() const { return value.value; }
+    };
+
+    class Scratch {
+    public:
+      explicit Scratch(const Predicate &p)
+          : values_(p.n_values_ * kBlock), masks_(p.n_masks_ * kBlock) {}
+      double *value(uint32_t r) { return values_.data() + size_t(r) * kBlock; }
+      uint8_t *mask(uint32_t r) { return masks_.data() + size_t(r) * kBlock; }
+
+    private:
+      std::vector<double> values_;
+      std::vector<uint8_t> masks_;
+    };
+
+    struct Compiler {
+      Predicate &p;
+      std::string error;
+
+      Node fail(std::string message) {
+        if (error.empty()) error = std::move(message);
+        return {};
+      }
+
+      static Node boolean(bool b) {
+        Node n;
+        n.kind = Node::kBool;
+        n.value = {Operand::kConst, 0, b ? 1.0 : 0.0};
+        return n;
+      }
+
+      static Node constant(double v) {
+        Node n;
+        n.kind = Node::kValue;
+        n.value = {Operand::kConst, 0, v};
+        return n;
+      }
+
+      Node emit_value(Op op, Operand a, Operand b = {Operand::kConst, 0, 0}) {
+        const uint32_t dst = p.n_values_++;
+        p.program_.push_back({op, dst, a, b});
+        Node n;
+        n.kind = Node::kValue;
+        n.value = {Operand::kReg, dst, 0};
+        return n;
+      }
+
+      Node emit_mask(Op op, Operand a, Operand b = {Operand::kConst, 0, 0}) {
+        const uint32_t dst = p.n_masks_++;
+        p.program_.push_back({op, dst, a, b});
+        Node n;
+        n.kind = Node::kMask;
+        n.index = dst;
+        return n;
+      }
+
+      // An object is the AND of its keys.
+      Node object(const nlohmann::json &obj) {
+        std::vector<Node> terms;
+        for (const auto &[key, arg] : obj.items()) {
+          if (key == "$each_n" || key == "$each_t" || key == "$limit") {
+            p.ignored_.push_back(key);
+          } else if (!key.empty() && key[0] == '@') {
+            terms.push_back(column_conditions(key, arg));
+          } else if (!key.empty() && key[0] == '$') {
+            terms.push_back(op(key, arg));
+          } else {
+            return fail("unknown key: " + key);
+          }
+          if (!error.empty()) return {};
+        }
+        return logic(true, terms);
+      }
+
+      // {"@col": {"$lt": 1, ...}} or {"@col": 1}.
+      Node column_conditions(const std::string &name, const nlohmann::json &arg) {
+        Node col = operand(nlohmann::json(name));
+        if (!arg.is_object()) return compare(Op::kEq, col, operand(arg));
+        std::vector<Node> terms;
+        for (const auto &[key, value] : arg.items()) {
+          if (key == "$in" || key == "$nin") {
+            terms.push_back(in(col, value, key == "$nin"));
+          } else if (auto cmp = comparison(key)) {
+            terms.push_back(compare(*cmp, col, operand(value)));
+          } else {
+            return fail("unsupported operator on " + name + ": " + key);
+          }
+        }
+        return logic(true, terms);
+      }
+
+      static std::optional<Op> comparison(std::string_view key) {
+        if (key == "$eq") return Op::kEq;
+        if (key == "$ne") return Op::kNe;
+        if (key == "$gt") return Op::kGt;
+        if (key == "$gte") return Op::kGe;
+        if (key == "$lt") return Op::kLt;
+        if (key == "$lte") return Op::kLe;
+        return std::nullopt;
+      }
+
+      // {"$op": [args...]}; a lone argument may be given without the list.
+      Node op(const std::string &key, const nlohmann::json &arg) {
+        const nlohmann::json args = arg.is_array() ? arg : nlohmann::json::array({arg});
+        if (key == "$and" || key == "$or") {
+          std::vector<Node> terms;
+          for (const auto &a : args) terms.push_back(condition(a));
+          return logic(key == "$and", terms);
+        }
+        if (key == "$not") {
+          if (args.size() != 1) return fail("$not takes one operand");
+          return negate(condition(args[0]));
+        }
+        if (auto cmp = comparison(key)) {
+          if (args.size() != 2) return fail(key + " takes two operands");
+          return compare(*cmp, operand(args[0]), operand(args[1]));
+        }
+        if (key == "$in" || key == "$nin") {
+          if (args.size() < 2) return fail(key + " takes a value and a list");
+          nlohmann::json list = nlohmann::json::array();
+          for (size_t i = 1; i < args.size(); ++i) list.push_back(args[i]);
+          return in(operand(args[0]), list, key == "$nin");
+        }
+        return arithmetic(key, args);
+      }
+
+      Node arithmetic(const std::string &key, const nlohmann::json &args) {
+        Op o;
+        if (key == "$abs") {
+          if (args.size() != 1) return fail("$abs takes one operand");
+          Node a = operand(args[0]);
+          if (a.kind != Node::kValue) return a;
+          if (a.value.kind == Operand::kConst) return constant(std::abs(a.value.value));
+          return emit_value(Op::kAbs, a.value);
+        } else if (key == "$add") {
+          o = Op::kAdd;
+        } else if (key == "$sub") {
+          o = Op::kSub;
+        } else if (key == "$mult") {
+          o = Op::kMul;
+        } else if (key == "$div") {
+          o = Op::kDiv;
+        } else {
+          return fail("unsupported operator: " + key);
+        }
+        if (args.size() < 2 || ((o == Op::kSub || o == Op::kDiv) && args.size() != 2)) {
+          return fail(key + ": wrong number of operands");
+        }
+        Node acc = operand(args[0]);
+        for (size_t i = 1; i < args.size() && acc.kind == Node::kValue; ++i) {
+          Node b = operand(args[i]);
+          if (b.kind != Node::kValue) return b.kind == Node::kError ? b : fail(key + " of a condition");
+          if (acc.value.kind == Operand::kConst && b.value.kind == Operand::kConst) {
+            acc = constant(apply(o, acc.value.value, b.value.value));
+          } else {
+            acc = emit_value(o, acc.value, b.value);
+          }
+        }
+        return acc;
+      }
+
+      Node in(Node value, const nlohmann::json &list, bool negated) {
+        if (!list.is_array()) return fail("$in takes a list");
+        std::vector<Node> terms;
+        for (const auto &v : list) terms.push_back(compare(Op::kEq, value, operand(v)));
+        Node any = logic(false, terms);
+        return negated ? negate(any) : any;
+      }
+
+      // A value operand: number, bool, "@column" or an arithmetic object.
+      Node operand(const nlohmann::json &v) {
+        if (v.is_number()) return constant(v.get<double>());
+        if (v.is_boolean()) return constant(v.get<bool>() ? 1.0 : 0.0);
+        if (v.is_string()) {
+          const auto &s = v.get_ref<const std::string &>();
+          if (s.empty() || s[0] != '@') return fail("unsupported operand: " + s);
+          const auto it = std::find(p.columns_.begin(), p.columns_.end(), s.substr(1));
+          if (it == p.columns_.end()) return fail("unknown column: " + s);
+          Node n;
+          n.kind = Node::kValue;
+          n.value = {Operand::kColumn, uint32_t(it - p.columns_.begin()), 0};
+          return n;
+        }
+        if (v.is_object() && v.size() == 1) {
+          const auto it = v.begin();
+          if (!it.key().empty() && it.key()[0] == '$') return op(it.key(), it.value());
+        }
+        return fail("unsupported operand: " + v.dump());
+      }
+
+      // Operands of $and/$or/$not: conditions, or values tested for != 0.
+      Node condition(const nlohmann::json &v) {
+        if (v.is_object()) return object(v);
+        return compare(Op::kNe, operand(v), constant(0));
+      }
+
+      Node compare(Op o, Node a, Node b) {
+        if (a.kind == Node::kError || b.kind == Node::kError) return {};
+        if (a.kind != Node::kValue || b.kind != Node::kValue) {
+          return fail("comparison of a condition");
+        }
+        if (a.value.kind == Operand::kConst && b.value.kind == Operand::kConst) {
+          return boolean(apply(o, a.value.value, b.value.value) != 0);
+        }
+        return emit_mask(o, a.value, b.value);
+      }
+
+      Node negate(Node a) {
+        a = to_mask(a);
+        if (a.kind == Node::kError) return a;
+        if (a.kind == Node::kBool) return boolean(a.value_bool() == 0);
+        return emit_mask(Op::kNot, {Operand::kReg, a.index, 0});
+      }
+
+      Node logic(bool is_and, std::vector<Node> &terms) {
+        Node acc = boolean(is_and);
+        for (auto &t : terms) {
+          if (t.kind == Node::kError) return t;
+          Node m = to_mask(t);
+          if (m.kind == Node::kBool) {
+            // true in an AND, false in an OR: no effect; otherwise decides.
+            if ((m.value_bool() != 0) != is_and) return m;
+            continue;
+          }
+          if (acc.kind == Node::kBool) {
+            acc = m;
+          } else {
+            acc = emit_mask(is_and ? Op::kAnd : Op::kOr, {Operand::kReg, acc.index, 0},
+                            {Operand::kReg, m.index, 0});
+          }
+        }
+        return acc;
+      }
+
+      // Masks and booleans pass through; a value is tested for != 0.
+      Node to_mask(Node n) {
+        if (n.kind == Node::kValue) return compare(Op::kNe, n, constant(0));
+        if (n.kind == Node::kError && error.empty()) return fail("empty condition");
+        return n;
+      }
+    };
+
+    static double apply(Op o, double a, double b) {
+      switch (o) {
+      case Op::kAbs: return std::abs(a);
+      case Op::kAdd: return a + b;
+      case Op::kSub: return a - b;
+      case Op::kMul: return a * b;
+      case Op::kDiv: return a / b;
+      case Op::kEq: return a == b;
+      case Op::kNe: return a != b;
+      case Op::kGt: return a > b;
+      case Op::kGe: return a >= b;
+      case Op::kLt: return a < b;
+      case Op::kLe: return a <= b;
+      default: return 0;
+      }
+    }
+
+    // out[i] = f(a[i], b[i]) with either side possibly a broadcast constant.
+    template <typename T, typename F>
+    static void binary(const double *a, double ca, const double *b, double cb, size_t n,
+                       T *out, F f) {
+      if (a && b) {
+        for (size_t i = 0; i < n; ++i) out[i] = T(f(a[i], b[i]));
+      } else if (a) {
+        for (size_t i = 0; i < n; ++i) out[i] = T(f(a[i], cb));
+      } else if (b) {
+        for (size_t i = 0; i < n; ++i) out[i] = T(f(ca, b[i]));
+      } else {
+        std::fill_n(out, n, T(f(ca, cb)));
+      }
+    }
+
+    template <typename T>
+    static void dispatch(Op o, const double *a, double ca, const double *b, double cb,
+                         size_t n, T *out) {
+      switch (o) {
+      case Op::kAdd: return binary(a, ca, b, cb, n, out, [](double x, double y) { return x + y; });
+      case Op::kSub: return binary(a, ca, b, cb, n, out, [](double x, double y) { return x - y; });
+      case Op::kMul: return binary(a, ca, b, cb, n, out, [](double x, double y) { return x * y; });
+      case Op::kDiv: return binary(a, ca, b, cb, n, out, [](double x, double y) { return x / y; });
+      case Op::kEq: return binary(a, ca, b, cb, n, out, [](double x, double y) { return x == y; });
+      case Op::kNe: return binary(a, ca, b, cb, n, out, [](double x, double y) { return x != y; });
+      case Op::kGt: return binary(a, ca, b, cb, n, out, [](double x, double y) { return x > y; });
+      case Op::kGe: return binary(a, ca, b, cb, n, out, [](double x, double y) { return x >= y; });
+      case Op::kLt: return binary(a, ca, b, cb, n, out, [](double x, double y) { return x < y; });
+      case Op::kLe: return binary(a, ca, b, cb, n, out, [](double x, double y) { return x <= y; });
+      default: return;
+      }
+    }
+
+    void run(std::span<const double *const> columns, size_t base, size_t n,
+             Scratch &scratch) const {
+      auto array = [&](const Operand &o) -> const double * {
+        switch (o.kind) {
+        case Operand::kColumn: return columns[o.index] + base;
+        case Operand::kReg: return scratch.value(o.index);
+        case Operand::kConst: return nullptr;
+        }
+        return nullptr;
+      };
+      for (const auto &in : program_) {
+        switch (in.op) {
+        case Op::kAbs: {
+          const double *a = array(in.a);
+          double *out = scratch.value(in.dst);
+          for (size_t i = 0; i < n; ++i) out[i] = std::abs(a[i]);
+          break;
+        }
+        case Op::kAdd:
+        case Op::kSub:
+        case Op::kMul:
+        case Op::kDiv:
+          dispatch(in.op, array(in.a), in.a.value, array(in.b), in.b.value, n,
+                   scratch.value(in.dst));
+          break;
+        case Op::kAnd: {
+          const uint8_t *a = scratch.mask(in.a.index), *b = scratch.mask(in.b.index);
+          uint8_t *out = scratch.mask(in.dst);
+          for (size_t i = 0; i < n; ++i) out[i] = a[i] & b[i];
+          break;
+        }
+        case Op::kOr: {
+          const uint8_t *a = scratch.mask(in.a.index), *b = scratch.mask(in.b.index);
+          uint8_t *out = scratch.mask(in.dst);
+          for (size_t i = 0; i < n; ++i) out[i] = a[i] | b[i];
+          break;
+        }
+        case Op::kNot: {
+          const uint8_t *a = scratch.mask(in.a.index);
+          uint8_t *out = scratch.mask(in.dst);
+          for (size_t i = 0; i < n; ++i) out[i] = a[i] ^ 1;
+          break;
+        }
+        default:
+          dispatch(in.op, array(in.a), in.a.value, array(in.b), in.b.value, n,
+                   scratch.mask(in.dst));
+          break;
+        }
+      }
+    }
+
+    std::vector<std::string> columns_;
+    std::vector<std::string> ignored_;
+    std::vector<Instr> program_;
+    uint32_t n_values_ = 0;
+    uint32_t n_masks_ = 0;
+    Node result_;
+  };
+
+  // The IMU columns as a `when` condition names them.
+  inline std::vector<std::string> imu_predicate_columns() { return {"acc_x", "acc_y", "acc_z"}; }
+
+  // Rows of the frame matching `pred`, compiled over imu_predicate_columns().
+  inline size_t count_matching(const AccelerationFrame &frame, const Predicate &pred) {
+    profile::Scope scope("predicate");
+    scope.rows(frame.size());
+    const double *columns[] = {frame.acc_x().data(), frame.acc_y().data(),
+                               frame.acc_z().data()};
+    return pred.count(columns, frame.size());
+  }
+}
@@ -0,0 +1,294 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+// Lightweight per-stage instrumentation. Stages are created by name on first
+// use and live for the whole process; a Scope records one call's wall time,
+// the allocations made on the calling thread meanwhile and any bytes/rows it
+// is told about. Everything is a no-op branch until profile::init() sees
+// --profile, so the hooks stay in release builds.
+//
+// Allocations are only counted in programs linked with alloc_counter.cc,
+// which replaces the global operator new (the bench always is, the tools
+// with -DREDUCT_COUNT_ALLOCS=ON); elsewhere the allocs columns are empty.
+namespace common::profile {
+  inline std::atomic<bool> g_enabled{false};
+  inline std::atomic<uint64_t> g_allocations{0};
+  inline thread_local uint64_t t_allocations = 0;
+  // Set by alloc_counter.cc before main() when it is linked in.
+  inline bool g_counting_allocations = false;
+
+  inline bool enabled() { return g_enabled.load(std::memory_order_relaxed); }
+  inline bool counting_allocations() { return g_counting_allocations; }
+
+  // Allocations made by the whole process, or by the calling thread; zero
+  // unless counting_allocations().
+  inline uint64_t allocations() { return g_allocations.load(std::memory_order_relaxed); }
+  inline uint64_t thread_allocations() { return t_allocations; }
+
+  // Latency histogram with power-of-two nanosecond buckets: bucket i holds
+  // samples in [2^(i-1), 2^i), bucket 0 holds zero.
+  class Histogram {
+  public:
+    static constexpr size_t kBuckets = 64;
+
+    void add(uint64_t ns) {
+      buckets_[size_t(std::bit_width(ns))].fetch_add(1, std::memory_order_relaxed);
+      uint64_t prev = max_.load(std::memory_order_relaxed);
+      while (ns > prev &&
+             !max_.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {
+      }
+    }
+
+    uint64_t count(size_t bucket) const {
+      return buckets_[bucket].load(std::memory_order_relaxed);
+    }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+    static uint64_t upper_bound(size_t bucket) {
+      return bucket == 0 ? 0 : bucket >= 64 ? UINT64_MAX : (uint64_t{1} << bucket) - 1;
+    }
+
+    // Estimate of the q-quantile, interpolated inside the bucket.
+    double quantile(double q) const {
+      uint64_t total = 0;
+      for (size_t i = 0; i <= kBuckets; ++i) total += count(i);
+      if (total == 0) return 0.0;
+      const double rank = q * double(total);
+      double seen = 0;
+      for (size_t i = 0; i <= kBuckets; ++i) {
+        const double c = double(count(i));
+        if (c > 0 && seen + c >= rank) {
+          const double lo = i == 0 ? 0.0 : double(uint64_t{1} << (i - 1));
+          const double hi = std::min(double(upper_bound(i)), double(max()));
+          return lo + (hi - lo) * std::clamp((rank - seen) / c, 0.0, 1.0);
+        }
+        seen += c;
+      }
+      return double(max());
+    }
+
+  private:
+    std::array<std::atomic<uint64_t>, kBuckets + 1> buckets_{};
+    std::atomic<uint64_t> max_{0};
+  };
+
+  struct Stage {
+    std::string name;
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> rows_out{0};
+    std::atomic<uint64_t> allocs{0};
+    Histogram latency;
+
+    void add_bytes(uint64_t n) { bytes_in.fetch_add(n, std::memory_order_relaxed); }
+    void add_rows(uint64_t n) { rows_out.fetch_add(n, std::memory_order_relaxed); }
+  };
+
+  class Registry {
+  public:
+    static Registry &instance() {
+      static Registry registry;
+      return registry;
+    }
+
+    // Stage addresses are stable, so hot paths look a stage up once:
+    //   static auto &stage = profile::stage("decode");
+    Stage &stage(std::string_view name) {
+      std::lock_guard lock(mutex_);
+      auto it = stages_.find(name);
+      if (it == stages_.end()) {
+        auto s = std::make_unique<Stage>();
+        s->name = std::string(name);
+        order_.push_back(s.get());
+        it = stages_.emplace(s->name, std::move(s)).first;
+      }
+      return *it->second;
+    }
+
+    std::vector<const Stage *> stages() const {
+      std::lock_guard lock(mutex_);
+      return {order_.begin(), order_.end()};
+    }
+
+    std::chrono::steady_clock::time_point start_time() const { return start_; }
+
+  private:
+    Registry() : start_(std::chrono::steady_clock::now()) {}
+
+    mutable std::mutex mutex_;
+    std::map<std::string, std::unique_ptr<Stage>, std::less<>> stages_;
+    std::vector<Stage *> order_;  // in order of first use
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  inline Stage &stage(std::string_view name) {
+    return Registry::instance().stage(name);
+  }
+
+  // Times one call of a stage from construction to destruction.
+  class Scope {
+  public:
+    explicit Scope(Stage &stage) : stage_(enabled() ? &stage : nullptr) {
+      if (stage_) {
+        if (counting_allocations()) allocs_ = t_allocations;
+        t0_ = std::chrono::steady_clock::now();
+      }
+    }
+    explicit Scope(std::string_view name)
+        : Scope(enabled() ? profile::stage(name) : dummy()) {}
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+    ~Scope() {
+      if (!stage_) return;
+      const auto ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now() - t0_)
+                                   .count());
+      stage_->calls.fetch_add(1, std::memory_order_relaxed);
+      stage_->total_ns.fetch_add(ns, std::memory_order_relaxed);
+      if (counting_allocations()) {
+        stage_->allocs.fetch_add(t_allocations - allocs_, std::memory_order_relaxed);
+      }
+      stage_->latency.add(ns);
+    }
+
+    void bytes(uint64_t n) {
+      if (stage_) stage_->add_bytes(n);
+    }
+    void rows(uint64_t n) {
+      if (stage_) stage_->add_rows(n);
+    }
+
+  private:
+    static Stage &dummy() {
+      static Stage stage;
+      return stage;
+    }
+
+    Stage *stage_;
+    uint64_t allocs_ = 0;
+    std::chrono::steady_clock::time_point t0_{};
+  };
+
+  inline void print_report(std::ostream &os = std::cout) {
+    const auto stages = Registry::instance().stages();
+    os << "\n=== Profile ===\n";
+    os << std::left << std::setw(20) << "stage" << std::right << std::setw(10)
+       << "calls" << std::setw(12) << "total ms" << std::setw(11) << "mean us"
+       << std::setw(11) << "p50 us" << std::setw(11) << "p99 us" << std::setw(11)
+       << "max us" << std::setw(12) << "MB in" << std::setw(12) << "rows out"
+       << std::setw(11) << "allocs" << "\n";
+    os << std::string(121, '-') << "\n";
+    for (const auto *s : stages) {
+      const uint64_t calls = s->calls.load();
+      const double total_ms = double(s->total_ns.load()) / 1e6;
+      os << std::left << std::setw(20) << s->name << std::right << std::setw(10)
+         << calls << std::fixed << std::setprecision(2) << std::setw(12)
+         << total_ms << std::setw(11) << (calls ? total_ms * 1e3 / double(calls) : 0.0)
+         << std::setw(11) << s->latency.quantile(0.5) / 1e3 << std::setw(11)
+         << s->latency.quantile(0.99) / 1e3 << std::setw(11)
+         << double(s->latency.max()) / 1e3 << std::setw(12)
+         << double(s->bytes_in.load()) / 1e6 << std::setw(12) << s->rows_out.load()
+         << std::setw(11);
+      if (counting_allocations()) {
+        os << s->allocs.load() << "\n";
+      } else {
+        os << "-" << "\n";
+      }
+    }
+    const double wall_ms = std::chrono::duration<double, std::milli>(
+                               std::chrono::steady_clock::now() -
+                               Registry::instance().start_time())
+                               .count();
+    os << "wall " << std::fixed << std::setprecision(2) << wall_ms << " ms";
+    if (counting_allocations()) os << ", allocations " << allocations();
+    os << "\n";
+  }
+
+  inline bool write_json(const std::string &path) {
+    auto stages = nlohmann::json::array();
+    for (const auto *s : Registry::instance().stages()) {
+      auto histogram = nlohmann::json::array();
+      for (size_t i = 0; i <= Histogram::kBuckets; ++i) {
+        if (uint64_t c = s->latency.count(i)) {
+          histogram.push_back({{"le_ns", Histogram::upper_bound(i)}, {"count", c}});
+        }
+      }
+      stages.push_back({{"name", s->name},
+                        {"calls", s->calls.load()},
+                        {"total_ns", s->total_ns.load()},
+                        {"p50_ns", s->latency.quantile(0.5)},
+                        {"p90_ns", s->latency.quantile(0.9)},
+                        {"p99_ns", s->latency.quantile(0.99)},
+                        {"max_ns", s->latency.max()},
+                        {"bytes_in", s->bytes_in.load()},
+                        {"rows_out", s->rows_out.load()},
+                        {"allocs", counting_allocations() ? nlohmann::json(s->allocs.load())
+                                                          : nlohmann::json(nullptr)},
+                        {"latency_histogram", histogram}});
+    }
+    const double wall_ns = std::chrono::duration<double, std::nano>(
+                               std::chrono::steady_clock::now() -
+                               Registry::instance().start_time())
+                               .count();
+    nlohmann::json report = {{"wall_ns", wall_ns},
+                             {"allocations", counting_allocations()
+                                                 ? nlohmann::json(allocations())
+                                                 : nlohmann::json(nullptr)},
+                             {"stages", stages}};
+    std::ofstream out(path);
+    out << report.dump(2) << "\n";
+    return bool(out);
+  }
+
+  inline std::string g_report_path;
+
+  // Enables profiling if argv has --profile or --profile=<report.json>. The
+  // report defaults to <program>.profile.json in the working directory.
+  inline void init(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+      std::string_view arg = argv[i];
+      if (arg == "--profile" || arg.starts_with("--profile=")) {
+        g_enabled = true;
+        Registry::instance();  // wall time counts from here
+        if (arg.size() > 10) {
+          g_report_path = std::string(arg.substr(10));
+        } else {
+          std::string_view prog = argc > 0 ? argv[0] : "profile";
+          prog = prog.substr(prog.find_last_of('/') + 1);
+          g_report_path = std::string(prog) + ".profile.json";
+        }
+      }
+    }
+  }
+
+  // Prints the table and writes the JSON report when profiling is on.
+  inline void report() {
+    if (!enabled()) return;
+    print_report();
+    if (write_json(g_report_path)) {
+      std::cout << "Profile written to " << g_report_path << "\n";
+    } else {
+      std::cerr << "Failed to write " << g_report_path << "\n";
+    }
+  }
+}
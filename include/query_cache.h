@@ -0,0 +1,503 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include <reduct/client.h>
+#include "mapped_file.h"
+#include "parallel_query.h"
+#include "record_source.h"
+
+namespace common {
+  // Segment file: "RSEG" + u32 version, then records in timestamp order:
+  //   i64 ts_us | u32 n_labels | (u32 len, key, u32 len, value)... |
+  //   u32 len, content_type | u64 len, blob
+  // Integers are stored in host byte order; the cache is local to one box.
+  namespace segment {
+    constexpr char kMagic[4] = {'R', 'S', 'E', 'G'};
+    constexpr uint32_t kVersion = 1;
+
+    // Encodes everything of a record but the blob bytes, ending with the
+    // blob length.
+    inline void encode_header(std::string &out, int64_t ts_us,
+                              const reduct::IBucket::LabelMap &labels,
+                              std::string_view content_type, uint64_t blob_len) {
+      auto put = [&](auto v) {
+        out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+      };
+      auto put_str = [&](std::string_view str) {
+        put(uint32_t(str.size()));
+        out.append(str);
+      };
+      put(ts_us);
+      put(uint32_t(labels.size()));
+      for (const auto &[k, v] : labels) {
+        put_str(k);
+        put_str(v);
+      }
+      put_str(content_type);
+      put(blob_len);
+    }
+
+    struct RecordView {
+      int64_t ts_us;
+      std::string_view labels;  // still encoded, decoded on demand
+      uint32_t n_labels;
+      std::string_view content_type;
+      std::string_view blob;
+    };
+
+    class Writer {
+    public:
+      explicit Writer(const std::filesystem::path &path)
+          : out_(path, std::ios::binary | std::ios::trunc) {
+        out_.write(kMagic, 4);
+        put(kVersion);
+      }
+
+      bool ok() const { return bool(out_); }
+
+      void write(int64_t ts_us, const reduct::IBucket::LabelMap &labels,
+                 std::string_view content_type, std::string_view blob) {
+        header_.clear();
+        encode_header(header_, ts_us, labels, content_type, blob.size());
+        out_.write(header_.data(), std::streamsize(header_.size()));
+        out_.write(blob.data(), std::streamsize(blob.size()));
+      }
+
+      // Streaming form of write(): the blob arrives through append() and its
+      // length is patched in by end_record().
+      void begin_record(int64_t ts_us, const reduct::IBucket::LabelMap &labels,
+                        std::string_view content_type) {
+        write(ts_us, labels, content_type, {});
+        blob_len_pos_ = out_.tellp() - std::streamoff(sizeof(uint64_t));
+        blob_len_ = 0;
+      }
+
+      void append(std::string_view chunk) {
+        out_.write(chunk.data(), std::streamsize(chunk.size()));
+        blob_len_ += chunk.size();
+      }
+
+      void end_record() {
+        auto end = out_.tellp();
+        out_.seekp(blob_len_pos_);
+        put(blob_len_);
+        out_.seekp(end);
+      }
+
+      bool close() {
+        out_.close();
+        return !out_.fail();
+      }
+
+    private:
+      template <typename T> void put(T v) {
+        out_.write(reinterpret_cast<const char *>(&v), sizeof(T));
+      }
+
+      std::ofstream out_;
+      std::string header_;
+      std::streampos blob_len_pos_{};
+      uint64_t blob_len_ = 0;
+    };
+
+    class Reader {
+    public:
+      explicit Reader(std::string_view data) : data_(data), pos_(8) {
+        valid_ = data.size() >= 8 && std::memcmp(data.data(), kMagic, 4) == 0;
+        uint32_t version = 0;
+        if (valid_) std::memcpy(&version, data.data() + 4, 4);
+        valid_ = valid_ && version == kVersion;
+      }
+
+      // Reader over bare records starting at `pos`, without the file header.
+      static Reader at(std::string_view data, size_t pos) {
+        return Reader(data, pos);
+      }
+
+      bool valid() const { return valid_; }
+      size_t position() const { return pos_; }
+
+      // Returns false at the end of the segment or on a truncated record.
+      bool next(RecordView &rec) {
+        if (!valid_ || pos_ >= data_.size()) return false;
+        if (!get(rec.ts_us) || !get(rec.n_labels)) return fail();
+        size_t labels_begin = pos_;
+        for (uint32_t i = 0; i < 2 * rec.n_labels; ++i) {
+          std::string_view s;
+          if (!get_str<uint32_t>(s)) return fail();
+        }
+        rec.labels = data_.substr(labels_begin, pos_ - labels_begin);
+        if (!get_str<uint32_t>(rec.content_type)) return fail();
+        if (!get_str<uint64_t>(rec.blob)) return fail();
+        return true;
+      }
+
+      static reduct::IBucket::LabelMap decode_labels(std::string_view data,
+                                                     uint32_t n) {
+        reduct::IBucket::LabelMap labels;
+        Reader r(data, 0);
+        for (uint32_t i = 0; i < n; ++i) {
+          std::string_view k, v;
+          r.get_str<uint32_t>(k);
+          r.get_str<uint32_t>(v);
+          labels.emplace(k, v);
+        }
+        return labels;
+      }
+
+    private:
+      Reader(std::string_view data, size_t pos)
+          : data_(data), pos_(pos), valid_(true) {}
+
+      bool fail() {
+        valid_ = false;
+        return false;
+      }
+
+      template <typename T> bool get(T &v) {
+        if (data_.size() - pos_ < sizeof(T)) return false;
+        std::memcpy(&v, data_.data() + pos_, sizeof(T));
+        pos_ += sizeof(T);
+        return true;
+      }
+
+      template <typename L> bool get_str(std::string_view &s) {
+        L len;
+        if (!get(len) || data_.size() - pos_ < len) return false;
+        s = data_.substr(pos_, size_t(len));
+        pos_ += size_t(len);
+        return true;
+      }
+
+      std::string_view data_;
+      size_t pos_;
+      bool valid_ = false;
+    };
+  }
+
+  inline uint64_t fnv1a(std::string_view s, uint64_t h = 1469598103934665603ULL) {
+    for (unsigned char c : s) {
+      h ^= c;
+      h *= 1099511628211ULL;
+    }
+    return h;
+  }
+
+  // Canonical form of a JSON option so that formatting doesn't change the
+  // cache key; falls back to the raw text if it doesn't parse.
+  inline std::string canonical_json(const std::optional<std::string> &s) {
+    if (!s) return {};
+    auto parsed = nlohmann::json::parse(*s, nullptr, false);
+    return parsed.is_discarded() ? *s : parsed.dump();
+  }
+
+  // Identifies the query options that change which records or bytes come
+  // back, independent of JSON formatting.
+  inline std::string options_key(const reduct::IBucket::QueryOptions &options) {
+    uint64_t h = fnv1a(canonical_json(options.ext));
+    h = fnv1a("\n", h);
+    h = fnv1a(canonical_json(options.when), h);
+    h = fnv1a(options.strict.value_or(false) ? "s" : "", h);
+
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(h));
+    return hex;
+  }
+
+  // $REDUCT_CACHE_DIR, or ".reduct_cache" next to the working directory.
+  inline std::filesystem::path cache_root() {
+    const char *dir = std::getenv("REDUCT_CACHE_DIR");
+    return dir ? dir : ".reduct_cache";
+  }
+
+  // <root>/<entry>/<options key>: where everything derived from one query
+  // of an entry is kept.
+  inline std::filesystem::path
+  cache_entry_dir(const std::filesystem::path &root, std::string_view entry,
+                  const reduct::IBucket::QueryOptions &options) {
+    std::string name(entry);
+    for (char &c : name) {
+      if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_' &&
+          c != '.') {
+        c = '_';
+      }
+    }
+    return root / name / options_key(options);
+  }
+
+  // Transparent on-disk cache in front of a bucket. Each (entry, ext/when)
+  // pair gets a directory of segment files named by the [start, stop) range
+  // they cover. A query is served from mapped segments where they cover the
+  // range and only the gaps are fetched from the server, each gap becoming
+  // a new segment once it has been read completely.
+  //
+  // Stored ranges are assumed immutable: a gap reaching past the entry's
+  // latest record is served but not stored. Queries with $limit/$each_n/
+  // $each_t select records relative to the whole range and are only served
+  // from an exact match; continuous queries and open ranges bypass the cache.
+  class QueryCache : public RecordSource {
+  public:
+    QueryCache(std::unique_ptr<RecordSource> upstream,
+               std::filesystem::path root)
+        : upstream_(std::move(upstream)), root_(std::move(root)) {}
+
+    reduct::Result<std::vector<reduct::IBucket::EntryInfo>>
+    GetEntryList() const noexcept override {
+      return upstream_->GetEntryList();
+    }
+
+    reduct::Error Query(std::string_view entry, std::optional<Time> start,
+                        std::optional<Time> stop,
+                        reduct::IBucket::QueryOptions options,
+                        reduct::IBucket::ReadRecordCallback callback) const override {
+      if (root_.empty() || !start || !stop || options.continuous ||
+          options.head_only) {
+        return upstream_->Query(entry, start, stop, std::move(options),
+                                std::move(callback));
+      }
+
+      const auto dir = entry_dir(entry, options);
+      std::error_code ec;
+      std::filesystem::create_directories(dir, ec);
+
+      if (!splittable(options)) {
+        const auto path = dir / segment_name(*start, *stop);
+        if (std::filesystem::exists(path)) {
+          bool stopped = false;
+          return serve(path, *start, *stop, callback, stopped);
+        }
+        bool stopped = false;
+        return fetch(dir, entry, *start, *stop, options, callback, stopped);
+      }
+
+      auto segments = list_segments(dir);
+      Time cursor = *start;
+      while (cursor < *stop) {
+        // The covering segment reaching furthest, or the next one to start.
+        const Segment *cover = nullptr;
+        Time next_start = *stop;
+        for (const auto &seg : segments) {
+          if (seg.start <= cursor && cursor < seg.stop) {
+            if (!cover || seg.stop > cover->stop) cover = &seg;
+          } else if (seg.start > cursor) {
+            next_start = std::min(next_start, seg.start);
+          }
+        }
+
+        bool stopped = false;
+        reduct::Error err;
+        Time until;
+        if (cover) {
+          until = std::min(cover->stop, *stop);
+          err = serve(cover->path, cursor, until, callback, stopped);
+        } else {
+          until = next_start;
+          err = fetch(dir, entry, cursor, until, options, callback, stopped);
+        }
+        if (err != reduct::Error::kOk || stopped) return err;
+        cursor = until;
+      }
+      return reduct::Error::kOk;
+    }
+
+  private:
+    struct Segment {
+      Time start;
+      Time stop;
+      std::filesystem::path path;
+    };
+
+    // $limit, $each_n and $each_t count across the whole query, so its result
+    // is not the union of the results over sub-ranges. Operators are matched
+    // as keys anywhere in the condition, not inside string values; a condition
+    // that doesn't parse is treated as unsplittable.
+    static bool splittable(const reduct::IBucket::QueryOptions &options) {
+      for (const auto *opt : {&options.when, &options.ext}) {
+        if (!*opt) continue;
+        auto json = nlohmann::json::parse(**opt, nullptr, false);
+        if (json.is_discarded() || has_stateful_operator(json)) return false;
+      }
+      return true;
+    }
+
+    static bool has_stateful_operator(const nlohmann::json &json) {
+      if (json.is_object()) {
+        for (const auto &[key, value] : json.items()) {
+          if (key == "$limit" || key == "$each_n" || key == "$each_t") return true;
+          if (has_stateful_operator(value)) return true;
+        }
+      } else if (json.is_array()) {
+        for (const auto &value : json) {
+          if (has_stateful_operator(value)) return true;
+        }
+      }
+      return false;
+    }
+
+    static std::string segment_name(Time start, Time stop) {
+      return std::to_string(start.time_since_epoch().count()) + "-" +
+             std::to_string(stop.time_since_epoch().count()) + ".seg";
+    }
+
+    std::filesystem::path
+    entry_dir(std::string_view entry,
+              const reduct::IBucket::QueryOptions &options) const {
+      return cache_entry_dir(root_, entry, options);
+    }
+
+    static std::vector<Segment> list_segments(const std::filesystem::path &dir) {
+      std::vector<Segment> out;
+      std::error_code ec;
+      for (const auto &file : std::filesystem::directory_iterator(dir, ec)) {
+        if (file.path().extension() != ".seg") continue;
+        const std::string stem = file.path().stem().string();
+        auto dash = stem.find('-', 1);
+        if (dash == std::string::npos) continue;
+        char *end = nullptr;
+        long long a = std::strtoll(stem.c_str(), &end, 10);
+        long long b = std::strtoll(stem.c_str() + dash + 1, &end, 10);
+        out.push_back({Time(std::chrono::microseconds(a)),
+                       Time(std::chrono::microseconds(b)), file.path()});
+      }
+      return out;
+    }
+
+    static reduct::IBucket::ReadableRecord
+    make_record(Time ts, reduct::IBucket::LabelMap labels,
+                std::string content_type, std::string_view blob) {
+      reduct::IBucket::ReadableRecord rec;
+      rec.timestamp = ts;
+      rec.size = blob.size();
+      rec.last = false;
+      rec.labels = std::move(labels);
+      rec.content_type = std::move(content_type);
+      rec.Read = [blob](reduct::IBucket::ReadCallback cb) {
+        cb(blob);
+        return reduct::Error::kOk;
+      };
+      return rec;
+    }
+
+    static reduct::Error serve(const std::filesystem::path &path, Time lo,
+                               Time hi,
+                               const reduct::IBucket::ReadRecordCallback &callback,
+                               bool &stopped) {
+      auto file = MappedFile::open(path);
+      if (!file) {
+        return {.code = -1, .message = "Failed to map " + path.string()};
+      }
+      segment::Reader reader(file->view());
+      segment::RecordView rv;
+      while (reader.next(rv)) {
+        Time ts{std::chrono::microseconds(rv.ts_us)};
+        if (ts < lo) continue;
+        if (ts >= hi) break;
+        auto rec = make_record(
+            ts, segment::Reader::decode_labels(rv.labels, rv.n_labels),
+            std::string(rv.content_type), rv.blob);
+        if (!callback(rec)) {
+          stopped = true;
+          break;
+        }
+      }
+      if (!reader.valid()) {
+        return {.code = -1, .message = "Corrupted cache segment " + path.string()};
+      }
+      return reduct::Error::kOk;
+    }
+
+    reduct::Error fetch(const std::filesystem::path &dir, std::string_view entry,
+                        Time lo, Time hi,
+                        const reduct::IBucket::QueryOptions &options,
+                        const reduct::IBucket::ReadRecordCallback &callback,
+                        bool &stopped) const {
+      const auto final_path = dir / segment_name(lo, hi);
+      auto tmp_path = final_path;
+      tmp_path += ".tmp" + std::to_string(::getpid()) + "_" +
+                  std::to_string(reinterpret_cast<uintptr_t>(this));
+      segment::Writer writer(tmp_path);
+
+      reduct::Error read_err = reduct::Error::kOk;
+      bool partial = false;
+      auto err = upstream_->Query(
+          entry, lo, hi, options,
+          [&](const reduct::IBucket::ReadableRecord &rec) {
+            // The caller reads through the upstream record and every chunk
+            // is teed into the segment, so streaming readers stay streaming.
+            writer.begin_record(rec.timestamp.time_since_epoch().count(),
+                                rec.labels, rec.content_type);
+            bool consumed = false;
+            auto tee = [&](reduct::IBucket::ReadCallback cb) {
+              consumed = true;
+              auto r_err = rec.Read([&](std::string_view chunk) {
+                writer.append(chunk);
+                if (cb(chunk)) return true;
+                partial = true;  // the rest of the blob is never read
+                return false;
+              });
+              if (r_err != reduct::Error::kOk) read_err = r_err;
+              return r_err;
+            };
+
+            reduct::IBucket::ReadableRecord local;
+            local.timestamp = rec.timestamp;
+            local.size = rec.size;
+            local.last = rec.last;
+            local.labels = rec.labels;
+            local.content_type = rec.content_type;
+            local.Read = tee;
+            bool keep_going = callback(local);
+            if (!consumed) tee([](std::string_view) { return true; });
+            writer.end_record();
+
+            if (!keep_going) stopped = true;
+            return keep_going && read_err == reduct::Error::kOk;
+          });
+      if (err == reduct::Error::kOk) err = read_err;
+
+      bool complete = false;
+      if (err == reduct::Error::kOk && !stopped && !partial) {
+        auto info = find_entry(*upstream_, std::string(entry));
+        complete = info && info->latest_record >= hi;
+      }
+
+      std::error_code ec;
+      if (writer.close() && complete) {
+        std::filesystem::rename(tmp_path, final_path, ec);
+      } else {
+        std::filesystem::remove(tmp_path, ec);
+      }
+      return err;
+    }
+
+    std::unique_ptr<RecordSource> upstream_;
+    std::filesystem::path root_;
+  };
+
+  // Caches under cache_root(). REDUCT_CACHE=0 turns the cache into a
+  // pass-through.
+  inline std::unique_ptr<QueryCache> connect_cached_bucket() {
+    auto bucket = connect_bucket();
+    if (!bucket) return nullptr;
+
+    std::filesystem::path root = cache_root();
+    const char *enabled = std::getenv("REDUCT_CACHE");
+    if (enabled && std::string_view(enabled) == "0") root.clear();
+    return std::make_unique<QueryCache>(
+        std::make_unique<BucketSource>(std::move(bucket)), std::move(root));
+  }
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <reduct/client.h>
+
+namespace common {
+  // The part of IBucket the extractors use. The live bucket, the query cache
+  // and the capture recorder/player all implement it, so they stack on top of
+  // each other and the extractors don't care which one they talk to.
+  class RecordSource {
+  public:
+    using Time = reduct::IBucket::Time;
+
+    virtual ~RecordSource() = default;
+
+    virtual reduct::Result<std::vector<reduct::IBucket::EntryInfo>>
+    GetEntryList() const noexcept = 0;
+
+    virtual reduct::Error Query(std::string_view entry, std::optional<Time> start,
+                                std::optional<Time> stop,
+                                reduct::IBucket::QueryOptions options,
+                                reduct::IBucket::ReadRecordCallback callback) const = 0;
+  };
+
+  class BucketSource : public RecordSource {
+  public:
+    explicit BucketSource(std::unique_ptr<reduct::IBucket> bucket)
+        : bucket_(std::move(bucket)) {}
+
+    reduct::Result<std::vector<reduct::IBucket::EntryInfo>>
+    GetEntryList() const noexcept override {
+      return bucket_->GetEntryList();
+    }
+
+    reduct::Error Query(std::string_view entry, std::optional<Time> start,
+                        std::optional<Time> stop,
+                        reduct::IBucket::QueryOptions options,
+                        reduct::IBucket::ReadRecordCallback callback) const override {
+      return bucket_->Query(entry, start, stop, std::move(options),
+                            std::move(callback));
+    }
+
+  private:
+    std::unique_ptr<reduct::IBucket> bucket_;
+  };
+
+  // Lets several owners use one source whose Query() is safe to call
+  // concurrently.
+  class SharedSource : public RecordSource {
+  public:
+    explicit SharedSource(std::shared_ptr<const RecordSource> source)
+        : source_(std::move(source)) {}
+
+    reduct::Result<std::vector<reduct::IBucket::EntryInfo>>
+    GetEntryList() const noexcept override {
+      return source_->GetEntryList();
+    }
+
+    reduct::Error Query(std::string_view entry, std::optional<Time> start,
+                        std::optional<Time> stop,
+                        reduct::IBucket::QueryOptions options,
+                        reduct::IBucket::ReadRecordCallback callback) const override {
+      return source_->Query(entry, start, stop, std::move(options),
+                            std::move(callback));
+    }
+
+  private:
+    std::shared_ptr<const RecordSource> source_;
+  };
+}
@@ -0,0 +1,522 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include <reduct/client.h>
+#include "query_cache.h"
+#include "record_source.h"
+
+namespace common {
+  // Capture file: "RCAP" + u32 version, then frames appended as they arrive:
+  //   'S' | u32 stream id | u32 len, entry | u32 len, options key
+  //   'R' | u32 stream id | segment record (see query_cache.h)
+  //   'W' | u32 stream id | i64 start_us | i64 stop_us, a recorded window
+  //   'E' | u64 len, JSON entry list
+  // A stream is one (entry, query options) pair. Records of a stream may be
+  // interleaved with others and out of order when sharded workers record in
+  // parallel; the player sorts them when it opens the file. A window frame
+  // follows every query that completed, so the player can tell an empty range
+  // from one that was never recorded. A truncated tail is ignored, so a
+  // capture from an interrupted run is still usable.
+  namespace capture {
+    constexpr char kMagic[4] = {'R', 'C', 'A', 'P'};
+    constexpr uint32_t kVersion = 2;
+
+    // The capture is keyed like the cache, plus head_only because those
+    // records carry no blob.
+    inline std::string stream_key(const reduct::IBucket::QueryOptions &options) {
+      return options_key(options) + (options.head_only ? "h" : "");
+    }
+  }
+
+  // Appends capture frames from any number of threads.
+  class CaptureWriter {
+  public:
+    static std::shared_ptr<CaptureWriter> open(const std::filesystem::path &path) {
+      auto writer = std::shared_ptr<CaptureWriter>(new CaptureWriter(path));
+      if (!writer->out_) return nullptr;
+      return writer;
+    }
+
+    uint32_t stream_id(std::string_view entry, const std::string &key) {
+      std::lock_guard lock(mutex_);
+      auto [it, inserted] = streams_.try_emplace({std::string(entry), key},
+                                                 uint32_t(streams_.size()));
+      if (inserted) {
+        std::string frame = "S";
+        put(frame, it->second);
+        put_str(frame, entry);
+        put_str(frame, key);
+        out_.write(frame.data(), std::streamsize(frame.size()));
+      }
+      return it->second;
+    }
+
+    void write_record(uint32_t stream, int64_t ts_us,
+                      const reduct::IBucket::LabelMap &labels,
+                      std::string_view content_type, std::string_view blob) {
+      std::string frame = "R";
+      put(frame, stream);
+      segment::encode_header(frame, ts_us, labels, content_type, blob.size());
+      std::lock_guard lock(mutex_);
+      out_.write(frame.data(), std::streamsize(frame.size()));
+      out_.write(blob.data(), std::streamsize(blob.size()));
+    }
+
+    // Marks [start_us, stop_us) of the stream as recorded in full.
+    void write_window(uint32_t stream, int64_t start_us, int64_t stop_us) {
+      std::string frame = "W";
+      put(frame, stream);
+      put(frame, start_us);
+      put(frame, stop_us);
+      std::lock_guard lock(mutex_);
+      out_.write(frame.data(), std::streamsize(frame.size()));
+    }
+
+    void write_entries(const std::vector<reduct::IBucket::EntryInfo> &entries) {
+      auto list = nlohmann::json::array();
+      for (const auto &e : entries) {
+        list.push_back({{"name", e.name},
+                        {"record_count", e.record_count},
+                        {"block_count", e.block_count},
+                        {"size", e.size},
+                        {"oldest_record", e.oldest_record.time_since_epoch().count()},
+                        {"latest_record", e.latest_record.time_since_epoch().count()}});
+      }
+      const std::string json = list.dump();
+      std::string frame = "E";
+      put(frame, uint64_t(json.size()));
+      frame += json;
+      std::lock_guard lock(mutex_);
+      out_.write(frame.data(), std::streamsize(frame.size()));
+    }
+
+  private:
+    explicit CaptureWriter(const std::filesystem::path &path)
+        : out_(path, std::ios::binary | std::ios::trunc) {
+      out_.write(capture::kMagic, 4);
+      uint32_t version = capture::kVersion;
+      out_.write(reinterpret_cast<const char *>(&version), sizeof(version));
+    }
+
+    template <typename T> static void put(std::string &out, T v) {
+      out.append(reinterpret_cast<const char *>(&v), sizeof(T));
+    }
+    static void put_str(std::string &out, std::string_view s) {
+      put(out, uint32_t(s.size()));
+      out.append(s);
+    }
+
+    std::mutex mutex_;
+    std::ofstream out_;
+    std::map<std::pair<std::string, std::string>, uint32_t> streams_;
+  };
+
+  // Passes queries through to `upstream` and records every record the caller
+  // sees, with its complete blob, into a capture file. Records are read to the
+  // end even if the caller stops reading early, so the capture can serve the
+  // same query again later.
+  class RecordingSource : public RecordSource {
+  public:
+    RecordingSource(std::unique_ptr<RecordSource> upstream,
+                    std::shared_ptr<CaptureWriter> writer)
+        : upstream_(std::move(upstream)), writer_(std::move(writer)) {}
+
+    reduct::Result<std::vector<reduct::IBucket::EntryInfo>>
+    GetEntryList() const noexcept override {
+      auto result = upstream_->GetEntryList();
+      if (result.error == reduct::Error::kOk) writer_->write_entries(result.result);
+      return result;
+    }
+
+    reduct::Error Query(std::string_view entry, std::optional<Time> start,
+                        std::optional<Time> stop,
+                        reduct::IBucket::QueryOptions options,
+                        reduct::IBucket::ReadRecordCallback callback) const override {
+      const uint32_t stream = writer_->stream_id(entry, capture::stream_key(options));
+      const bool head_only = options.head_only;
+      const int64_t lo = start ? start->time_since_epoch().count() : INT64_MIN;
+      int64_t hi = stop ? stop->time_since_epoch().count() : INT64_MAX;
+      auto err = upstream_->Query(
+          entry, start, stop, std::move(options),
+          [&](const reduct::IBucket::ReadableRecord &rec) {
+            std::string blob;
+            reduct::Error read_err = reduct::Error::kOk;
+            bool consumed = head_only;
+            auto tee = [&](reduct::IBucket::ReadCallback cb) {
+              consumed = true;
+              bool forward = true;
+              blob.reserve(rec.size);
+              auto err = rec.Read([&](std::string_view chunk) {
+                blob.append(chunk);
+                if (forward && !cb(chunk)) forward = false;
+                return true;
+              });
+              if (err != reduct::Error::kOk) read_err = err;
+              return err;
+            };
+
+            reduct::IBucket::ReadableRecord local;
+            local.timestamp = rec.timestamp;
+            local.size = rec.size;
+            local.last = rec.last;
+            local.labels = rec.labels;
+            local.content_type = rec.content_type;
+            local.Read = tee;
+            bool keep_going = callback(local);
+            if (!consumed) tee([](std::string_view) { return true; });
+
+            const int64_t ts = rec.timestamp.time_since_epoch().count();
+            if (read_err == reduct::Error::kOk) {
+              writer_->write_record(stream, ts, rec.labels, rec.content_type, blob);
+            }
+            if (!keep_going || read_err != reduct::Error::kOk) {
+              // Only the records before this one (and this one, if it was
+              // recorded) are known to be complete.
+              hi = read_err == reduct::Error::kOk ? ts + 1 : ts;
+              return false;
+            }
+            return true;
+          });
+      if (err == reduct::Error::kOk && lo < hi) writer_->write_window(stream, lo, hi);
+      return err;
+    }
+
+  private:
+    std::unique_ptr<RecordSource> upstream_;
+    std::shared_ptr<CaptureWriter> writer_;
+  };
+
+  struct ReplayOptions {
+    double speed = 0;             // 0 = as fast as memory allows, 1 = the
+                                  // recorded record timing, 10 = 10x faster
+    size_t bytes_per_second = 0;  // 0 = unlimited
+    size_t chunk_size = 0;        // Read() chunk size, 0 = whole blob at once
+  };
+
+  // Serves a capture file through the Query() interface. Blobs are handed out
+  // straight from the mapped file. A query returns the recorded records of
+  // the same entry and options whose timestamps fall in [start, stop), so
+  // sub-ranges and differently sharded windows replay too, as long as the
+  // recorded windows cover [start, stop). A range or option set that was
+  // never recorded yields a 404 like a missing entry.
+  class ReplaySource : public RecordSource {
+  public:
+    static std::unique_ptr<ReplaySource> open(const std::filesystem::path &path,
+                                              ReplayOptions options = {}) {
+      auto file = MappedFile::open(path);
+      if (!file) return nullptr;
+      auto source = std::unique_ptr<ReplaySource>(
+          new ReplaySource(std::move(*file), options));
+      if (!source->index()) return nullptr;
+      return source;
+    }
+
+    reduct::Result<std::vector<reduct::IBucket::EntryInfo>>
+    GetEntryList() const noexcept override {
+      return {entries_, reduct::Error::kOk};
+    }
+
+    reduct::Error Query(std::string_view entry, std::optional<Time> start,
+                        std::optional<Time> stop,
+                        reduct::IBucket::QueryOptions options,
+                        reduct::IBucket::ReadRecordCallback callback) const override {
+      auto it = streams_.find({std::string(entry), capture::stream_key(options)});
+      if (it == streams_.end()) {
+        return {.code = 404,
+                .message = "No capture of '" + std::string(entry) +
+                           "' with these query options"};
+      }
+      const auto &records = it->second;
+      const int64_t lo = start ? start->time_since_epoch().count() : INT64_MIN;
+      const int64_t hi = stop ? stop->time_since_epoch().count() : INT64_MAX;
+      if (!covered(windows_.at(it->first), lo, hi)) {
+        return {.code = 404,
+                .message = "The capture of '" + std::string(entry) +
+                           "' does not cover the requested range"};
+      }
+      auto first = std::lower_bound(
+          records.begin(), records.end(), lo,
+          [](const Indexed &r, int64_t ts) { return r.ts_us < ts; });
+      auto last = std::lower_bound(
+          first, records.end(), hi,
+          [](const Indexed &r, int64_t ts) { return r.ts_us < ts; });
+
+      Pacer pacer(options_, first != last ? first->ts_us : 0);
+      for (auto r = first; r != last; ++r) {
+        segment::RecordView rv;
+        auto reader = segment::Reader::at(file_.view(), r->offset);
+        if (!reader.next(rv)) {
+          return {.code = -1, .message = "Corrupted capture record"};
+        }
+        pacer.wait_for_record(rv.ts_us);
+
+        reduct::IBucket::ReadableRecord rec;
+        rec.timestamp = Time(std::chrono::microseconds(rv.ts_us));
+        rec.size = rv.blob.size();
+        rec.last = r + 1 == last;
+        rec.labels = segment::Reader::decode_labels(rv.labels, rv.n_labels);
+        rec.content_type = std::string(rv.content_type);
+        rec.Read = [&, blob = rv.blob](reduct::IBucket::ReadCallback cb) {
+          const size_t step = options_.chunk_size ? options_.chunk_size : blob.size();
+          for (size_t pos = 0; pos < blob.size(); pos += step) {
+            auto chunk = blob.substr(pos, step);
+            pacer.wait_for_bytes(chunk.size());
+            if (!cb(chunk)) break;
+          }
+          return reduct::Error::kOk;
+        };
+        if (!callback(rec)) break;
+      }
+      return reduct::Error::kOk;
+    }
+
+  private:
+    struct Indexed {
+      int64_t ts_us;
+      size_t offset;  // of the segment record in the file
+    };
+
+    // Throttles one query to the recorded timing and/or a byte rate.
+    class Pacer {
+    public:
+      Pacer(const ReplayOptions &options, int64_t first_ts_us)
+          : options_(options), first_ts_us_(first_ts_us),
+            t0_(std::chrono::steady_clock::now()) {}
+
+      void wait_for_record(int64_t ts_us) {
+        if (options_.speed <= 0) return;
+        auto offset = std::chrono::duration<double, std::micro>(
+            double(ts_us - first_ts_us_) / options_.speed);
+        std::this_thread::sleep_until(
+            t0_ + std::chrono::duration_cast<std::chrono::steady_clock::duration>(offset));
+      }
+
+      void wait_for_bytes(size_t n) {
+        if (options_.bytes_per_second == 0) return;
+        bytes_ += n;
+        auto due = std::chrono::duration<double>(double(bytes_) /
+                                                 double(options_.bytes_per_second));
+        std::this_thread::sleep_until(
+            t0_ + std::chrono::duration_cast<std::chrono::steady_clock::duration>(due));
+      }
+
+    private:
+      const ReplayOptions &options_;
+      int64_t first_ts_us_;
+      std::chrono::steady_clock::time_point t0_;
+      size_t bytes_ = 0;
+    };
+
+    using Window = std::pair<int64_t, int64_t>;  // [start_us, stop_us)
+
+    ReplaySource(MappedFile file, ReplayOptions options)
+        : file_(std::move(file)), options_(options) {}
+
+    // `windows` is sorted and merged, so one of them has to hold the range.
+    static bool covered(const std::vector<Window> &windows, int64_t lo, int64_t hi) {
+      if (lo >= hi) return true;
+      auto it = std::upper_bound(windows.begin(), windows.end(), lo,
+                                 [](int64_t ts, const Window &w) { return ts < w.first; });
+      return it != windows.begin() && std::prev(it)->second >= hi;
+    }
+
+    bool index() {
+      const std::string_view data = file_.view();
+      if (data.size() < 8 || std::memcmp(data.data(), capture::kMagic, 4) != 0) {
+        return false;
+      }
+      uint32_t version = 0;
+      std::memcpy(&version, data.data() + 4, 4);
+      if (version != capture::kVersion) return false;
+
+      std::map<uint32_t, std::pair<std::string, std::string>> ids;
+      std::map<uint32_t, std::vector<Indexed>> records;
+      std::map<uint32_t, std::vector<Window>> windows;
+      std::optional<std::string> entry_json;
+      size_t pos = 8;
+      auto get = [&](auto &v) {
+        if (data.size() - pos < sizeof(v)) return false;
+        std::memcpy(&v, data.data() + pos, sizeof(v));
+        pos += sizeof(v);
+        return true;
+      };
+      auto get_str = [&](std::string &s, auto len) {
+        if (!get(len) || data.size() - pos < len) return false;
+        s.assign(data.substr(pos, size_t(len)));
+        pos += size_t(len);
+        return true;
+      };
+
+      while (pos < data.size()) {
+        const char type = data[pos++];
+        uint32_t id = 0;
+        if (type == 'S') {
+          std::string entry, key;
+          if (!get(id) || !get_str(entry, uint32_t{}) || !get_str(key, uint32_t{})) break;
+          ids[id] = {std::move(entry), std::move(key)};
+        } else if (type == 'R') {
+          if (!get(id)) break;
+          auto reader = segment::Reader::at(data, pos);
+          segment::RecordView rv;
+          if (!reader.next(rv)) break;
+          records[id].push_back({rv.ts_us, pos});
+          pos = reader.position();
+        } else if (type == 'W') {
+          Window w;
+          if (!get(id) || !get(w.first) || !get(w.second)) break;
+          windows[id].push_back(w);
+        } else if (type == 'E') {
+          std::string json;
+          if (!get_str(json, uint64_t{})) break;
+          entry_json = std::move(json);
+        } else {
+          break;
+        }
+      }
+
+      for (auto &[id, recs] : records) {
+        auto name = ids.find(id);
+        if (name == ids.end()) continue;
+        std::stable_sort(recs.begin(), recs.end(),
+                         [](const Indexed &a, const Indexed &b) {
+                           return a.ts_us < b.ts_us;
+                         });
+        // Entries hold one record per timestamp; overlapping recorded
+        // queries must not replay it twice.
+        recs.erase(std::unique(recs.begin(), recs.end(),
+                               [](const Indexed &a, const Indexed &b) {
+                                 return a.ts_us == b.ts_us;
+                               }),
+                   recs.end());
+        streams_[name->second] = std::move(recs);
+      }
+      for (auto &[id, ws] : windows) {
+        auto name = ids.find(id);
+        if (name == ids.end()) continue;
+        // A recorded query may have matched no records at all.
+        streams_.try_emplace(name->second);
+        std::sort(ws.begin(), ws.end());
+        auto &merged = windows_[name->second];
+        for (const auto &w : ws) {
+          if (!merged.empty() && w.first <= merged.back().second) {
+            merged.back().second = std::max(merged.back().second, w.second);
+          } else {
+            merged.push_back(w);
+          }
+        }
+      }
+      for (const auto &[stream, recs] : streams_) windows_.try_emplace(stream);
+
+      if (entry_json) {
+        load_entries(*entry_json);
+      } else {
+        synthesize_entries();
+      }
+      return true;
+    }
+
+    void load_entries(const std::string &json) {
+      auto list = nlohmann::json::parse(json, nullptr, false);
+      if (!list.is_array()) return synthesize_entries();
+      for (const auto &e : list) {
+        reduct::IBucket::EntryInfo info{};
+        info.name = e.value("name", "");
+        info.record_count = e.value("record_count", size_t{0});
+        info.block_count = e.value("block_count", size_t{0});
+        info.size = e.value("size", size_t{0});
+        info.oldest_record =
+            Time(std::chrono::microseconds(e.value("oldest_record", int64_t{0})));
+        info.latest_record =
+            Time(std::chrono::microseconds(e.value("latest_record", int64_t{0})));
+        entries_.push_back(std::move(info));
+      }
+    }
+
+    // Captures without a GetEntryList() answer describe each entry by the
+    // records recorded for it.
+    void synthesize_entries() {
+      std::map<std::string, reduct::IBucket::EntryInfo> by_name;
+      for (const auto &[stream, recs] : streams_) {
+        if (recs.empty()) continue;
+        auto &info = by_name[stream.first];
+        Time oldest(std::chrono::microseconds(recs.front().ts_us));
+        Time latest(std::chrono::microseconds(recs.back().ts_us));
+        if (info.name.empty()) {
+          info.name = stream.first;
+          info.oldest_record = oldest;
+          info.latest_record = latest;
+        }
+        info.record_count = std::max(info.record_count, recs.size());
+        info.oldest_record = std::min(info.oldest_record, oldest);
+        info.latest_record = std::max(info.latest_record, latest);
+        size_t bytes = 0;
+        for (const auto &r : recs) {
+          segment::RecordView rv;
+          auto reader = segment::Reader::at(file_.view(), r.offset);
+          if (reader.next(rv)) bytes += rv.blob.size();
+        }
+        info.size = std::max(info.size, bytes);
+      }
+      for (auto &[name, info] : by_name) entries_.push_back(std::move(info));
+    }
+
+    MappedFile file_;
+    ReplayOptions options_;
+    std::map<std::pair<std::string, std::string>, std::vector<Indexed>> streams_;
+    std::map<std::pair<std::string, std::string>, std::vector<Window>> windows_;
+    std::vector<reduct::IBucket::EntryInfo> entries_;
+  };
+
+  // Source used by the extractors:
+  //   REDUCT_REPLAY=<file>  serve queries from a capture, no network. The
+  //                         pace is set by REDUCT_REPLAY_SPEED (1 = recorded
+  //                         timing) and REDUCT_REPLAY_RATE (bytes/s).
+  //   REDUCT_RECORD=<file>  query the server (through the cache) and capture
+  //                         everything the extractor reads.
+  // Without either it is the cached bucket of connect_cached_bucket().
+  inline std::unique_ptr<RecordSource> connect_source() {
+    if (const char *replay = std::getenv("REDUCT_REPLAY")) {
+      ReplayOptions options;
+      if (const char *speed = std::getenv("REDUCT_REPLAY_SPEED")) {
+        options.speed = std::strtod(speed, nullptr);
+      }
+      if (const char *rate = std::getenv("REDUCT_REPLAY_RATE")) {
+        options.bytes_per_second = std::strtoull(rate, nullptr, 10);
+      }
+      // One index shared by every connection of the process; Query() only
+      // reads from it.
+      static std::shared_ptr<const RecordSource> player =
+          ReplaySource::open(replay, options);
+      if (!player) return nullptr;
+      return std::make_unique<SharedSource>(player);
+    }
+
+    std::unique_ptr<RecordSource> source = connect_cached_bucket();
+    if (!source) return nullptr;
+
+    if (const char *record = std::getenv("REDUCT_RECORD")) {
+      // Shared by every connection of the process, e.g. the sharded
+      // workers; frames are flushed when the process exits.
+      static std::shared_ptr<CaptureWriter> writer = CaptureWriter::open(record);
+      if (!writer) return nullptr;
+      return std::make_unique<RecordingSource>(std::move(source), writer);
+    }
+    return source;
+  }
+}
@@ -0,0 +1,315 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "csv_decoder.h"
+#include "json_decoder.h"
+
+// Compile-time row schemas. A schema names a row struct and its columns in
+// the order the "select" extension should return them:
+//
+//   using ImuSchema = common::Schema<
+//       common::AccelerationData,
+//       common::Column<"ts_ns", &common::AccelerationData::ts_ns>,
+//       common::Column<"linear_acceleration_x",
+//                      &common::AccelerationData::linear_acceleration_x,
+//                      "acc_x">,  // also exposed as label @acc_x
+//       ...>;
+//
+// From that one declaration it provides the "select.columns" JSON (built at
+// compile time), a CSV row parser that writes each field straight to its
+// member and a JSON SAX decoder that maps keys to members through a
+// generated table, guessing the next key from the column order first.
+namespace common {
+  template <size_t N>
+  struct FixedString {
+    char data[N]{};
+
+    constexpr FixedString(const char (&s)[N]) {
+      std::copy_n(s, N, data);
+    }
+    constexpr std::string_view view() const { return {data, N - 1}; }
+  };
+
+  template <typename T> struct member_traits;
+  template <typename C, typename M> struct member_traits<M C::*> {
+    using row_type = C;
+    using value_type = M;
+  };
+
+  template <FixedString Name, auto Member, FixedString Label = "">
+  struct Column {
+    using row_type = typename member_traits<decltype(Member)>::row_type;
+    using value_type = typename member_traits<decltype(Member)>::value_type;
+    static_assert(std::is_arithmetic_v<value_type>,
+                  "schema columns must be numeric members");
+    static_assert(Name.view().find_first_of("\"\\") == std::string_view::npos &&
+                      Label.view().find_first_of("\"\\") == std::string_view::npos,
+                  "column names are emitted into JSON without escaping");
+
+    static constexpr std::string_view name = Name.view();
+    static constexpr std::string_view label = Label.view();
+    static constexpr auto member = Member;
+
+    template <typename Row> static void set(Row &row, int64_t i, double d) {
+      if constexpr (std::is_integral_v<value_type>) {
+        row.*Member = value_type(i);
+      } else {
+        row.*Member = value_type(d);
+      }
+    }
+  };
+
+  enum class SelectFormat { kCsv, kJson };
+
+  template <typename Row, typename... Columns>
+  class Schema {
+    static_assert(sizeof...(Columns) > 0 && sizeof...(Columns) <= 64,
+                  "a schema has 1 to 64 columns");
+    static_assert((std::is_same_v<Row, typename Columns::row_type> && ...),
+                  "every column must be a member of the row type");
+
+  public:
+    using row_type = Row;
+    static constexpr size_t kColumns = sizeof...(Columns);
+    // Rows arrive as an array of objects: [{"ts_ns": ..., ...}, ...]
+    static constexpr size_t row_depth = 2;
+
+    // [{"name":"ts_ns"},{"name":"linear_acceleration_x","as_label":"acc_x"},...]
+    static constexpr std::string_view columns_json() {
+      return {kColumnsJson.data(), kColumnsJson.size()};
+    }
+
+    // The full "ext" parameter for a select query. `when` is an optional
+    // condition on the labels declared by the columns.
+    static std::string select_ext(SelectFormat format, std::string_view when = {}) {
+      std::string ext = R"({"select":{)";
+      ext += format == SelectFormat::kCsv ? R"("csv":{"has_headers":true})"
+                                          : R"("json":{})";
+      ext += R"(,"columns":)";
+      ext += columns_json();
+      ext += "}";
+      if (!when.empty()) {
+        ext += R"(,"when":)";
+        ext += when;
+      }
+      ext += "}";
+      return ext;
+    }
+
+    // Parses one CSV line, column i into the i-th declared member.
+    static CsvStatus parse_csv_row(std::string_view line, Row &row) {
+      const char *p = line.data();
+      const char *end = p + line.size();
+      CsvStatus st = CsvStatus::kOk;
+      ((st = st == CsvStatus::kOk
+                 ? parse_csv_field(p, end, row.*Columns::member)
+                 : st),
+       ...);
+      return st;
+    }
+
+    template <typename Sink, typename OnError>
+    static CsvDecodeResult decode_csv(std::string_view blob, bool has_header,
+                                      Sink &&sink, OnError &&on_error) {
+      ArenaScope arena;
+      CsvStreamDecoder<std::remove_reference_t<Sink>,
+                       std::remove_reference_t<OnError>, Schema>
+          decoder(has_header, sink, on_error, arena.resource());
+      decoder.feed(blob);
+      return decoder.finish();
+    }
+
+    template <typename Sink>
+    static CsvDecodeResult decode_csv(std::string_view blob, bool has_header,
+                                      Sink &&sink) {
+      return decode_csv(blob, has_header, std::forward<Sink>(sink),
+                        [](size_t, std::string_view, CsvStatus) {});
+    }
+
+    // SAX handler for rows of scalar columns. Keys are matched against the
+    // expected next column first, which is a single comparison for output
+    // of the select extension, and against all columns otherwise.
+    template <typename Sink>
+    class Sax {
+    public:
+      using json = nlohmann::json;
+
+      Sax(Sink &sink, size_t row_depth) : sink_(sink), row_depth_(row_depth) {}
+
+      const JsonDecodeResult &result() const { return result_; }
+
+      bool null() { return skip(); }
+      bool boolean(bool) { return skip(); }
+      bool number_integer(json::number_integer_t v) { return set(v, double(v)); }
+      bool number_unsigned(json::number_unsigned_t v) {
+        return set(int64_t(v), double(v));
+      }
+      bool number_float(json::number_float_t v, const json::string_t &) {
+        return set(int64_t(v), v);
+      }
+      bool string(json::string_t &) { return skip(); }
+      bool binary(json::binary_t &) { return skip(); }
+
+      bool start_object(std::size_t) {
+        if (++depth_ == row_depth_) {
+          row_ = Row{};
+          seen_ = 0;
+          next_ = 0;
+        }
+        column_ = -1;
+        return true;
+      }
+
+      bool end_object() {
+        if (depth_-- == row_depth_) {
+          if (seen_ == kAllColumns) {
+            sink_(std::as_const(row_));
+            ++result_.rows;
+          } else {
+            ++result_.incomplete_rows;
+            result_.status = JsonStatus::kMissingField;
+          }
+        }
+        column_ = -1;
+        return true;
+      }
+
+      bool start_array(std::size_t) {
+        ++depth_;
+        column_ = -1;
+        return true;
+      }
+
+      bool end_array() {
+        --depth_;
+        column_ = -1;
+        return true;
+      }
+
+      bool key(json::string_t &name) {
+        column_ = depth_ == row_depth_ ? find_column(name) : -1;
+        return true;
+      }
+
+      bool parse_error(std::size_t, const std::string &,
+                       const nlohmann::detail::exception &) {
+        result_.status = JsonStatus::kSyntaxError;
+        return false;
+      }
+
+    private:
+      int find_column(std::string_view name) {
+        if (next_ < kColumns && kNames[next_] == name) return int(next_++);
+        for (size_t i = 0; i < kColumns; ++i) {
+          if (kNames[i] == name) {
+            next_ = i + 1;
+            return int(i);
+          }
+        }
+        return -1;
+      }
+
+      bool skip() {
+        column_ = -1;
+        return true;
+      }
+
+      bool set(int64_t i, double d) {
+        if (column_ >= 0) {
+          kSetters[size_t(column_)](row_, i, d);
+          seen_ |= uint64_t(1) << column_;
+        }
+        column_ = -1;
+        return true;
+      }
+
+      Sink &sink_;
+      size_t row_depth_;
+      size_t depth_ = 0;
+      size_t next_ = 0;
+      int column_ = -1;
+      uint64_t seen_ = 0;
+      Row row_{};
+      JsonDecodeResult result_;
+    };
+
+  private:
+    static constexpr std::array<std::string_view, kColumns> kNames = {Columns::name...};
+
+    using Setter = void (*)(Row &, int64_t, double);
+    static constexpr std::array<Setter, kColumns> kSetters = {
+        &Columns::template set<Row>...};
+
+    static constexpr uint64_t kAllColumns =
+        kColumns == 64 ? ~uint64_t(0) : (uint64_t(1) << kColumns) - 1;
+
+    // Writes the columns JSON to `out`, or only counts it when out is null.
+    static constexpr size_t write_columns(char *out) {
+      size_t n = 0;
+      auto put = [&](std::string_view s) {
+        for (char c : s) {
+          if (out) out[n] = c;
+          ++n;
+        }
+      };
+      put("[");
+      size_t i = 0;
+      auto column = [&](std::string_view name, std::string_view label) {
+        if (i++ > 0) put(",");
+        put(R"({"name":")");
+        put(name);
+        put("\"");
+        if (!label.empty()) {
+          put(R"(,"as_label":")");
+          put(label);
+          put("\"");
+        }
+        put("}");
+      };
+      (column(Columns::name, Columns::label), ...);
+      put("]");
+      return n;
+    }
+
+    static constexpr auto kColumnsJson = [] {
+      std::array<char, write_columns(nullptr)> out{};
+      write_columns(out.data());
+      return out;
+    }();
+  };
+
+  // decode_json() for a compile-time schema, so decode_json(blob, schema,
+  // sink) and the streaming decoders accept either kind of schema.
+  template <typename Sink, typename Row, typename... Columns>
+  JsonDecodeResult decode_json(std::string_view blob,
+                               const Schema<Row, Columns...> &, Sink &&sink,
+                               size_t row_depth) {
+    using Handler =
+        typename Schema<Row, Columns...>::template Sax<std::remove_reference_t<Sink>>;
+    Handler sax(sink, row_depth);
+    nlohmann::json::sax_parse(blob.data(), blob.data() + blob.size(), &sax);
+    return sax.result();
+  }
+
+  template <typename Sink, typename Row, typename... Columns>
+  JsonDecodeResult decode_json(std::string_view blob,
+                               const Schema<Row, Columns...> &schema, Sink &&sink) {
+    return decode_json(blob, schema, std::forward<Sink>(sink),
+                       Schema<Row, Columns...>::row_depth);
+  }
+
+  // The IMU columns the CSV and JSON entries are queried for.
+  using ImuSchema = Schema<
+      AccelerationData, Column<"ts_ns", &AccelerationData::ts_ns>,
+      Column<"linear_acceleration_x", &AccelerationData::linear_acceleration_x, "acc_x">,
+      Column<"linear_acceleration_y", &AccelerationData::linear_acceleration_y, "acc_y">,
+      Column<"linear_acceleration_z", &AccelerationData::linear_acceleration_z, "acc_z">>;
+}
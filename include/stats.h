@@ -0,0 +1,225 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include "data_structures.h"
+#include "profiling.h"
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define COMMON_STATS_HAVE_AVX2 1
+#endif
+
+namespace common {
+  // Running statistics of one column. NaNs are counted but excluded from
+  // every other field. Partial results from blocks or threads combine with
+  // merge(), using Chan's update for the variance term.
+  struct ColumnStats {
+    size_t count = 0;
+    size_t nan_count = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    double abs_min = std::numeric_limits<double>::infinity();
+    double abs_max = -std::numeric_limits<double>::infinity();
+    double mean = 0.0;
+    double m2 = 0.0;
+
+    double variance() const { return count > 1 ? m2 / double(count - 1) : 0.0; }
+    double stddev() const { return std::sqrt(variance()); }
+
+    void merge(const ColumnStats &other) {
+      nan_count += other.nan_count;
+      if (other.count == 0) return;
+      if (count == 0) {
+        size_t nans = nan_count;
+        *this = other;
+        nan_count = nans;
+        return;
+      }
+      const double na = double(count);
+      const double nb = double(other.count);
+      const double n = na + nb;
+      const double delta = other.mean - mean;
+      mean += delta * nb / n;
+      m2 += other.m2 + delta * delta * na * nb / n;
+      count += other.count;
+      min = std::min(min, other.min);
+      max = std::max(max, other.max);
+      abs_min = std::min(abs_min, other.abs_min);
+      abs_max = std::max(abs_max, other.abs_max);
+    }
+  };
+
+  struct FrameStats {
+    size_t rows = 0;
+    int64_t min_ts = std::numeric_limits<int64_t>::max();
+    int64_t max_ts = std::numeric_limits<int64_t>::min();
+    ColumnStats x;
+    ColumnStats y;
+    ColumnStats z;
+
+    void merge(const FrameStats &other) {
+      rows += other.rows;
+      min_ts = std::min(min_ts, other.min_ts);
+      max_ts = std::max(max_ts, other.max_ts);
+      x.merge(other.x);
+      y.merge(other.y);
+      z.merge(other.z);
+    }
+  };
+
+  namespace detail {
+    // Blocks stay in L1, so the second (deviation) pass over a block doesn't
+    // touch memory again.
+    constexpr size_t kStatsBlock = 2048;
+
+    inline ColumnStats block_stats_scalar(const double *p, size_t n) {
+      ColumnStats s;
+      double sum = 0.0;
+      for (size_t i = 0; i < n; ++i) {
+        double v = p[i];
+        if (std::isnan(v)) continue;
+        ++s.count;
+        sum += v;
+        s.min = std::min(s.min, v);
+        s.max = std::max(s.max, v);
+        s.abs_min = std::min(s.abs_min, std::abs(v));
+        s.abs_max = std::max(s.abs_max, std::abs(v));
+      }
+      s.nan_count = n - s.count;
+      if (s.count == 0) return s;
+
+      s.mean = sum / double(s.count);
+      for (size_t i = 0; i < n; ++i) {
+        double d = p[i] - s.mean;
+        if (!std::isnan(d)) s.m2 += d * d;
+      }
+      return s;
+    }
+
+#if defined(COMMON_STATS_HAVE_AVX2)
+    __attribute__((target("avx2"))) inline double hsum(__m256d v) {
+      __m128d lo = _mm256_castpd256_pd128(v);
+      __m128d hi = _mm256_extractf128_pd(v, 1);
+      lo = _mm_add_pd(lo, hi);
+      return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+    }
+
+    __attribute__((target("avx2"))) inline double hmin(__m256d v) {
+      alignas(32) double lanes[4];
+      _mm256_store_pd(lanes, v);
+      return std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+    }
+
+    __attribute__((target("avx2"))) inline double hmax(__m256d v) {
+      alignas(32) double lanes[4];
+      _mm256_store_pd(lanes, v);
+      return std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    }
+
+    __attribute__((target("avx2"))) inline ColumnStats
+    block_stats_avx2(const double *p, size_t n) {
+      const __m256d inf = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+      const __m256d ninf = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+      const __m256d sign = _mm256_set1_pd(-0.0);
+      __m256d vsum = _mm256_setzero_pd();
+      __m256d vmin = inf, vmax = ninf, vamin = inf, vamax = ninf;
+      size_t valid = 0;
+      size_t i = 0;
+
+      for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(p + i);
+        __m256d ok = _mm256_cmp_pd(v, v, _CMP_ORD_Q);
+        valid += size_t(std::popcount(unsigned(_mm256_movemask_pd(ok))));
+        __m256d a = _mm256_andnot_pd(sign, v);
+        vsum = _mm256_add_pd(vsum, _mm256_and_pd(v, ok));
+        vmin = _mm256_min_pd(vmin, _mm256_blendv_pd(inf, v, ok));
+        vmax = _mm256_max_pd(vmax, _mm256_blendv_pd(ninf, v, ok));
+        vamin = _mm256_min_pd(vamin, _mm256_blendv_pd(inf, a, ok));
+        vamax = _mm256_max_pd(vamax, _mm256_blendv_pd(ninf, a, ok));
+      }
+
+      ColumnStats s;
+      ColumnStats tail = block_stats_scalar(p + i, n - i);
+      double sum = hsum(vsum) + tail.mean * double(tail.count);
+      s.count = valid + tail.count;
+      s.nan_count = n - s.count;
+      if (s.count == 0) return s;
+
+      s.min = std::min(hmin(vmin), tail.min);
+      s.max = std::max(hmax(vmax), tail.max);
+      s.abs_min = std::min(hmin(vamin), tail.abs_min);
+      s.abs_max = std::max(hmax(vamax), tail.abs_max);
+      s.mean = sum / double(s.count);
+
+      const __m256d vmean = _mm256_set1_pd(s.mean);
+      __m256d vm2 = _mm256_setzero_pd();
+      for (i = 0; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(p + i);
+        __m256d ok = _mm256_cmp_pd(v, v, _CMP_ORD_Q);
+        __m256d d = _mm256_and_pd(_mm256_sub_pd(v, vmean), ok);
+        vm2 = _mm256_add_pd(vm2, _mm256_mul_pd(d, d));
+      }
+      s.m2 = hsum(vm2);
+      for (; i < n; ++i) {
+        double d = p[i] - s.mean;
+        if (!std::isnan(d)) s.m2 += d * d;
+      }
+      return s;
+    }
+#endif
+
+    using BlockStatsFn = ColumnStats (*)(const double *, size_t);
+
+    inline BlockStatsFn select_block_stats() {
+#if defined(COMMON_STATS_HAVE_AVX2)
+      if (__builtin_cpu_supports("avx2")) return block_stats_avx2;
+#endif
+      return block_stats_scalar;
+    }
+
+    inline BlockStatsFn block_stats() {
+      static const BlockStatsFn fn = select_block_stats();
+      return fn;
+    }
+  }
+
+  inline ColumnStats column_stats(std::span<const double> values) {
+    auto kernel = detail::block_stats();
+    ColumnStats s;
+    for (size_t i = 0; i < values.size(); i += detail::kStatsBlock) {
+      size_t n = std::min(detail::kStatsBlock, values.size() - i);
+      s.merge(kernel(values.data() + i, n));
+    }
+    return s;
+  }
+
+  // One sweep over the frame: every block of rows is reduced for all three
+  // columns and the timestamps before moving on.
+  inline FrameStats frame_stats(const AccelerationFrame &frame) {
+    profile::Scope scope("stats");
+    scope.rows(frame.size());
+    auto kernel = detail::block_stats();
+    auto ts = frame.ts_ns();
+    auto xs = frame.acc_x();
+    auto ys = frame.acc_y();
+    auto zs = frame.acc_z();
+
+    FrameStats s;
+    s.rows = frame.size();
+    for (size_t i = 0; i < frame.size(); i += detail::kStatsBlock) {
+      size_t n = std::min(detail::kStatsBlock, frame.size() - i);
+      s.x.merge(kernel(xs.data() + i, n));
+      s.y.merge(kernel(ys.data() + i, n));
+      s.z.merge(kernel(zs.data() + i, n));
+      for (size_t j = i; j < i + n; ++j) {
+        s.min_ts = std::min(s.min_ts, ts[j]);
+        s.max_ts = std::max(s.max_ts, ts[j]);
+      }
+    }
+    return s;
+  }
+}
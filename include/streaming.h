@@ -0,0 +1,63 @@
+#pragma once
+#include <string_view>
+#include <type_traits>
+#include <reduct/client.h>
+#include "arena.h"
+#include "csv_decoder.h"
+#include "json_decoder.h"
+#include "profiling.h"
+
+namespace common {
+  // Hands the record to decoder.feed() chunk by chunk as the SDK receives
+  // it, so parsing overlaps the transfer and the record is never held in
+  // one buffer. The stream_*() helpers below put the decoder's buffers on
+  // the thread's record arena, released when the record is done.
+  template <typename Decoder>
+  reduct::Error read_streaming(const reduct::IBucket::ReadableRecord &rec,
+                               Decoder &decoder) {
+    static auto &stage = profile::stage("decode");
+    return rec.Read([&](std::string_view chunk) {
+      profile::Scope scope(stage);
+      scope.bytes(chunk.size());
+      decoder.feed(chunk);
+      return true;
+    });
+  }
+
+  template <typename Sink, typename OnError>
+  reduct::Result<CsvDecodeResult>
+  stream_csv(const reduct::IBucket::ReadableRecord &rec, bool has_header,
+             Sink &&sink, OnError &&on_error) {
+    ArenaScope arena;
+    CsvStreamDecoder<std::remove_reference_t<Sink>,
+                     std::remove_reference_t<OnError>>
+        decoder(has_header, sink, on_error, arena.resource());
+    auto err = read_streaming(rec, decoder);
+    return {decoder.finish(), err};
+  }
+
+  // CSV with a row format other than AccelerationCsv, e.g. a Schema.
+  template <typename Format, typename Sink, typename OnError>
+  reduct::Result<CsvDecodeResult>
+  stream_csv(const reduct::IBucket::ReadableRecord &rec, const Format &,
+             bool has_header, Sink &&sink, OnError &&on_error) {
+    ArenaScope arena;
+    CsvStreamDecoder<std::remove_reference_t<Sink>,
+                     std::remove_reference_t<OnError>, Format>
+        decoder(has_header, sink, on_error, arena.resource());
+    auto err = read_streaming(rec, decoder);
+    return {decoder.finish(), err};
+  }
+
+  // Format is a JsonSchema or a compile-time Schema from schema.h.
+  template <typename Format, typename Sink>
+  reduct::Result<JsonDecodeResult>
+  stream_json(const reduct::IBucket::ReadableRecord &rec, const Format &schema,
+              Sink &&sink) {
+    ArenaScope arena;
+    JsonStreamDecoder<std::remove_reference_t<Sink>, Format> decoder(schema, sink,
+                                                                    arena.resource());
+    auto err = read_streaming(rec, decoder);
+    return {decoder.finish(), err};
+  }
+}
@@ -1,23 +1,30 @@
 #pragma once
 #include <algorithm>
+#include <charconv>
 #include <chrono>
+#include <cmath>
 #include <ctime>
 #include <iomanip>
 #include <iostream>
-#include <numeric>
+#include <limits>
 #include <optional>
+#include <span>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cctype>
 #include <reduct/client.h>
 #include "data_structures.h"
+#include "profiling.h"
+#include "stats.h"
 
 
 namespace common {
   using Time = reduct::IBucket::Time;
   
-  std::optional<Time> parse_time(const std::string& s) {
+  inline std::optional<Time> parse_time(const std::string& s) {
     if (s.empty()) return std::nullopt;
 
     std::tm tm{}; std::istringstream ss(s);
@@ -41,7 +48,80 @@ namespace common {
     return tp;
   }
 
-  void print_dataframe_head(const std::vector<AccelerationData> &data, size_t n = 5) {
+  inline bool has_flag(int argc, char **argv, std::string_view flag) {
+    for (int i = 1; i < argc; ++i) {
+      if (flag == argv[i]) return true;
+    }
+    return false;
+  }
+
+  // Value of a "--name=value" argument; pass the prefix including '='.
+  inline std::optional<std::string_view> flag_value(int argc, char **argv,
+                                                    std::string_view prefix) {
+    for (int i = 1; i < argc; ++i) {
+      std::string_view arg = argv[i];
+      if (arg.starts_with(prefix)) return arg.substr(prefix.size());
+    }
+    return std::nullopt;
+  }
+
+  // Numeric "--name=value" flags: `fallback` if the flag is absent, nullopt
+  // (after saying why on stderr) if the value is not a number in [min, max].
+  inline std::optional<double>
+  number_flag(int argc, char **argv, std::string_view prefix, double fallback,
+              double min = -std::numeric_limits<double>::max(),
+              double max = std::numeric_limits<double>::max()) {
+    auto text = flag_value(argc, argv, prefix);
+    if (!text) return fallback;
+    double value = 0;
+    auto [end, ec] = std::from_chars(text->data(), text->data() + text->size(), value);
+    if (ec != std::errc() || end != text->data() + text->size() || !std::isfinite(value) ||
+        value < min || value > max) {
+      const bool low = min > -std::numeric_limits<double>::max();
+      const bool high = max < std::numeric_limits<double>::max();
+      std::cerr << "Bad " << prefix << *text << ": expected a number";
+      if (low) std::cerr << " >= " << min;
+      if (high) std::cerr << (low ? " and" : "") << " <= " << max;
+      std::cerr << "\n";
+      return std::nullopt;
+    }
+    return value;
+  }
+
+  inline std::optional<size_t>
+  count_flag(int argc, char **argv, std::string_view prefix, size_t fallback,
+             size_t min = 0, size_t max = std::numeric_limits<size_t>::max()) {
+    auto text = flag_value(argc, argv, prefix);
+    if (!text) return fallback;
+    size_t value = 0;
+    auto [end, ec] = std::from_chars(text->data(), text->data() + text->size(), value);
+    if (ec != std::errc() || end != text->data() + text->size() || value < min ||
+        value > max) {
+      std::cerr << "Bad " << prefix << *text << ": expected a whole number >= " << min;
+      if (max < std::numeric_limits<size_t>::max()) std::cerr << " and <= " << max;
+      std::cerr << "\n";
+      return std::nullopt;
+    }
+    return value;
+  }
+
+  // A "--name=ISO" flag: `fallback` if absent, nullopt (after saying why on
+  // stderr) if the value is empty or not a time.
+  inline std::optional<Time> time_flag(int argc, char **argv, std::string_view prefix,
+                                       Time fallback) {
+    auto text = flag_value(argc, argv, prefix);
+    if (!text) return fallback;
+    std::optional<Time> value;
+    try {
+      value = parse_time(std::string(*text));
+    } catch (const std::exception &) {
+    }
+    if (!value) std::cerr << "Bad " << prefix << *text << ": expected an ISO time\n";
+    return value;
+  }
+
+  inline void print_dataframe_head(const AccelerationFrame &data, size_t n = 5) {
+    profile::Scope scope("print");
     std::cout << "\n=== DataFrame Head (first " << std::min(n, data.size())
               << " rows) ===\n";
     std::cout << std::setw(20) << "ts_ns" << std::setw(20) << "linear_accel_x"
@@ -50,7 +130,7 @@ namespace common {
     std::cout << std::string(80, '-') << "\n";
 
     for (size_t i = 0; i < std::min(n, data.size()); ++i) {
-      const auto &row = data[i];
+      const auto row = data.row(i);
       std::cout << std::setw(20) << row.ts_ns << std::setw(20) << std::fixed
                 << std::setprecision(6) << row.linear_acceleration_x
                 << std::setw(20) << std::fixed << std::setprecision(6)
@@ -59,7 +139,9 @@ namespace common {
     }
   }
 
-  void print_dataframe_stats(const std::vector<AccelerationData> &data) {
+  inline void print_dataframe_stats(const AccelerationFrame &data,
+                                    const FrameStats &stats) {
+    profile::Scope scope("print");
     if (data.empty()) {
       std::cout << "\nNo data available for statistics.\n";
       return;
@@ -68,33 +150,24 @@ namespace common {
     std::cout << "\n=== DataFrame Statistics ===\n";
     std::cout << "Total records: " << data.size() << "\n";
 
-    std::vector<double> x_vals, y_vals, z_vals;
-    for (const auto &row : data) {
-      x_vals.push_back(row.linear_acceleration_x);
-      y_vals.push_back(row.linear_acceleration_y);
-      z_vals.push_back(row.linear_acceleration_z);
-    }
-
-    auto calc_stats = [](const std::vector<double> &vals,
-                         const std::string &name) {
-      auto [min_it, max_it] = std::minmax_element(vals.begin(), vals.end());
-      double sum = std::accumulate(vals.begin(), vals.end(), 0.0);
-      double mean = sum / vals.size();
-
+    auto print_stats = [](const ColumnStats &col, const std::string &name) {
       std::cout << std::setw(20) << name << ": min=" << std::setw(10)
-                << std::fixed << std::setprecision(6) << *min_it
+                << std::fixed << std::setprecision(6) << col.min
                 << ", max=" << std::setw(10) << std::fixed << std::setprecision(6)
-                << *max_it << ", mean=" << std::setw(10) << std::fixed
-                << std::setprecision(6) << mean << "\n";
+                << col.max << ", mean=" << std::setw(10) << std::fixed
+                << std::setprecision(6) << col.mean << ", std=" << std::setw(10)
+                << std::fixed << std::setprecision(6) << col.stddev();
+      if (col.nan_count > 0) std::cout << ", nan=" << col.nan_count;
+      std::cout << "\n";
     };
 
-    calc_stats(x_vals, "linear_accel_x");
-    calc_stats(y_vals, "linear_accel_y");
-    calc_stats(z_vals, "linear_accel_z");
+    print_stats(stats.x, "linear_accel_x");
+    print_stats(stats.y, "linear_accel_y");
+    print_stats(stats.z, "linear_accel_z");
 
     if (!data.empty()) {
-      int64_t min_ts = data.front().ts_ns;
-      int64_t max_ts = data.back().ts_ns;
+      int64_t min_ts = stats.min_ts;
+      int64_t max_ts = stats.max_ts;
       double duration_sec = (max_ts - min_ts) / 1e9;
 
       std::cout << "\nTime range:\n";
@@ -108,4 +181,8 @@ namespace common {
       }
     }
   }
+
+  inline void print_dataframe_stats(const AccelerationFrame &data) {
+    print_dataframe_stats(data, frame_stats(data));
+  }
 }
\ No newline at end of file
@@ -0,0 +1,234 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+#include "parallel_query.h"
+#include "pointcloud.h"
+#include "profiling.h"
+
+namespace common {
+  struct VoxelGridOptions {
+    // Edge of a voxel, in the units of the points (metres for the lidar).
+    float leaf = 0.1f;
+    // Voxels with fewer points are dropped as noise.
+    uint32_t min_points = 1;
+    // Threads for one cloud; 0 = hardware concurrency.
+    size_t workers = 0;
+  };
+
+  // A cloud reduced to one point per occupied voxel, sorted by voxel key.
+  // Keys are Morton codes of the voxel's grid coordinates, anchored at the
+  // origin, so clouds downsampled with the same leaf share keys and can be
+  // compared with shared_voxels().
+  struct VoxelCloud {
+    float leaf = 0;
+    std::vector<uint64_t> keys;
+    // Centroid of the voxel's points; intensity is their mean.
+    std::vector<PointData> points;
+    std::vector<uint32_t> counts;
+    std::vector<float> intensity_min;
+    std::vector<float> intensity_max;
+    size_t input = 0;
+    // Points with a NaN coordinate or outside the +/-2^20 voxel grid.
+    size_t dropped = 0;
+
+    size_t size() const { return keys.size(); }
+    double ratio() const { return keys.empty() ? 0.0 : double(input) / double(size()); }
+  };
+
+  namespace voxel {
+    constexpr int kAxisBits = 21;
+    constexpr int64_t kBias = int64_t(1) << (kAxisBits - 1);
+
+    // Spreads the low 21 bits of v to every third bit.
+    constexpr uint64_t spread(uint64_t v) {
+      v &= 0x1fffff;
+      v = (v | v << 32) & 0x1f00000000ffffULL;
+      v = (v | v << 16) & 0x1f0000ff0000ffULL;
+      v = (v | v << 8) & 0x100f00f00f00f00fULL;
+      v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+      v = (v | v << 2) & 0x1249249249249249ULL;
+      return v;
+    }
+
+    constexpr uint64_t kInvalid = std::numeric_limits<uint64_t>::max();
+
+    // Morton key of the voxel holding p, or kInvalid.
+    inline uint64_t key(const PointData &p, float inv_leaf) {
+      if (!is_valid_point(p)) return kInvalid;
+      const float c[3] = {p.x, p.y, p.z};
+      uint64_t k = 0;
+      for (int a = 0; a < 3; ++a) {
+        const float f = std::floor(c[a] * inv_leaf);
+        if (!(f >= -float(kBias) && f < float(kBias))) return kInvalid;
+        k |= spread(uint64_t(int64_t(f) + kBias)) << a;
+      }
+      return k;
+    }
+
+    // parallel_for() without the thread when there is a single chunk.
+    template <typename Fn> void for_chunks(size_t chunks, Fn fn) {
+      if (chunks == 1) {
+        fn(size_t(0));
+      } else {
+        parallel_for(chunks, fn, chunks);
+      }
+    }
+
+    struct KeyedPoint {
+      uint64_t key;
+      PointData point;
+    };
+
+    // Stable LSD radix sort of `items` by key, one byte per pass, with each
+    // pass split across `chunks` threads: every thread counts its own slice,
+    // the counts are turned into per-thread output offsets, and every thread
+    // scatters its slice. Passes whose byte is the same for all keys are
+    // skipped, so grids a few hundred voxels wide take three or four passes.
+    inline void radix_sort(std::vector<KeyedPoint> &items, size_t chunks) {
+      const size_t n = items.size();
+      if (n < 2) return;
+      chunks = std::clamp<size_t>(chunks, 1, n);
+      std::vector<KeyedPoint> tmp(n);
+      std::vector<std::array<size_t, 256>> counts(chunks);
+      auto bounds = [&](size_t c) { return std::pair{n * c / chunks, n * (c + 1) / chunks}; };
+
+      uint64_t varying = 0;
+      for (const auto &item : items) varying |= item.key ^ items[0].key;
+
+      for (int shift = 0; shift < 64; shift += 8) {
+        if (((varying >> shift) & 0xff) == 0) continue;
+        for_chunks(chunks, [&](size_t c) {
+          auto &count = counts[c];
+          count.fill(0);
+          auto [lo, hi] = bounds(c);
+          for (size_t i = lo; i < hi; ++i) ++count[(items[i].key >> shift) & 0xff];
+        });
+        size_t offset = 0;
+        for (size_t b = 0; b < 256; ++b) {
+          for (size_t c = 0; c < chunks; ++c) {
+            const size_t k = counts[c][b];
+            counts[c][b] = offset;
+            offset += k;
+          }
+        }
+        for_chunks(chunks, [&](size_t c) {
+          auto &next = counts[c];
+          auto [lo, hi] = bounds(c);
+          for (size_t i = lo; i < hi; ++i) tmp[next[(items[i].key >> shift) & 0xff]++] = items[i];
+        });
+        items.swap(tmp);
+      }
+    }
+  }
+
+  // Reduces `points` to the centroid of each occupied voxel of a grid with
+  // edge options.leaf, with the count and the mean/min/max intensity of the
+  // voxel. Points are keyed and sorted by voxel key, so each voxel is a run
+  // aggregated by one sequential pass, without a hash table. A NaN intensity
+  // is left out of the voxel's intensity.
+  inline VoxelCloud voxel_downsample(std::span<const PointData> points,
+                                     const VoxelGridOptions &options = {}) {
+    profile::Scope scope("voxel");
+    scope.bytes(points.size() * sizeof(PointData));
+    VoxelCloud out;
+    out.leaf = options.leaf;
+    out.input = points.size();
+    if (points.empty() || !(options.leaf > 0)) return out;
+
+    const size_t workers = resolve_workers({.workers = options.workers});
+    // Below ~64k points per thread the thread start-up costs more than it
+    // saves.
+    const size_t chunks = std::clamp<size_t>(points.size() / (64 * 1024), 1, workers);
+    const float inv_leaf = 1.0f / options.leaf;
+
+    std::vector<voxel::KeyedPoint> items(points.size());
+    std::vector<size_t> kept(chunks);
+    voxel::for_chunks(chunks, [&](size_t c) {
+      const size_t lo = points.size() * c / chunks, hi = points.size() * (c + 1) / chunks;
+      size_t w = lo;
+      for (size_t i = lo; i < hi; ++i) {
+        const uint64_t k = voxel::key(points[i], inv_leaf);
+        if (k != voxel::kInvalid) items[w++] = {k, points[i]};
+      }
+      kept[c] = w - lo;
+    });
+    // Close the gaps left by dropped points.
+    size_t n = kept[0];
+    for (size_t c = 1; c < chunks; ++c) {
+      const size_t lo = points.size() * c / chunks;
+      std::copy_n(items.begin() + ptrdiff_t(lo), kept[c], items.begin() + ptrdiff_t(n));
+      n += kept[c];
+    }
+    items.resize(n);
+    out.dropped = points.size() - n;
+
+    voxel::radix_sort(items, chunks);
+
+    for (size_t i = 0; i < items.size();) {
+      const uint64_t k = items[i].key;
+      double sx = 0, sy = 0, sz = 0, si = 0;
+      uint32_t count = 0, with_intensity = 0;
+      float imin = std::numeric_limits<float>::infinity();
+      float imax = -std::numeric_limits<float>::infinity();
+      for (; i < items.size() && items[i].key == k; ++i) {
+        const auto &p = items[i].point;
+        sx += p.x;
+        sy += p.y;
+        sz += p.z;
+        ++count;
+        if (!std::isnan(p.intensity)) {
+          si += p.intensity;
+          ++with_intensity;
+          imin = std::min(imin, p.intensity);
+          imax = std::max(imax, p.intensity);
+        }
+      }
+      if (count < options.min_points) continue;
+      const float nan = std::numeric_limits<float>::quiet_NaN();
+      out.keys.push_back(k);
+      out.points.push_back({float(sx / count), float(sy / count), float(sz / count),
+                            with_intensity ? float(si / with_intensity) : nan});
+      out.counts.push_back(count);
+      out.intensity_min.push_back(with_intensity ? imin : nan);
+      out.intensity_max.push_back(with_intensity ? imax : nan);
+    }
+    scope.rows(out.size());
+    return out;
+  }
+
+  // Downsamples every scan, scans in parallel and the threads left over
+  // shared within each scan.
+  inline std::vector<VoxelCloud>
+  voxel_downsample_all(std::span<const std::span<const PointData>> scans,
+                       const VoxelGridOptions &options = {}) {
+    std::vector<VoxelCloud> out(scans.size());
+    if (scans.empty()) return out;
+    const size_t workers = resolve_workers({.workers = options.workers});
+    VoxelGridOptions inner = options;
+    inner.workers = std::max<size_t>(1, workers / scans.size());
+    parallel_for(scans.size(), [&](size_t i) { out[i] = voxel_downsample(scans[i], inner); },
+                 workers);
+    return out;
+  }
+
+  // Number of voxels occupied in both clouds, which must share a leaf size.
+  inline size_t shared_voxels(const VoxelCloud &a, const VoxelCloud &b) {
+    size_t n = 0;
+    for (size_t i = 0, j = 0; i < a.keys.size() && j < b.keys.size();) {
+      if (a.keys[i] < b.keys[j]) {
+        ++i;
+      } else if (b.keys[j] < a.keys[i]) {
+        ++j;
+      } else {
+        ++n, ++i, ++j;
+      }
+    }
+    return n;
+  }
+}
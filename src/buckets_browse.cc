@@ -1,10 +1,16 @@
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <ctime>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <reduct/client.h>
 #include <string>
 #include "../include/common.h"
+#include "../include/inventory.h"
+#include "../include/replay.h"
+#include "../include/utilities.h"
 
 using reduct::Error;
 using reduct::IClient;
@@ -16,7 +22,81 @@ static std::string PrintTime(std::chrono::system_clock::time_point tp) {
   return buf;
 }
 
-int main() {
+static std::string PrintDuration(int64_t us) {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(us < 1'000'000 ? 1 : 2);
+  if (us < 1'000'000) {
+    out << double(us) / 1e3 << " ms";
+  } else {
+    out << double(us) / 1e6 << " s";
+  }
+  return out.str();
+}
+
+// Profiles every entry with head-only queries and prints its timing.
+static int PrintInventory(const std::vector<reduct::IBucket::EntryInfo> &entries,
+                          const common::InventoryOptions &options) {
+  const auto t0 = std::chrono::steady_clock::now();
+  auto results = common::scan_inventory(common::connect_source, entries, options);
+  const double elapsed =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  int status = 0;
+  std::cout << "\nInventory (" << std::fixed << std::setprecision(2) << elapsed << " s):\n";
+  for (const auto &[inv, err] : results) {
+    if (err != Error::kOk) {
+      std::cerr << "  - " << inv.name << ": " << err.message << "\n";
+      status = 1;
+      continue;
+    }
+    std::cout << "  - " << inv.name << (inv.from_cache ? " (cached)" : "") << "\n"
+              << std::setprecision(1) << "      " << inv.records << " records, "
+              << inv.rate() << " rec/s, " << inv.bytes_per_second() / 1024.0 << " KiB/s"
+              << ", peak " << inv.peak_records << " per "
+              << PrintDuration(options.burst_window_us) << "\n"
+              << "      size p50/p99 " << inv.sizes.quantile(0.5) << "/"
+              << inv.sizes.quantile(0.99) << " B, inter-arrival p50/p99 "
+              << PrintDuration(int64_t(inv.inter_arrival.quantile(0.5))) << "/"
+              << PrintDuration(int64_t(inv.inter_arrival.quantile(0.99))) << "\n"
+              << "      " << inv.gap_count << " gaps >= " << PrintDuration(options.min_gap_us)
+              << ", " << PrintDuration(inv.gap_us) << " in total";
+    if (inv.out_of_order) std::cout << ", " << inv.out_of_order << " out of order";
+    std::cout << "\n";
+    auto longest = inv.gaps;
+    std::sort(longest.begin(), longest.end(), [](const auto &a, const auto &b) {
+      return a.length_us() > b.length_us();
+    });
+    for (size_t i = 0; i < std::min<size_t>(longest.size(), 3); ++i) {
+      std::cout << "        " << PrintDuration(longest[i].length_us()) << " after "
+                << PrintTime(std::chrono::system_clock::time_point(
+                       std::chrono::microseconds(longest[i].start_us)))
+                << "\n";
+    }
+  }
+  return status;
+}
+
+// Lists the entries of the bucket. With --inventory, also scans each one
+// (concurrently, metadata only) for rate, size and inter-arrival profiles
+// and gaps; the result is cached until the entry changes, --refresh scans
+// anyway.
+//
+//   buckets_browse [--inventory] [--refresh] [--min-gap=SEC] [--workers=N]
+int main(int argc, char **argv) {
+  common::profile::init(argc, argv);
+  common::InventoryOptions options;
+  options.refresh = common::has_flag(argc, argv, "--refresh");
+  const auto min_gap_s = common::number_flag(argc, argv, "--min-gap=",
+                                             double(options.min_gap_us) / 1e6, 1e-6, 1e9);
+  const auto workers = common::count_flag(argc, argv, "--workers=", options.workers, 0, 1024);
+  if (!min_gap_s || !workers) {
+    std::cerr << "usage: " << argv[0]
+              << " [--inventory] [--refresh] [--min-gap=SEC] [--workers=N]\n";
+    return 2;
+  }
+  options.min_gap_us = int64_t(*min_gap_s * 1e6);
+  options.workers = *workers;
+
   auto client = IClient::Build(common::URL, {.api_token = common::TOKEN});
 
   auto [bucket, b_err] = client->GetBucket(common::BUCKET);
@@ -32,5 +112,9 @@ int main() {
               << " | oldest=" << PrintTime(e.oldest_record)
               << " | latest=" << PrintTime(e.latest_record) << "\n";
   }
-  return 0;
+
+  int status = 0;
+  if (common::has_flag(argc, argv, "--inventory")) status = PrintInventory(entries, options);
+  common::profile::report();
+  return status;
 }
@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+#include "../include/columnar_export.h"
+#include "../include/predicate.h"
+#include "../include/utilities.h"
+
+// Prints the columns of an export written with --export= and, for a time
+// range, the rows read straight from the mapping, optionally filtered by a
+// `when` condition over the file's columns.
+//
+//   columnar_dump FILE [--from=ISO] [--to=ISO] [--rows=10] [--when=JSON]
+int main(int argc, char **argv) {
+  common::profile::init(argc, argv);
+  if (argc < 2 || std::string_view(argv[1]).starts_with("--")) {
+    std::cerr << "usage: " << argv[0]
+              << " FILE [--from=ISO] [--to=ISO] [--rows=10] [--when=JSON]\n";
+    return 2;
+  }
+
+  // No --from / --to means the whole file.
+  using Time = common::Time;
+  const auto from = common::time_flag(argc, argv, "--from=", Time::min());
+  const auto to = common::time_flag(argc, argv, "--to=", Time::max());
+  const auto max_rows = common::count_flag(argc, argv, "--rows=", 10);
+  if (!from || !to || !max_rows) {
+    std::cerr << "usage: " << argv[0]
+              << " FILE [--from=ISO] [--to=ISO] [--rows=10] [--when=JSON]\n";
+    return 2;
+  }
+  const int64_t from_ns = *from == Time::min() ? std::numeric_limits<int64_t>::min()
+                                               : from->time_since_epoch().count() * 1000;
+  const int64_t to_ns = *to == Time::max() ? std::numeric_limits<int64_t>::max()
+                                           : to->time_since_epoch().count() * 1000;
+
+  auto reader = common::ColumnarReader::open(argv[1]);
+  if (!reader) {
+    std::cerr << "Not a columnar export: " << argv[1] << "\n";
+    return 1;
+  }
+
+  const auto &columns = reader->columns();
+  std::cout << "=== " << argv[1] << " ===\n";
+  std::cout << reader->rows() << " rows in " << reader->n_blocks() << " blocks\n";
+  for (size_t c = 0; c < columns.size(); ++c) {
+    const auto &range = reader->range(c);
+    std::cout << "  " << std::setw(12) << columns[c].name << std::setw(9)
+              << (columns[c].type == common::ColumnType::kInt64     ? "int64"
+                  : columns[c].type == common::ColumnType::kFloat64 ? "float64"
+                                                                    : "float32")
+              << "  [" << std::setprecision(17) << range.min << ", " << range.max
+              << "]\n";
+  }
+
+  std::optional<common::Predicate> predicate;
+  if (auto when = common::flag_value(argc, argv, "--when=")) {
+    std::vector<std::string> names;
+    for (const auto &col : columns) names.push_back(col.name);
+    std::string error;
+    predicate = common::Predicate::compile(*when, names, &error);
+    if (!predicate) {
+      std::cerr << "Bad --when: " << error << "\n";
+      return 2;
+    }
+  }
+
+  const auto t0 = std::chrono::steady_clock::now();
+  const auto slices = reader->slices(from_ns, to_ns);
+  size_t total = 0;
+  for (const auto &s : slices) total += s.size();
+  std::cout << "\n" << total << " rows in range from " << slices.size()
+            << " blocks, located in " << std::fixed << std::setprecision(3)
+            << std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0)
+                   .count()
+            << " us\n";
+
+  for (const auto &col : columns) std::cout << std::setw(22) << col.name;
+  std::cout << "\n" << std::setprecision(6);
+  size_t shown = 0, matched = 0;
+  std::vector<std::vector<double>> values(columns.size());
+  std::vector<const double *> pointers(columns.size());
+  std::vector<uint8_t> mask;
+  for (const auto &s : slices) {
+    if (!predicate && shown >= *max_rows) break;
+    for (size_t c = 0; c < columns.size(); ++c) {
+      reader->read_doubles(s.block, c, s.begin, s.end, values[c]);
+      pointers[c] = values[c].data();
+    }
+    mask.assign(s.size(), 1);
+    if (predicate) predicate->evaluate(pointers, s.size(), mask.data());
+    for (size_t i = 0; i < s.size(); ++i) {
+      if (!mask[i]) continue;
+      ++matched;
+      if (shown++ >= *max_rows) continue;
+      for (size_t c = 0; c < columns.size(); ++c) {
+        std::cout << std::setw(22);
+        if (columns[c].type == common::ColumnType::kInt64) {
+          std::cout << reader->values<int64_t>(s.block, c)[s.begin + i];
+        } else {
+          std::cout << values[c][i];
+        }
+      }
+      std::cout << "\n";
+    }
+  }
+  if (predicate) std::cout << matched << " of " << total << " rows match --when\n";
+
+  common::profile::report();
+  return 0;
+}
@@ -1,55 +1,85 @@
 #include <cassert>
-#include <filesystem>
-#include <fstream>
 #include <iostream>
 #include <reduct/client.h>
 #include <string>
+#include "../include/arena.h"
 #include "../include/common.h"
+#include "../include/frame_writer.h"
+#include "../include/replay.h"
 #include "../include/utilities.h"
 
 using reduct::Error;
 using reduct::IBucket;
-using reduct::IClient;
 
-int main() {
+// Saves a few camera frames to img/ through the async frame writer, with a
+// manifest. --queue= is the writer's queue depth and --fsync= when frames
+// are flushed to disk: not at all, after each file, or once on close.
+//
+//   extract_images_save [--queue=16] [--fsync=none|each|close]
+int main(int argc, char **argv) {
+  common::profile::init(argc, argv);
   constexpr const char *ENTRY = "raw__rsense_color_image_raw_compressed";
   constexpr int MAX_FRAMES = 5;
 
+  common::FrameWriterOptions writer_options{.dir = "img"};
+  const auto queue = common::count_flag(argc, argv, "--queue=", writer_options.queue_depth, 1,
+                                        4096);
+  const auto fsync = common::flag_value(argc, argv, "--fsync=").value_or("none");
+  const bool known_fsync = fsync == "none" || fsync == "each" || fsync == "close";
+  if (!known_fsync) std::cerr << "Bad --fsync=" << fsync << "\n";
+  if (!queue || !known_fsync) {
+    std::cerr << "usage: " << argv[0] << " [--queue=16] [--fsync=none|each|close]\n";
+    return 2;
+  }
+  writer_options.queue_depth = *queue;
+  writer_options.fsync = fsync == "each"    ? common::FsyncPolicy::kEachFile
+                         : fsync == "close" ? common::FsyncPolicy::kOnClose
+                                            : common::FsyncPolicy::kNone;
+
   auto start_time = common::parse_time(common::START_STR);
   auto stop_time = common::parse_time(common::STOP_STR);
 
   const std::string when = std::string(R"({"$each_t":"5s","$limit":)") +
                            std::to_string(MAX_FRAMES) + "}";
 
-  auto client = IClient::Build(common::URL, {.api_token = common::TOKEN});
-  auto [bucket, b_err] = client->GetBucket(common::BUCKET);
-  assert(b_err == Error::kOk);
+  auto bucket = common::connect_source();
+  assert(bucket);
 
-  std::filesystem::create_directories("img");
+  common::AsyncFrameWriter writer(writer_options);
 
   int idx = 0;
   auto q_err = bucket->Query(
       ENTRY, start_time, stop_time, {.when = when},
       [&](const IBucket::ReadableRecord &rec) {
-        auto [blob, r_err] = rec.ReadAll();
+        common::profile::Scope scope("query.record");
+        scope.bytes(rec.size);
+        std::string blob = writer.acquire_blob();
+        auto r_err = common::read_blob(rec, blob);
         assert(r_err == Error::kOk);
 
         std::string ext = (rec.content_type.find("png") != std::string::npos)
                               ? ".png"
                               : ".jpg";
-        std::string fname = "img/frame_" + std::to_string(idx++) + ext;
-
-        std::ofstream of(fname, std::ios::binary);
-        of.write(blob.data(), static_cast<std::streamsize>(blob.size()));
-        of.close();
+        std::string fname = "frame_" + std::to_string(idx++) + ext;
 
-        std::cout << "Saved " << fname
+        std::cout << "Saving img/" << fname
                   << " | ts=" << rec.timestamp.time_since_epoch().count()
                   << " | size=" << rec.size
                   << " | content_type=" << rec.content_type << "\n";
+
+        writer.submit({.name = std::move(fname),
+                       .blob = std::move(blob),
+                       .ts_us = rec.timestamp.time_since_epoch().count(),
+                       .content_type = rec.content_type});
         return true;
       });
 
   assert(q_err == Error::kOk);
-  return 0;
+
+  bool ok = writer.close();
+  std::cout << "Saved " << writer.written() << " frames, manifest: "
+            << writer.manifest_path().string() << "\n";
+  if (!ok) std::cerr << "Failed to write " << writer.failed() << " frame(s)\n";
+  common::profile::report();
+  return ok ? 0 : 1;
 }
@@ -3,21 +3,26 @@
 #include <cstdint>
 #include <iomanip>
 #include <iostream>
-#include <nlohmann/json.hpp>
 #include <numeric>
 #include <reduct/client.h>
 #include <string>
 #include <vector>
+#include "../include/columnar_export.h"
 #include "../include/common.h"
 #include "../include/data_structures.h"
+#include "../include/json_decoder.h"
+#include "../include/mcap.h"
+#include "../include/parallel_query.h"
+#include "../include/pipeline.h"
+#include "../include/replay.h"
+#include "../include/streaming.h"
 #include "../include/utilities.h"
 
 using reduct::Error;
 using reduct::IBucket;
-using reduct::IClient;
-using json = nlohmann::json;
 
-int main() {
+int main(int argc, char **argv) {
+  common::profile::init(argc, argv);
   constexpr const char *MCAP_ENTRY = "mcap";
   constexpr const char *IMU_TOPIC = "/vectornav/IMU_restamped";
 
@@ -32,39 +37,76 @@ int main() {
   std::cout << "MCAP Entry: " << MCAP_ENTRY << "\n";
   std::cout << "IMU Topic: " << IMU_TOPIC << "\n\n";
 
-  auto client = IClient::Build(common::URL, {.api_token = common::TOKEN});
-  auto [bucket, b_err] = client->GetBucket(common::BUCKET);
-  assert(b_err == Error::kOk);
-
-  std::vector<common::AccelerationData> df_ros;
-
-  std::cout << "Processing ROS messages from MCAP...\n";
-
-  auto q_err = bucket->Query(
-      MCAP_ENTRY, start_time, stop_time, {.ext = ext},
-      [&](const IBucket::ReadableRecord &rec) {
-        auto [blob, r_err] = rec.ReadAll();
-        assert(r_err == Error::kOk);
-
-        auto data = json::parse(blob);
-
-        int64_t sec = data["header"]["stamp"]["sec"].get<int64_t>();
-        int64_t nsec = data["header"]["stamp"]["nanosec"].get<int64_t>();
-        int64_t ts_ns = sec * 1'000'000'000LL + nsec;
-
-        double ax = data["linear_acceleration"]["x"].get<double>();
-        double ay = data["linear_acceleration"]["y"].get<double>();
-        double az = data["linear_acceleration"]["z"].get<double>();
-
-        common::AccelerationData row = {ts_ns, ax, ay, az};
-        df_ros.push_back(row);
-
-        if (df_ros.size() % 100 == 0) {
-          std::cout << "  Processed " << df_ros.size() << " messages...\n";
-        }
-
-        return true;
-      });
+  const bool pipelined = common::has_flag(argc, argv, "--pipeline");
+  // --native reads the raw MCAP records and decodes the CDR messages here,
+  // instead of having the server convert every message to JSON.
+  const bool native = common::has_flag(argc, argv, "--native");
+  std::cout << "Processing ROS messages from MCAP"
+            << (pipelined ? " (pipelined)" : "") << (native ? " (native CDR)" : "")
+            << "...\n";
+  const IBucket::QueryOptions options =
+      native ? IBucket::QueryOptions{} : IBucket::QueryOptions{.ext = ext};
+
+  auto report = [](IBucket::Time ts, const common::JsonDecodeResult &res) {
+    if (res.status != common::JsonStatus::kOk) {
+      std::cerr << "Error decoding message " << ts.time_since_epoch().count()
+                << ": " << common::to_string(res.status) << "\n";
+    }
+  };
+
+  auto decode_mcap = [&](IBucket::Time ts, std::string_view blob,
+                         common::AccelerationFrame &rows) {
+    thread_local common::McapReader reader({IMU_TOPIC});
+    auto res = common::decode_mcap_imu(
+        blob, reader,
+        [&](const common::AccelerationData &row) { rows.push_back(row); });
+    if (res.status != common::McapStatus::kOk || res.bad_messages > 0) {
+      std::cerr << "Error decoding record " << ts.time_since_epoch().count() << ": "
+                << common::to_string(res.status) << ", " << res.bad_messages
+                << " message(s) not CDR sensor_msgs/msg/Imu\n";
+    }
+  };
+
+  auto [df_ros, q_err] =
+      pipelined
+          ? common::query_pipelined<common::AccelerationFrame>(
+                common::connect_source, MCAP_ENTRY, start_time, stop_time,
+                options,
+                [&](const common::PipelineItem &item,
+                    common::AccelerationFrame &rows) {
+                  if (native) {
+                    decode_mcap(item.timestamp, item.blob, rows);
+                    return;
+                  }
+                  auto res = common::decode_json(
+                      item.blob, common::ros_imu_schema(),
+                      [&](const common::AccelerationData &row) {
+                        rows.push_back(row);
+                      });
+                  report(item.timestamp, res);
+                })
+          : common::query_sharded<common::AccelerationFrame>(
+                common::connect_source, MCAP_ENTRY, start_time, stop_time,
+                options,
+                [&](const IBucket::ReadableRecord &rec,
+                    common::AccelerationFrame &rows) {
+                  if (native) {
+                    // The reader needs the whole file to walk its chunks.
+                    thread_local std::string blob;
+                    auto r_err = common::read_blob(rec, blob);
+                    assert(r_err == Error::kOk);
+                    decode_mcap(rec.timestamp, blob, rows);
+                    return true;
+                  }
+                  auto [res, r_err] = common::stream_json(
+                      rec, common::ros_imu_schema(),
+                      [&](const common::AccelerationData &row) {
+                        rows.push_back(row);
+                      });
+                  assert(r_err == Error::kOk);
+                  report(rec.timestamp, res);
+                  return true;
+                });
 
   assert(q_err == Error::kOk);
 
@@ -72,14 +114,14 @@ int main() {
   std::cout << "Total ROS messages extracted: " << df_ros.size() << "\n";
 
   if (!df_ros.empty()) {
-    std::sort(
-        df_ros.begin(), df_ros.end(),
-        [](const common::AccelerationData &a, const common::AccelerationData &b) { return a.ts_ns < b.ts_ns; });
+    df_ros.sort_by_time();
+    common::export_frame_if_requested(argc, argv, df_ros);
     common::print_dataframe_head(df_ros);
     common::print_dataframe_stats(df_ros);
   } else {
     std::cout << "\nNo ROS messages found for topic: " << IMU_TOPIC << "\n";
   }
 
+  common::profile::report();
   return 0;
 }
@@ -2,68 +2,50 @@
 #include <cassert>
 #include <chrono>
 #include <cmath>
-#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <reduct/client.h>
 #include <string>
 #include <vector>
+#include "../include/arena.h"
+#include "../include/columnar_export.h"
 #include "../include/common.h"
+#include "../include/parallel_query.h"
+#include "../include/pointcloud.h"
+#include "../include/replay.h"
 #include "../include/utilities.h"
+#include "../include/voxel_grid.h"
 
 using reduct::Error;
 using reduct::IBucket;
-using reduct::IClient;
-
-struct PointData {
-  float x;
-  float y;
-  float z;
-  float intensity;
-};
 
 struct ScanData {
-  std::vector<PointData> points;
-  std::map<std::string, std::string> labels;
+  std::string blob;
   reduct::IBucket::Time timestamp;
+  common::PointLayout layout;
 };
 
-std::vector<PointData> to_xyz(const std::string &blob) {
-  std::vector<PointData> points;
-  const size_t point_size = sizeof(PointData);
-  const size_t num_points = blob.size() / point_size;
-
-  points.reserve(num_points);
-
-  const unsigned char *bytes =
-      reinterpret_cast<const unsigned char *>(blob.data());
-  for (size_t i = 0; i < num_points; ++i) {
-    const unsigned char *p = bytes + i * point_size;
-    PointData point;
-    std::memcpy(&point.x, p + 0, 4);
-    std::memcpy(&point.y, p + 4, 4);
-    std::memcpy(&point.z, p + 8, 4);
-    std::memcpy(&point.intensity, p + 12, 4);
-    points.push_back(point);
-  }
-
-  return points;
-}
-
-int main() {
+int main(int argc, char **argv) {
+  common::profile::init(argc, argv);
   constexpr const char *ENTRY =
       "raw__os_node_segmented_point_cloud_no_destagger";
   constexpr int MAX_SCANS = 4;
 
+  // 0 (no --leaf) keeps the full clouds.
+  const auto leaf = common::number_flag(argc, argv, "--leaf=", 0.0, 1e-4, 1e4);
+  if (!leaf) {
+    std::cerr << "usage: " << argv[0] << " [--leaf=METERS] [--export=FILE]\n";
+    return 2;
+  }
+
   auto start_time = common::parse_time(common::START_STR);
   auto stop_time = common::parse_time(common::STOP_STR);
 
   const std::string when = std::string(R"({"$each_t":"5s","$limit":)") +
                            std::to_string(MAX_SCANS) + "}";
 
-  auto client = IClient::Build(common::URL, {.api_token = common::TOKEN});
-  auto [bucket, b_err] = client->GetBucket(common::BUCKET);
-  assert(b_err == Error::kOk);
+  auto bucket = common::connect_source();
+  assert(bucket);
 
   std::vector<ScanData> scan_data;
   std::cout << "Fetching " << MAX_SCANS
@@ -72,19 +54,26 @@ int main() {
   auto q_err =
       bucket->Query(ENTRY, start_time, stop_time, {.when = when},
                     [&](const IBucket::ReadableRecord &rec) {
-                      auto [blob, r_err] = rec.ReadAll();
-                      assert(r_err == Error::kOk);
-
+                      common::profile::Scope scope("query.record");
+                      scope.bytes(rec.size);
                       ScanData scan;
-                      scan.points = to_xyz(blob);
-                      scan.labels = rec.labels;
+                      auto r_err = common::read_blob(rec, scan.blob);
+                      assert(r_err == Error::kOk);
                       scan.timestamp = rec.timestamp;
+                      if (auto layout = common::PointLayout::from_labels(rec.labels)) {
+                        scan.layout = *layout;
+                      } else {
+                        std::cerr << "Unreadable point layout labels, assuming packed "
+                                     "{x, y, z, intensity}\n";
+                      }
 
                       scan_data.push_back(std::move(scan));
 
+                      const auto &loaded = scan_data.back();
                       std::cout << "Loaded scan " << scan_data.size() << ": "
-                                << scan.points.size() << " points, timestamp: "
-                                << scan.timestamp.time_since_epoch().count()
+                                << loaded.blob.size() / loaded.layout.point_step
+                                << " points, timestamp: "
+                                << loaded.timestamp.time_since_epoch().count()
                                 << "\n";
 
                       return true;
@@ -109,54 +98,88 @@ int main() {
   std::cout << "Time range: " << std::fixed << std::setprecision(1)
             << rel_t.front() << "s to " << rel_t.back() << "s\n\n";
 
-  const int sample_step = 100;
+  // The views alias the blobs in scan_data, which stay put from here on.
+  std::vector<common::PointCloudView> clouds(scan_data.size());
+  std::vector<common::PointCloudStats> stats(scan_data.size());
+  common::parallel_for(scan_data.size(), [&](size_t i) {
+    common::profile::Scope scope("analyse");
+    scope.bytes(scan_data[i].blob.size());
+    clouds[i] = common::PointCloudView::from_blob(scan_data[i].blob, scan_data[i].layout);
+    stats[i] = common::point_cloud_stats(clouds[i].points());
+  });
+
+  // With --leaf=<m>, each scan is also reduced to one point per voxel; the
+  // reduced clouds are what --export= writes.
+  std::vector<common::VoxelCloud> voxels;
+  if (*leaf > 0) {
+    std::vector<std::span<const common::PointData>> spans;
+    for (const auto &cloud : clouds) spans.push_back(cloud.points());
+    voxels = common::voxel_downsample_all(spans, {.leaf = float(*leaf)});
+    std::cout << "=== Voxel grid, leaf " << *leaf << " ===\n";
+    for (size_t i = 0; i < voxels.size(); ++i) {
+      const auto &v = voxels[i];
+      std::cout << "Scan " << (i + 1) << ": " << v.input << " -> " << v.size()
+                << " voxels (" << std::setprecision(1) << v.ratio() << "x, "
+                << v.dropped << " dropped)";
+      if (i > 0) {
+        std::cout << ", " << std::setprecision(1)
+                  << 100.0 * double(common::shared_voxels(voxels[i - 1], v)) /
+                         double(std::max<size_t>(v.size(), 1))
+                  << "% shared with scan " << i;
+      }
+      std::cout << "\n";
+    }
+    std::cout << "\n";
+  }
+
+  if (auto path = common::flag_value(argc, argv, "--export=")) {
+    common::ColumnarWriter writer(*path, common::columnar::point_columns());
+    bool ok = true;
+    for (size_t i = 0; i < scan_data.size(); ++i) {
+      ok = common::append_scan(writer,
+                               scan_data[i].timestamp.time_since_epoch().count() * 1000,
+                               voxels.empty() ? clouds[i].points()
+                                              : std::span<const common::PointData>(
+                                                    voxels[i].points)) &&
+           ok;
+    }
+    ok = writer.close() && ok;
+    std::cout << (ok ? "Exported " : "Failed to export ") << writer.rows()
+              << " points to " << *path << "\n\n";
+  }
 
   for (size_t i = 0; i < scan_data.size(); ++i) {
-    const auto &scan = scan_data[i];
-    const auto &points = scan.points;
+    const auto points = clouds[i].points();
+    const auto &st = stats[i];
 
     std::cout << "Scan " << (i + 1) << " at t = " << std::fixed
               << std::setprecision(1) << rel_t[i] << "s:\n";
-    std::cout << "  Total points: " << points.size() << "\n";
-
-    std::vector<float> x_vals, y_vals, z_vals, intensity_vals;
-    for (size_t j = 0; j < points.size(); j += sample_step) {
-      const auto &pt = points[j];
-      if (!std::isnan(pt.x) && !std::isnan(pt.y) && !std::isnan(pt.z)) {
-        x_vals.push_back(pt.x);
-        y_vals.push_back(pt.y);
-        z_vals.push_back(pt.z);
-        intensity_vals.push_back(pt.intensity);
-      }
-    }
-
-    std::cout << "  Sampled points (every " << sample_step
-              << "th): " << points.size() / sample_step << " total, "
-              << x_vals.size() << " valid (non-NaN)\n";
-
-    if (!x_vals.empty()) {
-      auto [x_min, x_max] = std::minmax_element(x_vals.begin(), x_vals.end());
-      auto [y_min, y_max] = std::minmax_element(y_vals.begin(), y_vals.end());
-      auto [z_min, z_max] = std::minmax_element(z_vals.begin(), z_vals.end());
-      auto [i_min, i_max] =
-          std::minmax_element(intensity_vals.begin(), intensity_vals.end());
+    std::cout << "  Total points: " << st.total << ", " << st.valid
+              << " valid (non-NaN)\n";
 
+    if (st.valid > 0) {
       std::cout << "  X range: [" << std::fixed << std::setprecision(2)
-                << *x_min << ", " << *x_max << "]\n";
-      std::cout << "  Y range: [" << *y_min << ", " << *y_max << "]\n";
-      std::cout << "  Z range: [" << *z_min << ", " << *z_max << "]\n";
-      std::cout << "  Intensity range: [" << *i_min << ", " << *i_max << "]\n";
+                << st.min.x << ", " << st.max.x << "]\n";
+      std::cout << "  Y range: [" << st.min.y << ", " << st.max.y << "]\n";
+      std::cout << "  Z range: [" << st.min.z << ", " << st.max.z << "]\n";
+      std::cout << "  Intensity range: [" << st.min.intensity << ", "
+                << st.max.intensity << "]\n";
 
       std::cout << "  Sample points:\n";
-      for (size_t j = 0; j < std::min(size_t(5), x_vals.size()); ++j) {
-        std::cout << "    Point " << j * sample_step << ": "
-                  << "x=" << x_vals[j] << ", y=" << y_vals[j]
-                  << ", z=" << z_vals[j] << ", I=" << intensity_vals[j] << "\n";
+      size_t shown = 0;
+      for (size_t j = 0; j < points.size() && shown < 5; ++j) {
+        const auto &pt = points[j];
+        if (!common::is_valid_point(pt)) continue;
+        std::cout << "    Point " << j << ": "
+                  << "x=" << pt.x << ", y=" << pt.y << ", z=" << pt.z
+                  << ", I=" << pt.intensity << "\n";
+        ++shown;
       }
     }
 
     std::cout << "\n";
   }
 
+  common::profile::report();
   return 0;
 }
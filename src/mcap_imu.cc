@@ -0,0 +1,111 @@
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include "../include/columnar_export.h"
+#include "../include/data_structures.h"
+#include "../include/mcap.h"
+#include "../include/utilities.h"
+
+namespace {
+  // A synthetic 200 Hz IMU on `topic` and a 10 Hz string topic next to it.
+  std::string make_file(const std::string &topic, size_t messages,
+                        const std::string &compression, size_t chunk_size) {
+    common::mcap::Writer writer(compression, chunk_size);
+    if (writer.compression() != compression) {
+      std::cerr << "This build cannot write " << compression
+                << " chunks, writing them uncompressed\n";
+    }
+    const auto imu = writer.add_channel(
+        writer.add_schema("sensor_msgs/msg/Imu", "ros2msg", ""), topic, "cdr");
+    const auto status = writer.add_channel(
+        writer.add_schema("std_msgs/msg/String", "ros2msg", "string data"), "/status", "cdr");
+
+    const int64_t t0 = 1'710'000'000'000'000'000LL;
+    std::string msg;
+    for (size_t i = 0; i < messages; ++i) {
+      const double t = double(i) / 200.0;
+      const common::AccelerationData row{t0 + int64_t(i) * 5'000'000, 2.0 * std::sin(t),
+                                         0.5 * std::cos(3.0 * t), 9.81 + 0.1 * std::sin(7.0 * t)};
+      common::encode_cdr_imu(row, msg, "vectornav");
+      writer.write(imu, uint64_t(row.ts_ns), msg);
+      if (i % 20 == 0) {
+        writer.write(status, uint64_t(row.ts_ns), std::string("\0\1\0\0\3\0\0\0ok\0", 11));
+      }
+    }
+    return writer.finish();
+  }
+}
+
+// Decodes the IMU messages of a local MCAP file, or writes one to try it
+// with. The same decoder backs extract_mcap_ros_topic --native.
+//
+//   mcap_imu FILE [--topic=/imu] [--rows=5] [--export=FILE]
+//   mcap_imu --write=FILE [--topic=/imu] [--messages=100000]
+//            [--compression=lz4|zstd] [--chunk-kb=1024]
+int main(int argc, char **argv) {
+  common::profile::init(argc, argv);
+  const std::string topic(common::flag_value(argc, argv, "--topic=").value_or("/imu"));
+
+  const auto messages = common::count_flag(argc, argv, "--messages=", 100'000, 1, 100'000'000);
+  const auto chunk_kb = common::count_flag(argc, argv, "--chunk-kb=", 1024, 1, 1024 * 1024);
+  const auto rows = common::count_flag(argc, argv, "--rows=", 5);
+  const auto path = common::flag_value(argc, argv, "--write=");
+  const bool has_file = argc > 1 && !std::string_view(argv[1]).starts_with("--");
+  if (!messages || !chunk_kb || !rows || (!path && !has_file)) {
+    std::cerr << "usage: " << argv[0] << " FILE [--topic=/imu] [--rows=5] [--export=FILE]\n"
+              << "       " << argv[0] << " --write=FILE [--topic=/imu] [--messages=N]"
+              << " [--compression=lz4|zstd] [--chunk-kb=1024]\n";
+    return 2;
+  }
+
+  if (path) {
+    const std::string compression(common::flag_value(argc, argv, "--compression=").value_or(""));
+    const std::string file = make_file(topic, *messages, compression, *chunk_kb * 1024);
+    std::ofstream out(std::string(*path), std::ios::binary | std::ios::trunc);
+    out.write(file.data(), std::streamsize(file.size()));
+    if (!out) {
+      std::cerr << "Failed to write " << *path << "\n";
+      return 1;
+    }
+    std::cout << "Wrote " << file.size() << " bytes to " << *path << "\n";
+    return 0;
+  }
+
+  auto file = common::MappedFile::open(argv[1]);
+  if (!file) {
+    std::cerr << "Cannot open " << argv[1] << "\n";
+    return 1;
+  }
+
+  common::McapReader reader({topic});
+  common::AccelerationFrame frame;
+  const auto t0 = std::chrono::steady_clock::now();
+  auto res = common::decode_mcap_imu(
+      file->view(), reader, [&](const common::AccelerationData &row) { frame.push_back(row); });
+  const double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  const auto &stats = reader.stats();
+  std::cout << "=== " << argv[1] << " ===\n"
+            << "Status: " << common::to_string(res.status) << "\n"
+            << "Chunks: " << stats.chunks << " (" << stats.chunks_skipped
+            << " skipped), " << stats.decompressed_bytes << " bytes decompressed\n"
+            << "Messages on " << topic << ": " << res.messages << ", " << res.rows
+            << " rows, " << res.bad_messages << " not decodable\n"
+            << "Decoded in " << std::fixed << std::setprecision(3) << seconds * 1e3
+            << " ms (" << std::setprecision(1)
+            << double(file->view().size()) / seconds / (1024.0 * 1024.0) << " MiB/s)\n";
+
+  if (!frame.empty()) {
+    frame.sort_by_time();
+    common::export_frame_if_requested(argc, argv, frame);
+    common::print_dataframe_head(frame, *rows);
+    common::print_dataframe_stats(frame);
+  }
+
+  common::profile::report();
+  return res.status == common::McapStatus::kOk ? 0 : 1;
+}
@@ -0,0 +1,118 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <reduct/client.h>
+#include <string>
+#include "../include/common.h"
+#include "../include/lod.h"
+#include "../include/parallel_query.h"
+#include "../include/query_cache.h"
+#include "../include/replay.h"
+#include "../include/schema.h"
+#include "../include/streaming.h"
+#include "../include/utilities.h"
+
+using reduct::Error;
+using reduct::IBucket;
+
+// Builds (or reopens) the LOD pyramid of the CSV IMU entry and prints the
+// buckets a plot of `--pixels` columns would draw.
+//
+//   plot_lod [--pixels=1000] [--from=ISO] [--to=ISO] [--lttb] [--rebuild]
+int main(int argc, char **argv) {
+  common::profile::init(argc, argv);
+  constexpr const char *CSV_ENTRY = "csv__vectornav_IMU";
+
+  auto start_time = *common::parse_time(common::START_STR);
+  auto stop_time = *common::parse_time(common::STOP_STR);
+  const IBucket::QueryOptions options{
+      .ext = common::ImuSchema::select_ext(common::SelectFormat::kCsv)};
+
+  const auto pixels = common::count_flag(argc, argv, "--pixels=", 1000, 1, 1'000'000);
+  const auto zoom_start = common::time_flag(argc, argv, "--from=", start_time);
+  const auto zoom_stop = common::time_flag(argc, argv, "--to=", stop_time);
+  if (zoom_start && zoom_stop && *zoom_start >= *zoom_stop) {
+    std::cerr << "--from= must be before --to=\n";
+  }
+  if (!pixels || !zoom_start || !zoom_stop || *zoom_start >= *zoom_stop) {
+    std::cerr << "usage: " << argv[0]
+              << " [--pixels=1000] [--from=ISO] [--to=ISO] [--lttb] [--rebuild]\n";
+    return 2;
+  }
+
+  // Kept next to the cached segments of the same query.
+  const auto path = common::cache_entry_dir(common::cache_root(), CSV_ENTRY, options) /
+                    (std::to_string(start_time.time_since_epoch().count()) + "-" +
+                     std::to_string(stop_time.time_since_epoch().count()) + ".lod");
+
+  std::cout << "=== C++ LOD Pyramid (Proof of Concept) ===\n";
+  std::cout << "CSV Entry: " << CSV_ENTRY << "\n";
+  std::cout << "Pyramid: " << path.string() << "\n\n";
+
+  const auto t0 = std::chrono::steady_clock::now();
+  std::optional<common::LodPyramid> pyramid;
+  if (!common::has_flag(argc, argv, "--rebuild")) pyramid = common::LodPyramid::load(path);
+
+  if (pyramid) {
+    std::cout << "Loaded " << pyramid->size() << " rows";
+  } else {
+    auto [built, q_err] = common::query_sharded<common::LodPyramid>(
+        common::connect_source, CSV_ENTRY, start_time, stop_time, options,
+        [](const IBucket::ReadableRecord &rec, common::LodPyramid &lod) {
+          auto [res, r_err] = common::stream_csv(
+              rec, common::ImuSchema{}, true,
+              [&](const common::AccelerationData &row) { lod.add(row); },
+              [](size_t, std::string_view, common::CsvStatus) {});
+          return r_err == Error::kOk;
+        });
+    if (q_err != Error::kOk) {
+      std::cerr << "Query failed: " << q_err.message << "\n";
+      return 1;
+    }
+    pyramid = std::move(built);
+    if (!pyramid->save(path)) std::cerr << "Failed to save " << path << "\n";
+    std::cout << "Built from " << pyramid->size() << " rows";
+  }
+  pyramid->finish();
+  std::cout << " in " << std::fixed << std::setprecision(2)
+            << std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now() - t0)
+                   .count()
+            << " ms\n";
+
+  for (size_t k = 0; k < pyramid->n_levels(); ++k) {
+    const auto &level = pyramid->level(k);
+    std::cout << "  level " << std::setw(2) << k << ": width "
+              << std::setw(12) << level.width_ns / 1000 << " us, "
+              << level.index.size() << " buckets\n";
+  }
+
+  const int64_t from_ns = zoom_start->time_since_epoch().count() * 1000;
+  const int64_t to_ns = zoom_stop->time_since_epoch().count() * 1000;
+
+  if (common::has_flag(argc, argv, "--lttb")) {
+    auto [ts, values] = pyramid->lttb_view(from_ns, to_ns, *pixels, 0);
+    std::cout << "\n=== LTTB acc_x, " << ts.size() << " points ===\n";
+    for (size_t i = 0; i < std::min<size_t>(ts.size(), 10); ++i) {
+      std::cout << std::setw(22) << ts[i] << std::setw(14) << std::setprecision(6)
+                << values[i] << "\n";
+    }
+  } else {
+    auto view = pyramid->view(from_ns, to_ns, *pixels);
+    std::cout << "\n=== " << view.size() << " buckets from level " << view.level
+              << " (" << view.width_ns / 1000 << " us) for " << *pixels
+              << " pixels ===\n";
+    std::cout << std::setw(22) << "bucket_ns" << std::setw(8) << "count"
+              << std::setw(14) << "acc_x min" << std::setw(14) << "acc_x mean"
+              << std::setw(14) << "acc_x max" << "\n";
+    for (size_t b = 0; b < std::min<size_t>(view.size(), 10); ++b) {
+      const auto &x = view.stats[b * view.n_columns];
+      std::cout << std::setw(22) << view.ts_ns[b] << std::setw(8) << view.count[b]
+                << std::setprecision(6) << std::setw(14) << x.min << std::setw(14)
+                << view.mean(b, 0) << std::setw(14) << x.max << "\n";
+    }
+  }
+
+  common::profile::report();
+  return 0;
+}
@@ -0,0 +1,110 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <nlohmann/json.hpp>
+#include "../include/common.h"
+#include "../include/job_runner.h"
+#include "../include/replay.h"
+#include "../include/utilities.h"
+
+namespace {
+  // The queries of the extract_* examples, as one batch.
+  std::string default_jobs() {
+    nlohmann::json start = common::START_STR, stop = common::STOP_STR;
+    return nlohmann::json::array({
+        {{"name", "csv"}, {"entry", "csv__vectornav_IMU"}, {"sink", "csv"},
+         {"when", {{"$gt", {{{"$abs", {"@acc_x"}}}, 10}}}}, {"start", start}, {"stop", stop}},
+        {{"name", "json"}, {"entry", "json__vectornav_IMU"}, {"sink", "json"},
+         {"when", {{"@acc_z", {{"$lt", -5}}}}}, {"start", start}, {"stop", stop}},
+        {{"name", "mcap"}, {"entry", "mcap"}, {"sink", "ros"},
+         {"topic", "/vectornav/IMU_restamped"}, {"start", start}, {"stop", stop}},
+        {{"name", "images"}, {"entry", "raw__rsense_color_image_raw_compressed"},
+         {"sink", "files"}, {"output", "img"}, {"when", {{"$each_t", "5s"}, {"$limit", 5}}},
+         {"start", start}, {"stop", stop}},
+        {{"name", "pointcloud"}, {"entry", "raw__os_node_segmented_point_cloud_no_destagger"},
+         {"sink", "points"}, {"when", {{"$each_t", "5s"}, {"$limit", 4}}}, {"start", start},
+         {"stop", stop}},
+    }).dump();
+  }
+}
+
+// Runs a batch of extraction jobs over one shared client and connection
+// pool. JOBS is a JSON job list (see common::parse_jobs); without it the
+// queries of the extract_* examples run as one batch.
+//
+//   run_jobs [JOBS] [--max-queries=4] [--max-bytes-mb=64]
+int main(int argc, char **argv) {
+  common::profile::init(argc, argv);
+
+  common::JobRunnerOptions options;
+  const auto max_queries =
+      common::count_flag(argc, argv, "--max-queries=", options.max_queries, 1, 256);
+  const auto max_mb = common::count_flag(argc, argv, "--max-bytes-mb=",
+                                         options.max_bytes_in_flight / (1024 * 1024), 1,
+                                         1024 * 1024);
+  if (!max_queries || !max_mb) {
+    std::cerr << "usage: " << argv[0] << " [JOBS] [--max-queries=4] [--max-bytes-mb=64]\n";
+    return 2;
+  }
+  options.max_queries = *max_queries;
+  options.max_bytes_in_flight = *max_mb * 1024 * 1024;
+
+  std::string text;
+  if (argc > 1 && !std::string_view(argv[1]).starts_with("--")) {
+    std::ifstream in(argv[1]);
+    if (!in) {
+      std::cerr << "Cannot read " << argv[1] << "\n";
+      return 2;
+    }
+    text.assign(std::istreambuf_iterator<char>(in), {});
+  } else {
+    text = default_jobs();
+  }
+
+  std::string error;
+  auto list = nlohmann::json::parse(text, nullptr, false);
+  auto jobs = common::parse_jobs(list, &error);
+  if (list.is_discarded() || !jobs) {
+    std::cerr << "Bad job list: " << (list.is_discarded() ? "invalid JSON" : error) << "\n";
+    return 2;
+  }
+
+
+  std::cout << "=== C++ Batch Extraction (Proof of Concept) ===\n";
+  std::cout << jobs->size() << " jobs, up to "
+            << std::max<size_t>(1, std::min(options.max_queries, jobs->size())) << " at once, "
+            << options.max_bytes_in_flight / (1024 * 1024) << " MiB in flight\n\n";
+
+  auto run = common::run_jobs(common::connect_source, *jobs, options);
+
+  std::cout << std::setw(14) << "job" << std::setw(10) << "records" << std::setw(12)
+            << "MiB" << std::setw(12) << "rows" << std::setw(10) << "start s"
+            << std::setw(10) << "took s" << "\n";
+  double total_s = 0;
+  int status = 0;
+  for (const auto &job : run.jobs) {
+    std::cout << std::setw(14) << job.name;
+    if (job.error != reduct::Error::kOk) {
+      std::cout << "  failed: " << job.error.message << "\n";
+      status = 1;
+      continue;
+    }
+    total_s += job.seconds;
+    std::cout << std::setw(10) << job.records << std::setw(12) << std::fixed
+              << std::setprecision(2) << double(job.bytes) / (1024.0 * 1024.0)
+              << std::setw(12) << job.rows << std::setw(10) << job.started_s
+              << std::setw(10) << job.seconds;
+    if (job.bad_rows) std::cout << "  (" << job.bad_rows << " bad)";
+    std::cout << "\n";
+  }
+  std::cout << "\nWall time " << run.seconds << " s for " << total_s
+            << " s of jobs, " << run.connections << " connection(s), peak "
+            << double(run.peak_bytes_in_flight) / (1024.0 * 1024.0) << " MiB in flight";
+  if (run.byte_waits) std::cout << ", " << run.byte_waits << " waits for the byte budget";
+  std::cout << "\n";
+
+  common::profile::report();
+  return status;
+}
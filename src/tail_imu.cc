@@ -0,0 +1,126 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <iomanip>
+#include <iostream>
+#include <reduct/client.h>
+#include <string>
+#include <thread>
+#include "../include/common.h"
+#include "../include/live_tail.h"
+#include "../include/replay.h"
+#include "../include/schema.h"
+#include "../include/streaming.h"
+#include "../include/utilities.h"
+
+using reduct::Error;
+using reduct::IBucket;
+
+namespace {
+  std::atomic<bool> g_stop{false};
+
+  void print_stats(const common::LiveTail &tail) {
+    static constexpr const char *kNames[] = {"acc_x", "acc_y", "acc_z"};
+    std::cout << "[" << tail.total() << " samples, " << tail.window_size()
+              << " in window]";
+    for (size_t c = 0; c < 3; ++c) {
+      const auto s = tail.stats(c);
+      std::cout << "  " << kNames[c] << " " << std::fixed << std::setprecision(3)
+                << s.min << "/" << s.mean << "/" << s.max << " sd " << s.stddev;
+    }
+    std::cout << "\n";
+  }
+}
+
+// Follows the CSV IMU entry by polling it and keeps rolling stats
+// of the last --window seconds, printing them every --every seconds and an
+// event whenever |acc_x| crosses --threshold. Runs until Ctrl-C or
+// --duration seconds.
+//
+//   tail_imu [--from=ISO] [--window=5] [--threshold=10] [--every=1]
+//            [--capacity=65536] [--duration=SEC]
+int main(int argc, char **argv) {
+  common::profile::init(argc, argv);
+  constexpr const char *CSV_ENTRY = "csv__vectornav_IMU";
+
+  const auto window_s = common::number_flag(argc, argv, "--window=", 5.0, 1e-3, 1e6);
+  const auto threshold = common::number_flag(argc, argv, "--threshold=", 10.0);
+  const auto every_s = common::number_flag(argc, argv, "--every=", 1.0, 0);
+  const auto duration_s = common::number_flag(argc, argv, "--duration=", 0.0, 0);
+  const auto capacity = common::count_flag(argc, argv, "--capacity=", 64 * 1024, 1, 1 << 30);
+  const auto start = common::time_flag(
+      argc, argv, "--from=",
+      std::chrono::time_point_cast<std::chrono::microseconds>(std::chrono::system_clock::now()));
+  if (!window_s || !threshold || !every_s || !duration_s || !capacity || !start) {
+    std::cerr << "usage: " << argv[0] << " [--from=ISO] [--window=5] [--threshold=10]"
+              << " [--every=1] [--capacity=65536] [--duration=SEC]\n";
+    return 2;
+  }
+  common::TailOptions tail_options;
+  tail_options.start = *start;
+
+  std::cout << "=== C++ Live IMU Tail (Proof of Concept) ===\n";
+  std::cout << "CSV Entry: " << CSV_ENTRY << "\n";
+  std::cout << "Window: " << *window_s << " s, event: |acc_x| > " << *threshold << "\n\n";
+
+  common::LiveTail tail(
+      {.capacity = *capacity, .window_ns = int64_t(*window_s * 1e9)},
+      {{"|acc_x|", 0, common::ThresholdOp::kAbsGreater, *threshold}},
+      [&](const common::ThresholdEvent &e) {
+        const auto &rule = tail.rules()[e.rule];
+        if (e.kind == common::ThresholdEvent::kEnter) {
+          std::cout << e.ts_ns << "  " << rule.name << " > " << rule.threshold
+                    << " (" << e.peak << ")\n";
+        } else {
+          std::cout << e.ts_ns << "  " << rule.name << " back under after "
+                    << (e.ts_ns - e.since_ns) / 1'000'000 << " ms, " << e.samples
+                    << " samples, peak " << e.peak << "\n";
+        }
+      });
+
+  // tail_entry sees the flag within a poll interval. A second Ctrl-C gets the
+  // default action, for when the server does not answer at all.
+  std::signal(SIGINT, [](int) {
+    g_stop = true;
+    std::signal(SIGINT, SIG_DFL);
+  });
+  std::thread timer;
+  if (*duration_s > 0) {
+    timer = std::thread([&] {
+      const auto until = std::chrono::steady_clock::now() +
+                         std::chrono::duration<double>(*duration_s);
+      while (!g_stop && std::chrono::steady_clock::now() < until) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      }
+      g_stop = true;
+    });
+  }
+
+  const IBucket::QueryOptions options{
+      .ext = common::ImuSchema::select_ext(common::SelectFormat::kCsv)};
+  auto last_print = std::chrono::steady_clock::now();
+  auto err = common::tail_entry(
+      common::connect_source, CSV_ENTRY, options,
+      [&](const IBucket::ReadableRecord &rec) {
+        auto [res, r_err] = common::stream_csv(
+            rec, common::ImuSchema{}, true,
+            [&](const common::AccelerationData &row) { tail.push(row); },
+            [](size_t, std::string_view, common::CsvStatus) {});
+        const auto now = std::chrono::steady_clock::now();
+        if (now - last_print >= std::chrono::duration<double>(*every_s)) {
+          print_stats(tail);
+          last_print = now;
+        }
+        return r_err;
+      },
+      g_stop, tail_options);
+
+  g_stop = true;
+  if (timer.joinable()) timer.join();
+  if (err != Error::kOk) std::cerr << "Query failed: " << err.message << "\n";
+
+  std::cout << "\n=== Final window ===\n";
+  print_stats(tail);
+  common::profile::report();
+  return err == Error::kOk ? 0 : 1;
+}